@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2020
+Steward Observatory Engineering & Technical Services, University of Arizona
+
+This program and the accompanying materials are made available under the
+terms of the Eclipse Public License 2.0 which is available at
+http://www.eclipse.org/legal/epl-2.0.
+*/
+
+#include <stdlib.h>
+#include "alloc_count.h"
+
+static alloc_count_t counts;
+
+#ifdef __GLIBC__
+// glibc supports replacing the allocator by defining these symbols in the
+// program; the originals stay reachable under their __libc_ names.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size){
+  counts.allocations++;
+  counts.bytes += size;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size){
+  counts.allocations++;
+  counts.bytes += nmemb * size;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size){
+  counts.allocations++;
+  counts.bytes += size;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr){
+  if(ptr != NULL) counts.frees++;
+  __libc_free(ptr);
+}
+
+bool alloc_count_supported(void){
+  return true;
+}
+#else
+bool alloc_count_supported(void){
+  return false;
+}
+#endif
+
+void alloc_count_get(alloc_count_t *out){
+  *out = counts;
+}
@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2020
+Steward Observatory Engineering & Technical Services, University of Arizona
+
+This program and the accompanying materials are made available under the
+terms of the Eclipse Public License 2.0 which is available at
+http://www.eclipse.org/legal/epl-2.0.
+*/
+
+/*
+Process-wide heap allocation counters for the benchmark.
+
+On glibc the benchmark replaces malloc/calloc/realloc/free with thin wrappers
+that count calls and forward to the glibc allocator, so allocations made by
+nanopb, tahu.c (strdup, strndup, ...) and the C++ runtime are all counted.
+Elsewhere the counters stay at zero and alloc_count_supported() is false.
+*/
+#ifndef __ALLOC_COUNT_H__
+#define __ALLOC_COUNT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint64_t allocations; // number of malloc/calloc/realloc calls
+  uint64_t bytes; // bytes requested by those calls
+  uint64_t frees; // number of free calls with a non-NULL pointer
+} alloc_count_t;
+
+// true if the counters are live on this platform
+bool alloc_count_supported(void);
+
+// copy the current counters
+void alloc_count_get(alloc_count_t *counts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
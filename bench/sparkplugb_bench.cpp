@@ -0,0 +1,547 @@
+/*
+Copyright (c) 2020
+Steward Observatory Engineering & Technical Services, University of Arizona
+
+This program and the accompanying materials are made available under the
+terms of the Eclipse Public License 2.0 which is available at
+http://www.eclipse.org/legal/epl-2.0.
+*/
+
+/*
+Host-side benchmark for the sparkplugb_arduino library.
+
+Each payload in the corpus is built with the tahu.c helpers, then three
+operations are timed on it:
+  build  - tahu.c builders (get_next_payload, add_simple_metric, ...) + free
+  encode - sparkplugb_arduino_encoder::encode
+  birth  - sparkplugb_arduino_birth_cache::encode with the cache filled, the
+           cost of a rebirth: the metric fingerprint plus the few fields
+           written around the cached metrics
+  decode - sparkplugb_arduino_decoder::decode + free_payload
+
+Results are reported as ns/message, MB/s of encoded payload and heap
+allocations per message.
+
+Before timing, each payload's metrics are repeated up to
+SPARKPLUGB_PARALLEL_MIN_METRICS and encoded serially and on several
+threads, with and without omitted metric timestamps; the bytes must match.
+A DataSet with many columns and a metric with many properties are also
+decoded into a sparkplugb_arduino_pool at two sizes, and the byte pool use
+must grow linearly with them.
+
+usage: sparkplugb_bench [min_seconds_per_case] [corpus_name]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pb_encode.h"
+#include "sparkplugb_arduino.hpp"
+#include "alloc_count.h"
+extern "C" {
+#include "tahu.h"
+}
+
+#define BENCH_BUFFER_SIZE (4 * 1024 * 1024)
+static uint8_t bench_buffer[BENCH_BUFFER_SIZE];
+static uint8_t birth_buffer[BENCH_BUFFER_SIZE];
+
+//----------------------------------------------------------------------------//
+//                               Corpus
+//----------------------------------------------------------------------------//
+
+// DDATA with a handful of aliased scalar metrics, no names
+static int build_small_ddata(org_eclipse_tahu_protobuf_Payload* payload){
+  int32_t i32 = -1234;
+  float f = 21.5f;
+  bool b = true;
+  uint64_t u64 = 1234567890123ULL;
+
+  get_next_payload(payload);
+  add_simple_metric(payload, NULL, true, 1, METRIC_DATA_TYPE_INT32, false, false, &i32, sizeof(i32));
+  add_simple_metric(payload, NULL, true, 2, METRIC_DATA_TYPE_FLOAT, false, false, &f, sizeof(f));
+  add_simple_metric(payload, NULL, true, 3, METRIC_DATA_TYPE_BOOLEAN, false, false, &b, sizeof(b));
+  add_simple_metric(payload, NULL, true, 4, METRIC_DATA_TYPE_UINT64, false, false, &u64, sizeof(u64));
+  return 0;
+}
+
+// NBIRTH with 200 named metrics, each with properties and metadata
+static int build_large_nbirth(org_eclipse_tahu_protobuf_Payload* payload){
+  char name[64];
+  const char* units = "degC";
+  double value;
+  int i;
+
+  get_next_payload(payload);
+  for(i=0; i<200; i++){
+    org_eclipse_tahu_protobuf_Payload_Metric metric;
+    org_eclipse_tahu_protobuf_Payload_PropertySet properties = org_eclipse_tahu_protobuf_Payload_PropertySet_init_default;
+    org_eclipse_tahu_protobuf_Payload_MetaData metadata = org_eclipse_tahu_protobuf_Payload_MetaData_init_default;
+    int32_t low = -40;
+    int32_t high = 125;
+
+    value = i * 0.25;
+    snprintf(name, sizeof(name), "Node Control/Sensors/Temperature %03d", i);
+    if(init_metric(&metric, name, true, 100 + i, METRIC_DATA_TYPE_DOUBLE, false, false, &value, sizeof(value)) < 0)
+      return -1;
+    add_property_to_set(&properties, "engUnit", PROPERTY_DATA_TYPE_STRING, units, strlen(units));
+    add_property_to_set(&properties, "engLow", PROPERTY_DATA_TYPE_INT32, &low, sizeof(low));
+    add_property_to_set(&properties, "engHigh", PROPERTY_DATA_TYPE_INT32, &high, sizeof(high));
+    add_propertyset_to_metric(&metric, &properties);
+    metadata.description = strdup("thermocouple on the primary mirror cell");
+    metadata.has_seq = true;
+    metadata.seq = i;
+    add_metadata_to_metric(&metric, &metadata);
+    if(add_metric_to_payload(payload, &metric) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// one DataSet metric with 240 columns of mixed numeric types
+static int build_dataset_240(org_eclipse_tahu_protobuf_Payload* payload){
+  const int n_cols = 240;
+  const int n_rows = 16;
+  uint32_t datatypes[240];
+  const char* column_keys[240];
+  char key_bufs[240][16];
+  org_eclipse_tahu_protobuf_Payload_DataSet_Row rows[16];
+  org_eclipse_tahu_protobuf_Payload_DataSet dataset;
+  int r, c;
+
+  for(c=0; c<n_cols; c++){
+    snprintf(key_bufs[c], sizeof(key_bufs[c]), "col%d", c);
+    column_keys[c] = key_bufs[c];
+    datatypes[c] = (c % 3 == 0) ? DATA_SET_DATA_TYPE_INT32 :
+                   (c % 3 == 1) ? DATA_SET_DATA_TYPE_FLOAT : DATA_SET_DATA_TYPE_INT64;
+  }
+  for(r=0; r<n_rows; r++){
+    rows[r] = org_eclipse_tahu_protobuf_Payload_DataSet_Row_init_default;
+    rows[r].elements_count = n_cols;
+    rows[r].elements = (org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue*)
+        calloc(n_cols, sizeof(org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue));
+    if(rows[r].elements == NULL) return -1;
+    for(c=0; c<n_cols; c++){
+      org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue* v = &rows[r].elements[c];
+      if(datatypes[c] == DATA_SET_DATA_TYPE_INT32){
+        v->which_value = org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_int_value_tag;
+        v->value.int_value = (uint32_t)(r * c - 1000);
+      }
+      else if(datatypes[c] == DATA_SET_DATA_TYPE_FLOAT){
+        v->which_value = org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_float_value_tag;
+        v->value.float_value = r * 0.5f + c;
+      }
+      else{
+        v->which_value = org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_long_value_tag;
+        v->value.long_value = (uint64_t)r << 40 | c;
+      }
+    }
+  }
+  if(init_dataset(&dataset, n_rows, n_cols, datatypes, column_keys, rows) < 0)
+    return -1;
+
+  get_next_payload(payload);
+  return add_simple_metric(payload, "Mirror/Actuators", true, 1, METRIC_DATA_TYPE_DATASET,
+                           false, false, &dataset, sizeof(dataset));
+}
+
+// UDT definition plus 20 instances, each with member metrics and parameters
+static int build_templates(org_eclipse_tahu_protobuf_Payload* payload){
+  const int n_members = 8;
+  const int n_instances = 20;
+  char name[64];
+  int i, m;
+
+  get_next_payload(payload);
+  for(i=0; i<=n_instances; i++){
+    org_eclipse_tahu_protobuf_Payload_Template udt = org_eclipse_tahu_protobuf_Payload_Template_init_default;
+    org_eclipse_tahu_protobuf_Payload_Metric metric;
+
+    udt.version = strdup("v1.0");
+    udt.has_is_definition = true;
+    udt.is_definition = (i == 0);
+    if(i != 0) udt.template_ref = strdup("Motor");
+    udt.metrics_count = n_members;
+    udt.metrics = (org_eclipse_tahu_protobuf_Payload_Metric*)
+        calloc(n_members, sizeof(org_eclipse_tahu_protobuf_Payload_Metric));
+    udt.parameters_count = 1;
+    udt.parameters = (org_eclipse_tahu_protobuf_Payload_Template_Parameter*)
+        calloc(1, sizeof(org_eclipse_tahu_protobuf_Payload_Template_Parameter));
+    if(udt.metrics == NULL || udt.parameters == NULL) return -1;
+    for(m=0; m<n_members; m++){
+      float value = (float)(i * m);
+      snprintf(name, sizeof(name), "member%d", m);
+      init_metric(&udt.metrics[m], name, false, 0, METRIC_DATA_TYPE_FLOAT, false, false, &value, sizeof(value));
+    }
+    udt.parameters[0].name = strdup("Index");
+    udt.parameters[0].has_type = true;
+    udt.parameters[0].type = PARAMETER_DATA_TYPE_INT32;
+    udt.parameters[0].which_value = org_eclipse_tahu_protobuf_Payload_Template_Parameter_int_value_tag;
+    udt.parameters[0].value.int_value = i;
+
+    snprintf(name, sizeof(name), (i == 0) ? "_types_/Motor" : "Motors/Motor%d", i);
+    if(init_metric(&metric, name, true, 1000 + i, METRIC_DATA_TYPE_TEMPLATE, false, false, &udt, sizeof(udt)) < 0)
+      return -1;
+    if(add_metric_to_payload(payload, &metric) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// 100 string metrics with long names and values
+static int build_string_heavy(org_eclipse_tahu_protobuf_Payload* payload){
+  char name[96];
+  char value[160];
+  int i;
+
+  get_next_payload(payload);
+  for(i=0; i<100; i++){
+    snprintf(name, sizeof(name), "Observatory/Enclosure/Status/Messages/Subsystem %03d/Last Message", i);
+    snprintf(value, sizeof(value), "subsystem %03d reported nominal operation; "
+             "all interlocks closed, no faults latched since last reset", i);
+    add_simple_metric(payload, name, false, 0, METRIC_DATA_TYPE_STRING, false, false, value, strlen(value));
+  }
+  return 0;
+}
+
+typedef int (*build_fn)(org_eclipse_tahu_protobuf_Payload* payload);
+
+typedef struct {
+  const char* name;
+  build_fn build;
+} corpus_entry_t;
+
+static const corpus_entry_t corpus[] = {
+  {"small_ddata", build_small_ddata},
+  {"large_nbirth", build_large_nbirth},
+  {"dataset_240col", build_dataset_240},
+  {"templates", build_templates},
+  {"string_heavy", build_string_heavy},
+};
+
+//----------------------------------------------------------------------------//
+//                               Timing
+//----------------------------------------------------------------------------//
+static uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef struct {
+  const corpus_entry_t* entry;
+  org_eclipse_tahu_protobuf_Payload* payload; // built payload
+  const uint8_t* encoded; // encoded copy of payload
+  size_t encoded_length;
+  sparkplugb_arduino_encoder* encoder;
+  sparkplugb_arduino_birth_cache* birth;
+  sparkplugb_arduino_decoder* decoder;
+} bench_ctx_t;
+
+// run one operation once, return false on failure
+typedef bool (*op_fn)(bench_ctx_t* ctx);
+
+static bool op_build(bench_ctx_t* ctx){
+  org_eclipse_tahu_protobuf_Payload payload;
+  bool ok = (ctx->entry->build(&payload) >= 0);
+  free_payload(&payload);
+  return ok;
+}
+
+static bool op_encode(bench_ctx_t* ctx){
+  size_t n = ctx->encoder->encode(ctx->payload, bench_buffer, BENCH_BUFFER_SIZE);
+  return n == ctx->encoded_length;
+}
+
+static bool op_birth(bench_ctx_t* ctx){
+  size_t n = ctx->birth->encode(ctx->encoder, ctx->payload);
+  return n == ctx->encoded_length;
+}
+
+static bool op_decode(bench_ctx_t* ctx){
+  bool ok = ctx->decoder->decode(ctx->encoded, ctx->encoded_length);
+  ctx->decoder->free_payload();
+  return ok;
+}
+
+typedef struct {
+  const char* name;
+  op_fn run;
+} op_entry_t;
+
+static const op_entry_t ops[] = {
+  {"build", op_build},
+  {"encode", op_encode},
+  {"birth", op_birth},
+  {"decode", op_decode},
+};
+
+static bool run_case(bench_ctx_t* ctx, const op_entry_t* op, double min_seconds){
+  uint64_t iterations = 1;
+  uint64_t elapsed = 0;
+  uint64_t i, t0;
+  alloc_count_t before, after;
+
+  if(!op->run(ctx)) return false; // warm up & sanity check
+
+  // double the iteration count until the case runs long enough
+  while(true){
+    alloc_count_get(&before);
+    t0 = now_ns();
+    for(i=0; i<iterations; i++){
+      if(!op->run(ctx)) return false;
+    }
+    elapsed = now_ns() - t0;
+    alloc_count_get(&after);
+    if(elapsed >= (uint64_t)(min_seconds * 1e9) || iterations >= (1ULL << 30)) break;
+    iterations *= 2;
+  }
+
+  double ns_per_msg = (double)elapsed / iterations;
+  double mb_per_s = (ctx->encoded_length / 1e6) / (ns_per_msg / 1e9);
+  printf("%-16s %-8s %9zu %10llu %12.1f %10.2f",
+         ctx->entry->name, op->name, ctx->encoded_length,
+         (unsigned long long)iterations, ns_per_msg, mb_per_s);
+  if(alloc_count_supported()){
+    printf(" %10.1f %12.1f\n",
+           (double)(after.allocations - before.allocations) / iterations,
+           (double)(after.bytes - before.bytes) / iterations);
+  }
+  else{
+    printf(" %10s %12s\n", "n/a", "n/a");
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------------//
+//                               Checks
+//----------------------------------------------------------------------------//
+#define CHECK_ENCODE_THREADS 4
+
+// encode payload's metrics, repeated to reach the parallel encode threshold,
+// serially and on CHECK_ENCODE_THREADS threads; false if the bytes differ
+static bool check_parallel_encode(const char* name, const org_eclipse_tahu_protobuf_Payload* payload){
+  org_eclipse_tahu_protobuf_Payload large = *payload;
+  org_eclipse_tahu_protobuf_Payload_Metric* metrics;
+  sparkplugb_arduino_encoder serial, parallel;
+  uint8_t *serial_out, *parallel_out;
+  size_t copies, size, serial_length, parallel_length, i;
+  bool ok = true;
+  int omit;
+
+  if(payload->metrics_count == 0) return true;
+  copies = (SPARKPLUGB_PARALLEL_MIN_METRICS + payload->metrics_count - 1) / payload->metrics_count;
+  large.metrics_count = (pb_size_t)(copies * payload->metrics_count);
+  large.has_timestamp = true;
+  metrics = (org_eclipse_tahu_protobuf_Payload_Metric*)malloc(large.metrics_count * sizeof(*metrics));
+  if(metrics == NULL) return false;
+  // shallow copies, every other one with the payload timestamp so that
+  // omitted timestamps apply to half of them
+  for(i=0; i<large.metrics_count; i++){
+    metrics[i] = payload->metrics[i % payload->metrics_count];
+    metrics[i].has_timestamp = (i % 2 == 0);
+    metrics[i].timestamp = large.timestamp;
+  }
+  large.metrics = metrics;
+
+  if(!pb_get_encoded_size(&size, org_eclipse_tahu_protobuf_Payload_fields, &large)){
+    free(metrics);
+    return false;
+  }
+  serial_out = (uint8_t*)malloc(size);
+  parallel_out = (uint8_t*)malloc(size);
+  parallel.set_encode_threads(CHECK_ENCODE_THREADS);
+
+  for(omit=0; omit<2 && ok && serial_out != NULL && parallel_out != NULL; omit++){
+    serial.set_omit_metric_timestamps(omit);
+    parallel.set_omit_metric_timestamps(omit);
+    serial_length = serial.encode(&large, serial_out, size);
+    parallel_length = parallel.encode(&large, parallel_out, size);
+    if(serial_length == (size_t)-1 || serial_length != parallel_length ||
+       memcmp(serial_out, parallel_out, serial_length) != 0){
+      fprintf(stderr, "%s: parallel encode of %u metrics differs from serial (omit timestamps %d)\n",
+              name, (unsigned)large.metrics_count, omit);
+      ok = false;
+    }
+  }
+  if(serial_out == NULL || parallel_out == NULL) ok = false;
+
+  free(serial_out);
+  free(parallel_out);
+  free(metrics);
+  return ok;
+}
+
+#define CHECK_POOL_SMALL 64
+#define CHECK_POOL_LARGE 512
+#define CHECK_POOL_BYTES (256 * 1024)
+
+// one metric holding a DataSet of entries columns and one row, or with
+// entries properties
+static void build_wide_metric(org_eclipse_tahu_protobuf_Payload_Metric* metric, bool dataset, int entries,
+                              char (*names)[16], char** keys, uint32_t* types,
+                              org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue* cells,
+                              org_eclipse_tahu_protobuf_Payload_DataSet_Row* row,
+                              org_eclipse_tahu_protobuf_Payload_PropertyValue* values)
+{
+  org_eclipse_tahu_protobuf_Payload_DataSet* ds = &metric->value.dataset_value;
+  int i;
+
+  *metric = org_eclipse_tahu_protobuf_Payload_Metric_init_default;
+  metric->name = (char*)"Wide";
+  for(i=0; i<entries; i++){
+    snprintf(names[i], sizeof(names[i]), "entry%d", i);
+    keys[i] = names[i];
+    types[i] = DATA_SET_DATA_TYPE_INT32;
+    cells[i] = org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_init_default;
+    cells[i].which_value = org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_int_value_tag;
+    cells[i].value.int_value = i;
+    values[i] = org_eclipse_tahu_protobuf_Payload_PropertyValue_init_default;
+    values[i].has_type = true;
+    values[i].type = PROPERTY_DATA_TYPE_STRING;
+    values[i].which_value = org_eclipse_tahu_protobuf_Payload_PropertyValue_string_value_tag;
+    values[i].value.string_value = names[i];
+  }
+  if(dataset){
+    *row = org_eclipse_tahu_protobuf_Payload_DataSet_Row_init_default;
+    row->elements_count = entries;
+    row->elements = cells;
+    metric->has_datatype = true;
+    metric->datatype = METRIC_DATA_TYPE_DATASET;
+    metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag;
+    *ds = org_eclipse_tahu_protobuf_Payload_DataSet_init_default;
+    ds->has_num_of_columns = true;
+    ds->num_of_columns = entries;
+    ds->columns_count = entries;
+    ds->columns = keys;
+    ds->types_count = entries;
+    ds->types = types;
+    ds->rows_count = 1;
+    ds->rows = row;
+  }
+  else{
+    metric->has_properties = true;
+    metric->properties.keys_count = entries;
+    metric->properties.keys = keys;
+    metric->properties.values_count = entries;
+    metric->properties.values = values;
+  }
+}
+
+// byte pool use of decoding a wide metric, 0 on failure
+static size_t pool_bytes_for(bool dataset, int entries){
+  static char names[CHECK_POOL_LARGE][16];
+  static char* keys[CHECK_POOL_LARGE];
+  static uint32_t types[CHECK_POOL_LARGE];
+  static org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue cells[CHECK_POOL_LARGE];
+  static org_eclipse_tahu_protobuf_Payload_PropertyValue values[CHECK_POOL_LARGE];
+  static org_eclipse_tahu_protobuf_Payload_Metric pool_metrics[2];
+  static org_eclipse_tahu_protobuf_Payload_DataSet_Row pool_rows[2];
+  static org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue pool_cells[CHECK_POOL_LARGE];
+  static uint8_t pool_bytes[CHECK_POOL_BYTES];
+  org_eclipse_tahu_protobuf_Payload payload = org_eclipse_tahu_protobuf_Payload_init_default;
+  org_eclipse_tahu_protobuf_Payload_Metric metric;
+  org_eclipse_tahu_protobuf_Payload_DataSet_Row row;
+  sparkplugb_arduino_encoder encoder;
+  sparkplugb_arduino_decoder decoder;
+  sparkplugb_arduino_pool pool;
+  size_t length, used;
+
+  build_wide_metric(&metric, dataset, entries, names, keys, types, cells, &row, values);
+  payload.metrics_count = 1;
+  payload.metrics = &metric;
+  length = encoder.encode(&payload, bench_buffer, BENCH_BUFFER_SIZE);
+  if(length == (size_t)-1) return 0;
+
+  pool.init(pool_metrics, 2, pool_rows, 2, pool_cells, CHECK_POOL_LARGE, pool_bytes, sizeof(pool_bytes));
+  decoder.set_allocator(&pool.allocator);
+  used = decoder.decode(bench_buffer, length) ? pool.bytes_used() : 0;
+  decoder.free_payload();
+  return used;
+}
+
+// byte pool use must grow with the number of DataSet columns or properties,
+// not with its square as when every array entry moved the array
+static bool check_pool_growth(){
+  const char* names[2] = {"DataSet columns", "properties"};
+  size_t small, large;
+  bool ok = true;
+  int kind;
+
+  for(kind=0; kind<2; kind++){
+    small = pool_bytes_for(kind == 0, CHECK_POOL_SMALL);
+    large = pool_bytes_for(kind == 0, CHECK_POOL_LARGE);
+    // linear growth gives a ratio of about 8, allow some slack
+    if(small == 0 || large == 0 || large > small * (CHECK_POOL_LARGE / CHECK_POOL_SMALL) * 3 / 2){
+      fprintf(stderr, "static pool: %d %s take %zu bytes, %d take %zu\n",
+              CHECK_POOL_SMALL, names[kind], small, CHECK_POOL_LARGE, large);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+int main(int argc, char* argv[]){
+  double min_seconds = 0.25;
+  const char* only = NULL;
+  sparkplugb_arduino_encoder encoder;
+  sparkplugb_arduino_birth_cache birth;
+  sparkplugb_arduino_decoder decoder;
+  unsigned int c, o;
+  int failures = 0;
+
+  if(argc > 1) min_seconds = atof(argv[1]);
+  if(argc > 2) only = argv[2];
+
+  if(!check_pool_growth()) failures++;
+
+  printf("%-16s %-8s %9s %10s %12s %10s %10s %12s\n",
+         "payload", "op", "bytes", "iters", "ns/msg", "MB/s", "allocs/msg", "alloc B/msg");
+
+  for(c=0; c<sizeof(corpus)/sizeof(corpus[0]); c++){
+    org_eclipse_tahu_protobuf_Payload payload;
+    bench_ctx_t ctx;
+    ssize_t length;
+    uint8_t* encoded;
+
+    if(only != NULL && strcmp(only, corpus[c].name) != 0) continue;
+
+    if(corpus[c].build(&payload) < 0){
+      fprintf(stderr, "%s: failed to build payload\n", corpus[c].name);
+      failures++;
+      continue;
+    }
+    length = encode_payload(bench_buffer, BENCH_BUFFER_SIZE, &payload);
+    if(length < 0){
+      fprintf(stderr, "%s: failed to encode payload\n", corpus[c].name);
+      free_payload(&payload);
+      failures++;
+      continue;
+    }
+    if(!check_parallel_encode(corpus[c].name, &payload)) failures++;
+    encoded = (uint8_t*)malloc(length);
+    memcpy(encoded, bench_buffer, length);
+
+    ctx.entry = &corpus[c];
+    ctx.payload = &payload;
+    ctx.encoded = encoded;
+    ctx.encoded_length = length;
+    ctx.encoder = &encoder;
+    ctx.birth = &birth;
+    ctx.decoder = &decoder;
+    birth.begin(birth_buffer, sizeof(birth_buffer)); // filled by the warm up run
+
+    for(o=0; o<sizeof(ops)/sizeof(ops[0]); o++){
+      if(!run_case(&ctx, &ops[o], min_seconds)){
+        fprintf(stderr, "%s: %s failed\n", corpus[c].name, ops[o].name);
+        failures++;
+      }
+    }
+
+    free(encoded);
+    free_payload(&payload);
+  }
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,438 @@
+/*
+Copyright (c) 2020
+Steward Observatory Engineering & Technical Services, University of Arizona
+
+This program and the accompanying materials are made available under the
+terms of the Eclipse Public License 2.0 which is available at
+http://www.eclipse.org/legal/epl-2.0.
+*/
+
+/*
+End-to-end load test through the in-process stub broker (stub_broker.h).
+
+nodes threads each act as a Sparkplug edge node: they encode NDATA payloads
+with sparkplugb_arduino_encoder and publish them with sparkplugb_arduino_mqtt,
+as fast as the broker takes them. consumers threads subscribe to the nodes'
+topics (node i goes to consumer i % consumers, through a + wildcard) and
+decode every message with sparkplugb_arduino_decoder. Metric 0 of each
+payload carries its encode time, so each consumer measures the end-to-end
+latency, which includes the time a message spends batched in the client.
+
+Clients connect to the broker over loopback TCP ("tcp") or an in-memory
+socketpair ("mem"). Reported are the messages/s delivered and the latency
+percentiles. Without a rate the nodes saturate the broker and the latency is
+mostly queueing; with a rate (messages/s per node) each node flushes its
+client before waiting for the next message.
+
+usage: sparkplugb_loadgen [nodes] [consumers] [messages_per_node] [metrics] [mem|tcp] [rate] [port]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "sparkplugb_arduino.hpp"
+#include "stub_broker.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define LOADGEN_TX_SIZE (16 * 1024)
+#define LOADGEN_RX_SIZE (64 * 1024)
+#define LOADGEN_MAX_METRICS 256
+#define LOADGEN_IDLE_MS 5000 // a consumer gives up after this long without data
+
+typedef struct {
+  int index;
+  int fd;
+  int nodes; // nodes index, index + consumers, ... below nodes are ours
+  int consumers;
+  uint64_t expected; // messages this consumer should receive
+  uint64_t received;
+  uint64_t failures; // payloads that did not decode
+  uint64_t* latencies; // ns, one per message received
+  uint64_t last_ns; // receive time of the last message
+  bool ready; // own ready message came back, the subscriptions are live
+  sparkplugb_arduino_decoder decoder;
+} consumer_t;
+
+typedef struct {
+  int index;
+  int fd;
+  uint64_t messages;
+  uint32_t metrics;
+  double rate; // messages/s, 0 for as fast as possible
+  uint64_t failures; // publishes the client did not take
+} node_t;
+
+static int ready_count;
+static int start_flag;
+
+static uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//----------------------------------------------------------------------------//
+//                               Transport
+//----------------------------------------------------------------------------//
+
+static long fd_write(void* ctx, const uint8_t* data, size_t length){
+  ssize_t n = send(*(int*)ctx, data, length, MSG_NOSIGNAL);
+
+  if(n < 0) return (errno == EINTR) ? 0 : -1;
+  return (long)n;
+}
+
+static long fd_read(void* ctx, uint8_t* data, size_t length){
+  ssize_t n = recv(*(int*)ctx, data, length, MSG_DONTWAIT);
+
+  if(n == 0) return -1;
+  if(n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+  return (long)n;
+}
+
+// connection to the broker, over TCP if port is not 0
+static int broker_connect(stub_broker_t* broker, uint16_t port){
+  struct sockaddr_in address;
+  int one = 1;
+  int fd;
+
+  if(port == 0) return stub_broker_attach(broker);
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0) return -1;
+  if(connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0){
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+// wait for data from the broker, then let the client handle it
+static bool service(sparkplugb_arduino_mqtt* mqtt, int fd, int timeout_ms){
+  struct pollfd p;
+
+  p.fd = fd;
+  p.events = POLLIN;
+  p.revents = 0;
+  poll(&p, 1, timeout_ms);
+  return mqtt->loop(now_ns() / 1000000);
+}
+
+static bool mqtt_start(sparkplugb_arduino_mqtt* mqtt, int* fd, const char* client_id){
+  uint64_t start = now_ns();
+
+  mqtt->set_transport(fd_write, fd_read, fd);
+  mqtt->set_keep_alive(0);
+  if(!mqtt->connect(client_id, start / 1000000)) return false;
+  while(!mqtt->connected()){
+    if(!service(mqtt, *fd, 100) && mqtt->state() == SPARKPLUGB_MQTT_DISCONNECTED) return false;
+    if(now_ns() - start > SPARKPLUGB_MQTT_TIMEOUT_MS * 1000000ULL) return false;
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------------//
+//                               Consumers
+//----------------------------------------------------------------------------//
+
+static void on_message(void* ctx, const char* topic, size_t topic_length,
+                       const uint8_t* payload, size_t length){
+  consumer_t* c = (consumer_t*)ctx;
+  org_eclipse_tahu_protobuf_Payload* p = &c->decoder.payload;
+  uint64_t now = now_ns();
+
+  if(topic_length > 8 && memcmp(topic, "loadgen/", 8) == 0){
+    c->ready = true;
+    return;
+  }
+  if(!c->decoder.decode(payload, length)){
+    c->failures++;
+    return;
+  }
+  if(p->metrics_count > 0 && p->metrics[0].which_value ==
+     org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag)
+  {
+    if(c->received < c->expected) c->latencies[c->received] = now - p->metrics[0].value.long_value;
+  }
+  else{
+    c->failures++;
+  }
+  c->decoder.free_payload();
+  c->received++;
+  c->last_ns = now;
+}
+
+static void* run_consumer(void* arg){
+  consumer_t* c = (consumer_t*)arg;
+  sparkplugb_arduino_mqtt mqtt;
+  uint8_t tx[1024];
+  uint8_t* rx = (uint8_t*)malloc(LOADGEN_RX_SIZE);
+  char name[64];
+  char topic[64];
+  int i;
+
+  mqtt.begin(tx, sizeof(tx), rx, LOADGEN_RX_SIZE);
+  mqtt.set_callback(on_message, c);
+  snprintf(name, sizeof(name), "consumer%d", c->index);
+  if(!mqtt_start(&mqtt, &c->fd, name)){
+    fprintf(stderr, "%s: can not connect\n", name);
+    __atomic_fetch_add(&ready_count, 1, __ATOMIC_RELEASE);
+    free(rx);
+    return NULL;
+  }
+
+  // messages of every type from the nodes of this consumer, then a message
+  // to itself, which comes back once the broker has the subscriptions
+  for(i=c->index; i<c->nodes; i+=c->consumers){
+    snprintf(topic, sizeof(topic), "spBv1.0/load/+/node%d", i);
+    mqtt.subscribe(topic, 0);
+  }
+  snprintf(topic, sizeof(topic), "loadgen/%d", c->index);
+  mqtt.subscribe(topic, 0);
+  mqtt.publish(topic, (const uint8_t*)"", 0, false);
+  mqtt.flush();
+  while(!c->ready && service(&mqtt, c->fd, 100)){
+  }
+  __atomic_fetch_add(&ready_count, 1, __ATOMIC_RELEASE);
+
+  c->last_ns = now_ns();
+  while(c->received < c->expected){
+    if(!service(&mqtt, c->fd, 100)) break;
+    if(now_ns() - c->last_ns > LOADGEN_IDLE_MS * 1000000ULL) break;
+  }
+  mqtt.disconnect();
+  close(c->fd);
+  free(rx);
+  return NULL;
+}
+
+//----------------------------------------------------------------------------//
+//                               Edge nodes
+//----------------------------------------------------------------------------//
+
+static void* run_node(void* arg){
+  node_t* n = (node_t*)arg;
+  sparkplugb_arduino_mqtt mqtt;
+  sparkplugb_arduino_encoder encoder;
+  org_eclipse_tahu_protobuf_Payload payload = org_eclipse_tahu_protobuf_Payload_init_zero;
+  org_eclipse_tahu_protobuf_Payload_Metric metrics[LOADGEN_MAX_METRICS + 1];
+  uint8_t* tx = (uint8_t*)malloc(LOADGEN_TX_SIZE);
+  uint8_t rx[256];
+  char name[64];
+  char topic[64];
+  uint64_t m;
+  uint64_t start;
+  uint64_t deadline;
+  uint32_t i;
+
+  mqtt.begin(tx, LOADGEN_TX_SIZE, rx, sizeof(rx));
+  snprintf(name, sizeof(name), "node%d", n->index);
+  snprintf(topic, sizeof(topic), "spBv1.0/load/NDATA/node%d", n->index);
+  if(!mqtt_start(&mqtt, &n->fd, name)){
+    fprintf(stderr, "%s: can not connect\n", name);
+    n->failures = n->messages;
+    free(tx);
+    return NULL;
+  }
+
+  // metric 0 is the encode time, the rest are float readings
+  for(i=0; i<=n->metrics; i++){
+    metrics[i] = org_eclipse_tahu_protobuf_Payload_Metric_init_zero;
+    metrics[i].has_alias = true;
+    metrics[i].alias = i;
+    metrics[i].has_datatype = true;
+    metrics[i].datatype = (i == 0) ? METRIC_DATA_TYPE_UINT64 : METRIC_DATA_TYPE_FLOAT;
+    metrics[i].which_value = (i == 0) ? org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag
+                                      : org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag;
+  }
+  encoder.set_payload(&payload);
+  encoder.set_metrics(metrics, n->metrics + 1);
+  payload.has_seq = true;
+  payload.has_timestamp = true;
+
+  while(!__atomic_load_n(&start_flag, __ATOMIC_ACQUIRE)){
+    usleep(1000);
+  }
+  start = now_ns();
+  for(m=0; m<n->messages; m++){
+    if(n->rate > 0){
+      deadline = start + (uint64_t)(m * 1e9 / n->rate);
+      if(now_ns() < deadline){
+        mqtt.flush(); // nothing else is coming before the deadline
+        while(now_ns() < deadline) usleep(50);
+      }
+    }
+    for(i=1; i<=n->metrics; i++) metrics[i].value.float_value = (float)(m + i);
+    payload.seq = m % 256;
+    payload.timestamp = now_ns() / 1000000;
+    metrics[0].value.long_value = now_ns();
+    if(!mqtt.publish(&encoder, topic)){
+      // the transmit buffer would not drain, give the broker a moment
+      if(!service(&mqtt, n->fd, 1) || !mqtt.publish(&encoder, topic)) n->failures++;
+    }
+    // pick up anything the broker sent, without waiting for it
+    if((m & 63) == 63 && !mqtt.loop(now_ns() / 1000000)) break;
+  }
+  mqtt.flush();
+  mqtt.disconnect();
+  close(n->fd);
+  free(tx);
+  return NULL;
+}
+
+//----------------------------------------------------------------------------//
+//                               Report
+//----------------------------------------------------------------------------//
+
+static int compare_u64(const void* a, const void* b){
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t* sorted, uint64_t count, double p){
+  uint64_t i;
+
+  if(count == 0) return 0;
+  i = (uint64_t)(p * (count - 1));
+  return sorted[i] / 1e3;
+}
+
+int main(int argc, char* argv[]){
+  int nodes = 4;
+  int consumers = 2;
+  uint64_t messages = 20000;
+  uint32_t metrics = 10;
+  bool tcp = false;
+  double rate = 0;
+  uint16_t port = 18830;
+  stub_broker_t* broker;
+  stub_broker_stats_t stats;
+  pthread_t* node_threads;
+  pthread_t* consumer_threads;
+  node_t* node_state;
+  consumer_t* consumer_state;
+  uint64_t* all;
+  uint64_t total = 0;
+  uint64_t expected = 0;
+  uint64_t failures = 0;
+  uint64_t start, end = 0;
+  int i;
+
+  if(argc > 1) nodes = atoi(argv[1]);
+  if(argc > 2) consumers = atoi(argv[2]);
+  if(argc > 3) messages = strtoull(argv[3], NULL, 10);
+  if(argc > 4) metrics = atoi(argv[4]);
+  if(argc > 5) tcp = strcmp(argv[5], "tcp") == 0;
+  if(argc > 6) rate = atof(argv[6]);
+  if(argc > 7) port = atoi(argv[7]);
+  if(nodes < 1 || consumers < 1 || messages < 1 || metrics > LOADGEN_MAX_METRICS){
+    printf("usage: %s [nodes] [consumers] [messages_per_node] [metrics] [mem|tcp] [rate] [port]\n", argv[0]);
+    return 1;
+  }
+  if(!tcp) port = 0;
+
+  broker = stub_broker_start(port);
+  if(broker == NULL){
+    fprintf(stderr, "can not start the broker\n");
+    return 1;
+  }
+  node_threads = (pthread_t*)calloc(nodes, sizeof(pthread_t));
+  consumer_threads = (pthread_t*)calloc(consumers, sizeof(pthread_t));
+  node_state = (node_t*)calloc(nodes, sizeof(node_t));
+  consumer_state = new consumer_t[consumers];
+  printf("%d nodes -> %d consumers over %s, %llu messages per node, %u metrics",
+         nodes, consumers, tcp ? "loopback TCP" : "in-memory connections",
+         (unsigned long long)messages, metrics);
+  if(rate > 0) printf(", %.0f msg/s per node", rate);
+  printf("\n");
+
+  for(i=0; i<consumers; i++){
+    consumer_t* c = &consumer_state[i];
+    c->index = i;
+    c->nodes = nodes;
+    c->consumers = consumers;
+    c->received = 0;
+    c->failures = 0;
+    c->ready = false;
+    c->expected = messages * ((nodes - i + consumers - 1) / consumers);
+    c->latencies = (uint64_t*)malloc((c->expected + 1) * sizeof(uint64_t));
+    c->fd = broker_connect(broker, port);
+    expected += c->expected;
+  }
+  for(i=0; i<nodes; i++){
+    node_state[i].index = i;
+    node_state[i].messages = messages;
+    node_state[i].metrics = metrics;
+    node_state[i].rate = rate;
+    node_state[i].fd = broker_connect(broker, port);
+  }
+  for(i=0; i<consumers; i++) pthread_create(&consumer_threads[i], NULL, run_consumer, &consumer_state[i]);
+  for(i=0; i<nodes; i++) pthread_create(&node_threads[i], NULL, run_node, &node_state[i]);
+
+  while(__atomic_load_n(&ready_count, __ATOMIC_ACQUIRE) < consumers){
+    usleep(1000);
+  }
+  start = now_ns();
+  __atomic_store_n(&start_flag, 1, __ATOMIC_RELEASE);
+  for(i=0; i<nodes; i++){
+    pthread_join(node_threads[i], NULL);
+    failures += node_state[i].failures;
+  }
+  for(i=0; i<consumers; i++){
+    pthread_join(consumer_threads[i], NULL);
+    total += consumer_state[i].received;
+    failures += consumer_state[i].failures;
+    if(consumer_state[i].last_ns > end) end = consumer_state[i].last_ns;
+  }
+  stub_broker_get_stats(broker, &stats);
+  stub_broker_stop(broker);
+
+  // one latency array across every consumer
+  all = (uint64_t*)malloc((total + 1) * sizeof(uint64_t));
+  total = 0;
+  for(i=0; i<consumers; i++){
+    uint64_t n = consumer_state[i].received;
+    if(n > consumer_state[i].expected) n = consumer_state[i].expected;
+    memcpy(all + total, consumer_state[i].latencies, n * sizeof(uint64_t));
+    total += n;
+    free(consumer_state[i].latencies);
+  }
+  qsort(all, total, sizeof(uint64_t), compare_u64);
+
+  printf("%-12s %12s %10s %10s %10s %10s %10s %10s\n", "received", "msg/s", "MB/s",
+         "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+  printf("%-12llu %12.0f %10.2f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+         (unsigned long long)total, end > start ? total * 1e9 / (end - start) : 0.0,
+         end > start ? stats.bytes_out * 1e3 / (end - start) : 0.0,
+         percentile_us(all, total, 0.5), percentile_us(all, total, 0.9),
+         percentile_us(all, total, 0.99), percentile_us(all, total, 0.999),
+         total ? all[total - 1] / 1e3 : 0.0);
+  if(total != expected || failures != 0){
+    printf("expected %llu messages, %llu failures\n",
+           (unsigned long long)expected, (unsigned long long)failures);
+  }
+
+  free(all);
+  free(node_threads);
+  free(consumer_threads);
+  free(node_state);
+  delete[] consumer_state;
+  return (total == expected && failures == 0) ? 0 : 1;
+}
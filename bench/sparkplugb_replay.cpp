@@ -0,0 +1,131 @@
+/*
+Copyright (c) 2020
+Steward Observatory Engineering & Technical Services, University of Arizona
+
+This program and the accompanying materials are made available under the
+terms of the Eclipse Public License 2.0 which is available at
+http://www.eclipse.org/legal/epl-2.0.
+*/
+
+/*
+Replays a payload log (tahu/payload_log.h) through sparkplugb_arduino_decoder.
+
+By default records are decoded back to back as fast as possible, and the log
+is replayed repeat times; the decode rate is reported as ns/message and MB/s.
+With a speed the records are decoded at their recorded pace (2 = twice as
+fast) and the worst lag behind that schedule is reported as well.
+
+usage: sparkplugb_replay log_file [speed] [repeat]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sparkplugb_arduino.hpp"
+#include "alloc_count.h"
+#include "payload_log.h"
+
+static uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline){
+  struct timespec ts;
+  uint64_t now = now_ns();
+
+  if(deadline <= now) return;
+  ts.tv_sec = (deadline - now) / 1000000000ULL;
+  ts.tv_nsec = (deadline - now) % 1000000000ULL;
+  nanosleep(&ts, NULL);
+}
+
+int main(int argc, char* argv[]){
+  payload_log_reader_t reader;
+  payload_log_record_t record;
+  sparkplugb_arduino_decoder decoder;
+  alloc_count_t before, after;
+  double speed = 0;
+  long repeat = 1;
+  long r;
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+  uint64_t failures = 0;
+  uint64_t first_record = 0;
+  uint64_t start, elapsed, deadline, t0;
+  uint64_t pass_start = 0;
+  uint64_t decode_ns = 0;
+  bool first;
+  uint64_t max_lag = 0;
+  int result;
+
+  if(argc < 2){
+    printf("usage: %s log_file [speed] [repeat]\n", argv[0]);
+    return 1;
+  }
+  if(argc > 2) speed = atof(argv[2]);
+  if(argc > 3) repeat = atol(argv[3]);
+  if(repeat < 1) repeat = 1;
+
+  if(payload_log_open(&reader, argv[1]) != 0){
+    fprintf(stderr, "can not read payload log %s\n", argv[1]);
+    return 1;
+  }
+  printf("%s: %llu records, %zu bytes\n", argv[1],
+         (unsigned long long)reader.record_count, reader.end);
+
+  alloc_count_get(&before);
+  start = now_ns();
+  for(r=0; r<repeat; r++){
+    payload_log_rewind(&reader);
+    first = true;
+    while((result = payload_log_next(&reader, &record)) == 1){
+      if(speed > 0){
+        if(first){
+          pass_start = now_ns();
+          first_record = record.timestamp;
+          first = false;
+        }
+        deadline = pass_start + (uint64_t)((record.timestamp - first_record) / speed);
+        sleep_until(deadline);
+        t0 = now_ns();
+        if(t0 > deadline && t0 - deadline > max_lag) max_lag = t0 - deadline;
+        if(!decoder.decode(record.payload, record.payload_length)) failures++;
+        decoder.free_payload();
+        decode_ns += now_ns() - t0;
+      }
+      else{
+        if(!decoder.decode(record.payload, record.payload_length)) failures++;
+        decoder.free_payload();
+      }
+      messages++;
+      bytes += record.payload_length;
+    }
+    if(result < 0){
+      fprintf(stderr, "payload log is corrupt at offset %zu\n", reader.position);
+      break;
+    }
+  }
+  elapsed = now_ns() - start;
+  // paced runs mostly sleep, only count the time spent decoding
+  if(speed > 0) elapsed = decode_ns;
+  alloc_count_get(&after);
+  payload_log_release(&reader);
+
+  if(messages == 0 || elapsed == 0){
+    printf("no payloads replayed\n");
+    return 1;
+  }
+  printf("%-12s %12s %10s %12s %12s\n", "messages", "ns/msg", "MB/s", "allocs/msg", "failures");
+  printf("%-12llu %12.1f %10.2f", (unsigned long long)messages,
+         (double)elapsed / messages, bytes * 1e3 / elapsed);
+  if(alloc_count_supported())
+    printf(" %12.1f", (double)(after.allocations - before.allocations) / messages);
+  else
+    printf(" %12s", "n/a");
+  printf(" %12llu\n", (unsigned long long)failures);
+  if(speed > 0)
+    printf("worst lag behind recorded pace: %.3f ms\n", max_lag / 1e6);
+  return 0;
+}
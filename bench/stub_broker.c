@@ -0,0 +1,747 @@
+/*
+Copyright (c) 2020
+Steward Observatory Engineering & Technical Services, University of Arizona
+
+This program and the accompanying materials are made available under the
+terms of the Eclipse Public License 2.0 which is available at
+http://www.eclipse.org/legal/epl-2.0.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "stub_broker.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// MQTT 3.1.1 control packet types, high nibble of the first byte
+#define MQTT_CONNECT 1
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_PUBREC 5
+#define MQTT_PUBREL 6
+#define MQTT_SUBSCRIBE 8
+#define MQTT_UNSUBSCRIBE 10
+#define MQTT_PINGREQ 12
+#define MQTT_DISCONNECT 14
+
+#define READ_CHUNK 65536
+
+typedef struct {
+  char *filter;
+  size_t length;
+  uint8_t qos;
+} subscription_t;
+
+typedef struct {
+  int fd;
+  uint8_t *in; // received bytes not handled yet
+  size_t in_used;
+  size_t in_size;
+  uint8_t *out; // bytes to write are out[out_start..out_used)
+  size_t out_start;
+  size_t out_used;
+  size_t out_size;
+  subscription_t *subs;
+  size_t subs_count;
+  size_t subs_size;
+  char *will_topic;
+  size_t will_topic_length;
+  uint8_t *will_payload;
+  size_t will_length;
+  uint8_t will_qos;
+  uint16_t packet_id; // last id used to deliver QoS 1
+  int connected; // CONNECT received
+  int closing;
+} connection_t;
+
+struct stub_broker {
+  pthread_t thread;
+  int listen_fd;
+  uint16_t port;
+  int wake[2]; // wakes poll() for stub_broker_attach() and stub_broker_stop()
+  int stop;
+  pthread_mutex_t lock; // guards attached
+  int *attached; // in-memory connections not served yet
+  size_t attached_count;
+  size_t attached_size;
+  connection_t **connections;
+  size_t count;
+  size_t size;
+  stub_broker_stats_t stats;
+};
+
+//----------------------------------------------------------------------------//
+//                               Buffers
+//----------------------------------------------------------------------------//
+
+// make room for length more bytes in a growable array
+static int reserve(void **data, size_t *size, size_t used, size_t length, size_t item){
+  size_t n = *size ? *size : 16;
+  void *p;
+
+  if(used + length <= *size){
+    return 0;
+  }
+  while(n < used + length){
+    n *= 2;
+  }
+  p = realloc(*data, n * item);
+  if(p == NULL){
+    return -1;
+  }
+  *data = p;
+  *size = n;
+  return 0;
+}
+
+// reserve space for length bytes at the end of the output, NULL on failure
+static uint8_t *out_space(connection_t *c, size_t length){
+  if(c->out_start > 0 && c->out_used + length > c->out_size){
+    memmove(c->out, c->out + c->out_start, c->out_used - c->out_start);
+    c->out_used -= c->out_start;
+    c->out_start = 0;
+  }
+  if(reserve((void **)&c->out, &c->out_size, c->out_used, length, 1) != 0){
+    c->closing = 1;
+    return NULL;
+  }
+  c->out_used += length;
+  return c->out + c->out_used - length;
+}
+
+static size_t put_header(uint8_t *p, uint8_t type, size_t length){
+  size_t n = 0;
+
+  p[n++] = type;
+  do{
+    p[n] = (uint8_t)(length & 0x7F);
+    length >>= 7;
+    if(length > 0){
+      p[n] |= 0x80;
+    }
+    n++;
+  }while(length > 0);
+  return n;
+}
+
+static size_t header_size(size_t length){
+  return 1 + (length < 128 ? 1 : length < 16384 ? 2 : length < 2097152 ? 3 : 4);
+}
+
+// queue a packet holding only a packet id, e.g. PUBACK
+static void send_ack(connection_t *c, uint8_t type, const uint8_t *id){
+  uint8_t *p = out_space(c, 4);
+
+  if(p != NULL){
+    p[0] = type;
+    p[1] = 2;
+    p[2] = id[0];
+    p[3] = id[1];
+  }
+}
+
+//----------------------------------------------------------------------------//
+//                               Routing
+//----------------------------------------------------------------------------//
+
+int stub_broker_topic_matches(const char *filter, size_t filter_length,
+                              const char *topic, size_t topic_length){
+  size_t f = 0;
+  size_t t = 0;
+
+  // topics starting with $ are not matched by a leading wildcard
+  if(topic_length > 0 && topic[0] == '$' && filter_length > 0 &&
+      (filter[0] == '+' || filter[0] == '#')){
+    return 0;
+  }
+  while(f < filter_length){
+    if(filter[f] == '#'){
+      return 1; // the rest of the levels, or the parent level itself
+    }
+    if(filter[f] == '+'){
+      while(t < topic_length && topic[t] != '/'){
+        t++;
+      }
+      f++;
+    }
+    else{
+      while(f < filter_length && t < topic_length && filter[f] != '/' && filter[f] == topic[t]){
+        f++;
+        t++;
+      }
+      if(f < filter_length && filter[f] != '/'){
+        return 0;
+      }
+      if(t < topic_length && topic[t] != '/'){
+        return 0;
+      }
+    }
+    // both are at the end of a level
+    if(f == filter_length){
+      return t == topic_length;
+    }
+    if(t == topic_length){
+      // "a/#" also matches "a"
+      return f + 2 == filter_length && filter[f + 1] == '#';
+    }
+    f++;
+    t++;
+  }
+  return t == topic_length;
+}
+
+// queue a PUBLISH to every client with a matching subscription
+static void route(stub_broker_t *broker, const uint8_t *topic, size_t topic_length,
+                  const uint8_t *payload, size_t length, uint8_t qos){
+  connection_t *c;
+  size_t remaining;
+  size_t i, j;
+  uint8_t *p;
+  int best;
+
+  for(i=0; i<broker->count; i++){
+    c = broker->connections[i];
+    if(!c->connected || c->closing){
+      continue;
+    }
+    best = -1;
+    for(j=0; j<c->subs_count; j++){
+      if(c->subs[j].qos > best &&
+          stub_broker_topic_matches(c->subs[j].filter, c->subs[j].length,
+                                    (const char *)topic, topic_length)){
+        best = c->subs[j].qos;
+      }
+    }
+    if(best < 0){
+      continue;
+    }
+    if(best > qos){
+      best = qos;
+    }
+    remaining = 2 + topic_length + (best > 0 ? 2 : 0) + length;
+    p = out_space(c, header_size(remaining) + remaining);
+    if(p == NULL){
+      continue;
+    }
+    p += put_header(p, (MQTT_PUBLISH << 4) | (best << 1), remaining);
+    *p++ = (uint8_t)(topic_length >> 8);
+    *p++ = (uint8_t)topic_length;
+    memcpy(p, topic, topic_length);
+    p += topic_length;
+    if(best > 0){
+      if(++c->packet_id == 0){
+        c->packet_id = 1;
+      }
+      *p++ = (uint8_t)(c->packet_id >> 8);
+      *p++ = (uint8_t)c->packet_id;
+    }
+    memcpy(p, payload, length);
+    __atomic_fetch_add(&broker->stats.delivered, 1, __ATOMIC_RELAXED);
+  }
+}
+
+//----------------------------------------------------------------------------//
+//                               Packets
+//----------------------------------------------------------------------------//
+
+// read a length-prefixed string at *offset, NULL if it runs past the end
+static const uint8_t *get_string(const uint8_t *body, size_t length, size_t *offset, size_t *string_length){
+  const uint8_t *s;
+
+  if(*offset + 2 > length){
+    return NULL;
+  }
+  *string_length = ((size_t)body[*offset] << 8) | body[*offset + 1];
+  if(*offset + 2 + *string_length > length){
+    return NULL;
+  }
+  s = body + *offset + 2;
+  *offset += 2 + *string_length;
+  return s;
+}
+
+static int handle_connect(connection_t *c, const uint8_t *body, size_t length){
+  const uint8_t *s;
+  size_t offset = 0;
+  size_t n;
+  uint8_t flags;
+  uint8_t *p;
+
+  s = get_string(body, length, &offset, &n);
+  if(s == NULL || n != 4 || memcmp(s, "MQTT", 4) != 0 || offset + 4 > length){
+    return -1;
+  }
+  flags = body[offset + 1];
+  offset += 4; // level, flags, keep alive
+  if(get_string(body, length, &offset, &n) == NULL){
+    return -1; // client id
+  }
+  if(flags & 0x04){
+    s = get_string(body, length, &offset, &n);
+    if(s == NULL || (c->will_topic = malloc(n + 1)) == NULL){
+      return -1;
+    }
+    memcpy(c->will_topic, s, n);
+    c->will_topic_length = n;
+    s = get_string(body, length, &offset, &n);
+    if(s == NULL || (c->will_payload = malloc(n + 1)) == NULL){
+      return -1;
+    }
+    memcpy(c->will_payload, s, n);
+    c->will_length = n;
+    c->will_qos = (flags >> 3) & 0x03;
+  }
+  c->connected = 1;
+  p = out_space(c, 4);
+  if(p != NULL){
+    memcpy(p, "\x20\x02\x00\x00", 4); // CONNACK, accepted
+  }
+  return 0;
+}
+
+static int handle_publish(stub_broker_t *broker, connection_t *c, uint8_t type,
+                          const uint8_t *body, size_t length){
+  uint8_t qos = (type >> 1) & 0x03;
+  const uint8_t *topic;
+  size_t topic_length;
+  size_t offset = 0;
+
+  topic = get_string(body, length, &offset, &topic_length);
+  if(topic == NULL || qos > 2 || offset + (qos > 0 ? 2 : 0) > length){
+    return -1;
+  }
+  if(qos > 0){
+    send_ack(c, (qos == 1 ? MQTT_PUBACK : MQTT_PUBREC) << 4, body + offset);
+    offset += 2;
+  }
+  __atomic_fetch_add(&broker->stats.received, 1, __ATOMIC_RELAXED);
+  route(broker, topic, topic_length, body + offset, length - offset, qos > 1 ? 1 : qos);
+  return 0;
+}
+
+static int handle_subscribe(connection_t *c, const uint8_t *body, size_t length, int subscribe){
+  const uint8_t *filter;
+  size_t offset = 2;
+  size_t n;
+  size_t i;
+  size_t granted = 0;
+  uint8_t qos[64];
+  uint8_t *p;
+  subscription_t *s;
+
+  if(length < 2){
+    return -1;
+  }
+  while(offset < length){
+    filter = get_string(body, length, &offset, &n);
+    if(filter == NULL || (subscribe && offset >= length) || granted == sizeof(qos)){
+      return -1;
+    }
+    // drop an existing subscription to the same filter
+    for(i=0; i<c->subs_count; i++){
+      if(c->subs[i].length == n && memcmp(c->subs[i].filter, filter, n) == 0){
+        free(c->subs[i].filter);
+        c->subs[i] = c->subs[--c->subs_count];
+        break;
+      }
+    }
+    if(subscribe){
+      if(reserve((void **)&c->subs, &c->subs_size, c->subs_count, 1, sizeof(*s)) != 0){
+        return -1;
+      }
+      s = &c->subs[c->subs_count];
+      s->filter = malloc(n + 1);
+      if(s->filter == NULL){
+        return -1;
+      }
+      memcpy(s->filter, filter, n);
+      s->length = n;
+      s->qos = body[offset++] > 0 ? 1 : 0;
+      qos[granted++] = s->qos;
+      c->subs_count++;
+    }
+  }
+  if(!subscribe){
+    send_ack(c, 0xB0, body); // UNSUBACK
+    return 0;
+  }
+  p = out_space(c, header_size(2 + granted) + 2 + granted);
+  if(p != NULL){
+    p += put_header(p, 0x90, 2 + granted); // SUBACK
+    *p++ = body[0];
+    *p++ = body[1];
+    memcpy(p, qos, granted);
+  }
+  return 0;
+}
+
+static int handle(stub_broker_t *broker, connection_t *c, uint8_t type, const uint8_t *body, size_t length){
+  uint8_t *p;
+
+  if(!c->connected && (type >> 4) != MQTT_CONNECT){
+    return -1;
+  }
+  switch(type >> 4){
+    case MQTT_CONNECT:
+      return c->connected ? -1 : handle_connect(c, body, length);
+    case MQTT_PUBLISH:
+      return handle_publish(broker, c, type, body, length);
+    case MQTT_PUBREL:
+      if(length >= 2){
+        send_ack(c, 0x70, body); // PUBCOMP
+      }
+      return 0;
+    case MQTT_SUBSCRIBE:
+      return handle_subscribe(c, body, length, 1);
+    case MQTT_UNSUBSCRIBE:
+      return handle_subscribe(c, body, length, 0);
+    case MQTT_PINGREQ:
+      p = out_space(c, 2);
+      if(p != NULL){
+        p[0] = 0xD0; // PINGRESP
+        p[1] = 0;
+      }
+      return 0;
+    case MQTT_DISCONNECT:
+      free(c->will_topic);
+      c->will_topic = NULL;
+      c->closing = 1;
+      return 0;
+    default:
+      return 0; // PUBACK, PUBCOMP, ... from subscribers
+  }
+}
+
+// handle every complete packet in the input
+static int handle_input(stub_broker_t *broker, connection_t *c){
+  size_t position = 0;
+  size_t length;
+  size_t header;
+  size_t shift;
+  int complete;
+
+  while(position < c->in_used && !c->closing){
+    length = 0;
+    header = 1;
+    shift = 0;
+    complete = 0;
+    while(position + header < c->in_used && header <= 4){
+      length |= (size_t)(c->in[position + header] & 0x7F) << shift;
+      shift += 7;
+      if((c->in[position + header++] & 0x80) == 0){
+        complete = 1;
+        break;
+      }
+    }
+    if(!complete){
+      if(header > 4){
+        return -1; // malformed remaining length
+      }
+      break;
+    }
+    if(position + header + length > c->in_used){
+      break;
+    }
+    if(handle(broker, c, c->in[position], c->in + position + header, length) != 0){
+      return -1;
+    }
+    position += header + length;
+  }
+  c->in_used -= position;
+  memmove(c->in, c->in + position, c->in_used);
+  return 0;
+}
+
+//----------------------------------------------------------------------------//
+//                               Connections
+//----------------------------------------------------------------------------//
+
+static int add_connection(stub_broker_t *broker, int fd){
+  connection_t *c;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  if(reserve((void **)&broker->connections, &broker->size, broker->count, 1, sizeof(c)) != 0 ||
+      (c = calloc(1, sizeof(*c))) == NULL){
+    close(fd);
+    return -1;
+  }
+  c->fd = fd;
+  broker->connections[broker->count++] = c;
+  return 0;
+}
+
+static void free_connection(connection_t *c){
+  size_t i;
+
+  close(c->fd);
+  for(i=0; i<c->subs_count; i++){
+    free(c->subs[i].filter);
+  }
+  free(c->subs);
+  free(c->in);
+  free(c->out);
+  free(c->will_topic);
+  free(c->will_payload);
+  free(c);
+}
+
+// drop closed connections, publishing the will of those that did not disconnect
+static void remove_closed(stub_broker_t *broker){
+  connection_t *c;
+  size_t i = 0;
+
+  while(i < broker->count){
+    c = broker->connections[i];
+    if(!c->closing){
+      i++;
+      continue;
+    }
+    broker->connections[i] = broker->connections[--broker->count];
+    if(c->will_topic != NULL){
+      route(broker, (const uint8_t *)c->will_topic, c->will_topic_length,
+            c->will_payload, c->will_length, c->will_qos > 1 ? 1 : c->will_qos);
+    }
+    free_connection(c);
+  }
+}
+
+static void read_connection(stub_broker_t *broker, connection_t *c){
+  ssize_t n;
+
+  if(reserve((void **)&c->in, &c->in_size, c->in_used, READ_CHUNK, 1) != 0){
+    c->closing = 1;
+    return;
+  }
+  n = recv(c->fd, c->in + c->in_used, READ_CHUNK, 0);
+  if(n <= 0){
+    if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+      c->closing = 1;
+    }
+    return;
+  }
+  c->in_used += n;
+  __atomic_fetch_add(&broker->stats.bytes_in, n, __ATOMIC_RELAXED);
+  if(handle_input(broker, c) != 0){
+    c->closing = 1;
+  }
+}
+
+static void write_connection(stub_broker_t *broker, connection_t *c){
+  ssize_t n;
+
+  while(c->out_start < c->out_used){
+    n = send(c->fd, c->out + c->out_start, c->out_used - c->out_start, MSG_NOSIGNAL);
+    if(n < 0){
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        c->closing = 1;
+      }
+      return;
+    }
+    c->out_start += n;
+    __atomic_fetch_add(&broker->stats.bytes_out, n, __ATOMIC_RELAXED);
+  }
+  c->out_start = 0;
+  c->out_used = 0;
+}
+
+static void take_attached(stub_broker_t *broker){
+  char drain[64];
+  size_t i;
+
+  while(read(broker->wake[0], drain, sizeof(drain)) > 0){
+  }
+  pthread_mutex_lock(&broker->lock);
+  for(i=0; i<broker->attached_count; i++){
+    add_connection(broker, broker->attached[i]);
+  }
+  broker->attached_count = 0;
+  pthread_mutex_unlock(&broker->lock);
+}
+
+static void *serve(void *arg){
+  stub_broker_t *broker = arg;
+  struct pollfd *fds = NULL;
+  size_t fds_size = 0;
+  size_t count;
+  size_t first;
+  size_t i;
+  int blocked;
+  int fd;
+  int one = 1;
+
+  while(!__atomic_load_n(&broker->stop, __ATOMIC_ACQUIRE)){
+    // stop reading while a slow subscriber has too much queued
+    blocked = 0;
+    for(i=0; i<broker->count; i++){
+      if(broker->connections[i]->out_used - broker->connections[i]->out_start > STUB_BROKER_HIGH_WATER){
+        blocked = 1;
+      }
+    }
+
+    count = broker->count;
+    if(reserve((void **)&fds, &fds_size, 0, count + 2, sizeof(*fds)) != 0){
+      break;
+    }
+    fds[0].fd = broker->wake[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = broker->listen_fd;
+    fds[1].events = POLLIN;
+    first = 2;
+    for(i=0; i<count; i++){
+      fds[first + i].fd = broker->connections[i]->fd;
+      fds[first + i].events = (blocked ? 0 : POLLIN) |
+        (broker->connections[i]->out_used > broker->connections[i]->out_start ? POLLOUT : 0);
+    }
+    if(poll(fds, first + count, 100) < 0){
+      continue;
+    }
+
+    if(fds[0].revents){
+      take_attached(broker);
+    }
+    if(broker->listen_fd >= 0 && (fds[1].revents & POLLIN)){
+      fd = accept(broker->listen_fd, NULL, NULL);
+      if(fd >= 0){
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        add_connection(broker, fd);
+      }
+    }
+    for(i=0; i<count; i++){
+      if(fds[first + i].revents & (POLLIN | POLLHUP | POLLERR)){
+        read_connection(broker, broker->connections[i]);
+      }
+    }
+    // write right away what this round queued, most sockets take it all
+    for(i=0; i<broker->count; i++){
+      if(broker->connections[i]->out_used > broker->connections[i]->out_start){
+        write_connection(broker, broker->connections[i]);
+      }
+    }
+    remove_closed(broker);
+  }
+  free(fds);
+  return NULL;
+}
+
+//----------------------------------------------------------------------------//
+//                               Public API
+//----------------------------------------------------------------------------//
+
+stub_broker_t *stub_broker_start(uint16_t port){
+  stub_broker_t *broker = calloc(1, sizeof(*broker));
+  struct sockaddr_in address;
+  int one = 1;
+
+  if(broker == NULL){
+    return NULL;
+  }
+  broker->listen_fd = -1;
+  broker->wake[0] = broker->wake[1] = -1;
+  pthread_mutex_init(&broker->lock, NULL);
+  if(pipe(broker->wake) != 0){
+    stub_broker_stop(broker);
+    return NULL;
+  }
+  fcntl(broker->wake[0], F_SETFL, O_NONBLOCK);
+
+  if(port != 0){
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    broker->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(broker->listen_fd < 0 ||
+        setsockopt(broker->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(broker->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(broker->listen_fd, 64) != 0){
+      stub_broker_stop(broker);
+      return NULL;
+    }
+    broker->port = port;
+  }
+
+  if(pthread_create(&broker->thread, NULL, serve, broker) != 0){
+    broker->thread = 0;
+    stub_broker_stop(broker);
+    return NULL;
+  }
+  return broker;
+}
+
+uint16_t stub_broker_port(stub_broker_t *broker){
+  return broker->port;
+}
+
+int stub_broker_attach(stub_broker_t *broker){
+  int fds[2];
+  int result;
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0){
+    return -1;
+  }
+  pthread_mutex_lock(&broker->lock);
+  result = reserve((void **)&broker->attached, &broker->attached_size,
+                   broker->attached_count, 1, sizeof(int));
+  if(result == 0){
+    broker->attached[broker->attached_count++] = fds[1];
+  }
+  pthread_mutex_unlock(&broker->lock);
+  if(result != 0 || write(broker->wake[1], "", 1) != 1){
+    close(fds[0]);
+    if(result != 0){
+      close(fds[1]);
+    }
+    return -1;
+  }
+  return fds[0];
+}
+
+void stub_broker_get_stats(stub_broker_t *broker, stub_broker_stats_t *stats){
+  stats->received = __atomic_load_n(&broker->stats.received, __ATOMIC_RELAXED);
+  stats->delivered = __atomic_load_n(&broker->stats.delivered, __ATOMIC_RELAXED);
+  stats->bytes_in = __atomic_load_n(&broker->stats.bytes_in, __ATOMIC_RELAXED);
+  stats->bytes_out = __atomic_load_n(&broker->stats.bytes_out, __ATOMIC_RELAXED);
+}
+
+void stub_broker_stop(stub_broker_t *broker){
+  size_t i;
+
+  if(broker == NULL){
+    return;
+  }
+  if(broker->thread){
+    __atomic_store_n(&broker->stop, 1, __ATOMIC_RELEASE);
+    if(write(broker->wake[1], "", 1) != 1){
+      // poll() times out and sees the flag anyway
+    }
+    pthread_join(broker->thread, NULL);
+  }
+  for(i=0; i<broker->count; i++){
+    free_connection(broker->connections[i]);
+  }
+  for(i=0; i<broker->attached_count; i++){
+    close(broker->attached[i]);
+  }
+  if(broker->listen_fd >= 0){
+    close(broker->listen_fd);
+  }
+  if(broker->wake[0] >= 0){
+    close(broker->wake[0]);
+    close(broker->wake[1]);
+  }
+  pthread_mutex_destroy(&broker->lock);
+  free(broker->connections);
+  free(broker->attached);
+  free(broker);
+}
@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2020
+Steward Observatory Engineering & Technical Services, University of Arizona
+
+This program and the accompanying materials are made available under the
+terms of the Eclipse Public License 2.0 which is available at
+http://www.eclipse.org/legal/epl-2.0.
+*/
+
+/*
+In-process MQTT 3.1.1 broker stand-in for end-to-end tests without a live
+Mosquitto.
+
+One thread serves every connection with poll(). Clients either connect over
+loopback TCP, or get a connection with stub_broker_attach(), which is a
+socketpair and never touches the network stack's TCP path. CONNECT, PUBLISH
+(QoS 0 and 1), SUBSCRIBE with + and # wildcards, UNSUBSCRIBE, PINGREQ and
+DISCONNECT are handled, and the will of a client that goes away without
+DISCONNECT is published. There are no retained messages, sessions or
+retransmissions.
+
+While any client has more than STUB_BROKER_HIGH_WATER bytes waiting to be
+written, the broker stops reading from every client, so fast publishers are
+slowed down to what the slowest subscriber takes instead of messages being
+dropped.
+*/
+#ifndef __STUB_BROKER_H__
+#define __STUB_BROKER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STUB_BROKER_HIGH_WATER (1u << 20)
+
+typedef struct stub_broker stub_broker_t;
+
+typedef struct {
+  uint64_t received; // PUBLISH packets received
+  uint64_t delivered; // PUBLISH packets queued to subscribers
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+} stub_broker_stats_t;
+
+// start a broker, listening on 127.0.0.1:port if port is not 0; NULL on failure
+stub_broker_t *stub_broker_start(uint16_t port);
+
+// TCP port the broker listens on, 0 if none
+uint16_t stub_broker_port(stub_broker_t *broker);
+
+// open an in-memory connection, returns the client's end or -1 on failure
+int stub_broker_attach(stub_broker_t *broker);
+
+// copy the counters
+void stub_broker_get_stats(stub_broker_t *broker, stub_broker_stats_t *stats);
+
+// stop the broker thread and close every connection
+void stub_broker_stop(stub_broker_t *broker);
+
+// true if an MQTT topic filter with + and # wildcards matches a topic
+int stub_broker_topic_matches(const char *filter, size_t filter_length,
+                              const char *topic, size_t topic_length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
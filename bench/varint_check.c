@@ -0,0 +1,163 @@
+/*
+Copyright (c) 2020
+Steward Observatory Engineering & Technical Services, University of Arizona
+
+This program and the accompanying materials are made available under the
+terms of the Eclipse Public License 2.0 which is available at
+http://www.eclipse.org/legal/epl-2.0.
+*/
+
+/*
+Randomized check of the fast varint path in pb_decode.c against the byte at
+a time loop.
+
+pb_decode_varint() and pb_decode_varint32() take the fast path for streams
+made with pb_istream_from_buffer() that have 8 bytes or more left. The same
+bytes read through a callback stream always take the original loop, so each
+input is decoded both ways and the result, the value and the bytes left must
+match. Inputs are varints of every length, overlong and sign extended ones,
+unterminated ones and plain random bytes, followed by 0 to 12 other bytes so
+that both sides of the 8 byte limit are covered.
+
+usage: varint_check [iterations] [seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pb_decode.h"
+
+#define CHECK_MAX_INPUT 24
+
+static uint64_t rng_state;
+
+// xorshift64*
+static uint64_t rng_next(void){
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+static bool reference_read(pb_istream_t *stream, pb_byte_t *buf, size_t count){
+  const pb_byte_t *source = (const pb_byte_t*)stream->state;
+
+  if(buf != NULL) memcpy(buf, source, count);
+  stream->state = (pb_byte_t*)source + count;
+  return true;
+}
+
+// a stream over the same bytes that is not a buffer stream
+static pb_istream_t reference_stream(const pb_byte_t *buf, size_t length){
+  pb_istream_t stream = pb_istream_from_buffer(buf, length);
+  stream.callback = reference_read;
+  return stream;
+}
+
+// write a varint of value in length bytes, overlong if length needs it
+static size_t put_varint(pb_byte_t *out, uint64_t value, size_t length){
+  size_t i;
+
+  for(i=0; i+1<length; i++){
+    out[i] = (pb_byte_t)(value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[i] = (pb_byte_t)(value & 0x7F);
+  return length;
+}
+
+// fill buf with one random input, return its length
+static size_t make_input(pb_byte_t *buf){
+  size_t length = 0, i, n;
+  uint64_t r = rng_next();
+  uint64_t value = rng_next() >> (rng_next() % 64);
+
+  switch(r % 6){
+    case 0: // shortest encoding of a random value
+      n = 1;
+      while(n < 10 && (value >> (7 * n)) != 0) n++;
+      length = put_varint(buf, value, n);
+      break;
+    case 1: // random length, overlong or truncated high bits
+      length = put_varint(buf, value, 1 + rng_next() % 10);
+      break;
+    case 2: // negative int32 as protobuf writes it, sign extended to 10 bytes
+      length = put_varint(buf, (uint64_t)(int64_t)(int32_t)value, 10);
+      break;
+    case 3: // padded with 0x80 bytes
+      n = 1 + rng_next() % 5;
+      length = put_varint(buf, value & 0xFFFFFFF, n);
+      buf[length - 1] |= 0x80;
+      n = rng_next() % 8;
+      for(i=0; i<n; i++) buf[length++] = 0x80;
+      buf[length++] = (pb_byte_t)(rng_next() % 2);
+      break;
+    case 4: // no terminating byte within 11 bytes
+      for(i=0; i<11; i++) buf[length++] = (pb_byte_t)(rng_next() | 0x80);
+      break;
+    default: // random bytes
+      for(i=0; i<12; i++) buf[length++] = (pb_byte_t)rng_next();
+      break;
+  }
+
+  // what follows the varint, sometimes cut into it
+  n = rng_next() % 13;
+  for(i=0; i<n && length<CHECK_MAX_INPUT; i++) buf[length++] = (pb_byte_t)rng_next();
+  if(rng_next() % 8 == 0) length = rng_next() % (length + 1);
+  return length;
+}
+
+static void print_input(const pb_byte_t *buf, size_t length){
+  size_t i;
+  for(i=0; i<length; i++) fprintf(stderr, " %02x", buf[i]);
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]){
+  unsigned long long iterations = 10000000;
+  unsigned long long i, failures = 0;
+  pb_byte_t buf[CHECK_MAX_INPUT];
+  size_t length;
+
+  if(argc > 1) iterations = strtoull(argv[1], NULL, 0);
+  rng_state = (argc > 2) ? strtoull(argv[2], NULL, 0) : 1;
+  if(rng_state == 0) rng_state = 1;
+
+  for(i=0; i<iterations && failures<10; i++){
+    pb_istream_t fast, reference;
+    uint64_t fast_value = 0, reference_value = 0;
+    uint32_t fast_value32 = 0, reference_value32 = 0;
+    bool fast_ok, reference_ok;
+
+    length = make_input(buf);
+
+    fast = pb_istream_from_buffer(buf, length);
+    reference = reference_stream(buf, length);
+    fast_ok = pb_decode_varint(&fast, &fast_value);
+    reference_ok = pb_decode_varint(&reference, &reference_value);
+    if(fast_ok != reference_ok ||
+       (fast_ok && (fast_value != reference_value || fast.bytes_left != reference.bytes_left))){
+      fprintf(stderr, "pb_decode_varint: fast %d %llu, %zu left; reference %d %llu, %zu left; input",
+              fast_ok, (unsigned long long)fast_value, fast.bytes_left,
+              reference_ok, (unsigned long long)reference_value, reference.bytes_left);
+      print_input(buf, length);
+      failures++;
+    }
+
+    fast = pb_istream_from_buffer(buf, length);
+    reference = reference_stream(buf, length);
+    fast_ok = pb_decode_varint32(&fast, &fast_value32);
+    reference_ok = pb_decode_varint32(&reference, &reference_value32);
+    if(fast_ok != reference_ok ||
+       (fast_ok && (fast_value32 != reference_value32 || fast.bytes_left != reference.bytes_left))){
+      fprintf(stderr, "pb_decode_varint32: fast %d %u, %zu left; reference %d %u, %zu left; input",
+              fast_ok, fast_value32, fast.bytes_left,
+              reference_ok, reference_value32, reference.bytes_left);
+      print_input(buf, length);
+      failures++;
+    }
+  }
+
+  printf("%llu inputs, %llu mismatches\n", i, failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -54,24 +54,9 @@ void callback(char* topic, byte* payload, unsigned int length){
 // ============== Setup all objects ============================================
 void setup() {
   // --------- TAHU -----------------
-  // create a payload and fill in the struct with appropriate values
+  // the payload's metrics are taken from this pool by spark.add()
   spark.set_payload(&payload);
-  spark.set_metrics(metrics, 1); // tell obj to set the pointer to metrics data
-  metrics[0].name = "fibonacci"; // name the metric
-  metrics[0].has_alias = false; // not using aliases
-  //metrics[0].alias = 0;
-  metrics[0].has_timestamp = true; // yes we are using timestamps
-  metrics[0].timestamp = 0; // not assigned yet
-  metrics[0].has_datatype = true; // yes it has a data type
-  metrics[0].datatype = METRIC_DATA_TYPE_INT32;
-  metrics[0].has_is_historical = false;
-  metrics[0].has_is_transient = false;
-  metrics[0].has_is_null = false;
-  metrics[0].has_metadata = false;
-  metrics[0].has_properties = false;
-  metrics[0].value.string_value = NULL;
-  metrics[0].which_value = org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag;
-  metrics[0].value.int_value = 0;
+  spark.set_metric_pool(metrics, 1);
   // ------- END TAHU --------------
 
   // initial values for fibonacci
@@ -136,12 +121,12 @@ void loop(){
         // If we were keeping track of the time we could set the timestamp
         //spark.payload.timestamp = timeClient.getUTCEpochTime();
         //spark.payload.metrics[0].timestamp = timeClient.getUTCEpochTime();
-    payload.metrics[0].value.int_value = fib;
+    spark.clear_metrics();
+    spark.add<int32_t>("fibonacci", fib); // INT32 metric with an int_value
     payload.seq++;
-    uint8_t *buf_ptr = (uint8_t*)binary_buffer;
 
     // Encode the payload
-    message_length = spark.encode(&buf_ptr, BINARY_BUFFER_SIZE);
+    message_length = spark.encode(binary_buffer, BINARY_BUFFER_SIZE);
 
     // Publish Sparkplug B encoded MQTT message to broker
     mmqtClient.publish(MQTT_TOPIC, binary_buffer, message_length, 0);
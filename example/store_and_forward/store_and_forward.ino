@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2020
+Steward Observatory Engineering & Technical Services, University of Arizona
+
+This program and the accompanying materials are made available under the
+terms of the Eclipse Public License 2.0 which is available at
+http://www.eclipse.org/legal/epl-2.0.
+*/
+
+/*
+Test program for sparkplugb_arduino library, written for a Teensy 4.1
+This program samples a value every second and publishes it to an MQTT broker,
+encoded as Sparkplug B. While the broker can not be reached the samples are
+kept in a sparkplugb_arduino_history buffer; after reconnecting they are sent
+as historical metrics, many samples per message.
+*/
+
+#include <NativeEthernet.h> // Teensy requires NativeEthernet to use onboard NIC
+#include <PubSubClient.h> // pub&sub MQTT messages
+#include <sparkplugb_arduino.hpp> // Sparkplug B encoding
+
+// Enter a MAC address and IP address for your controller below.
+// The IP address will be dependent on your local network:
+byte mac[] = {
+  0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED
+};
+IPAddress ip(192, 168, 249, 99); // Teensy's IP address
+IPAddress dns(192, 168, 249, 1);
+IPAddress gateway(192, 168, 249, 1);
+IPAddress subnet(255, 255, 255, 0);
+IPAddress mqtt_server(192, 168, 249, 98); // IP address of MQTT broker
+
+// MQTT
+EthernetClient enetClient;
+PubSubClient mmqtClient(enetClient);
+const char* MQTT_TOPIC = "spBv1.0/dev/DDATA/Teensy/fib";
+
+// Sparkplug
+sparkplugb_arduino_encoder spark;
+org_eclipse_tahu_protobuf_Payload payload;
+#define BINARY_BUFFER_SIZE 1024
+uint8_t binary_buffer[BINARY_BUFFER_SIZE]; // buffer for writing data to the network
+org_eclipse_tahu_protobuf_Payload_Metric metrics[1];
+
+// store and forward
+#define HISTORY_SIZE 3600 // one hour of samples
+sparkplugb_arduino_history_sample history_samples[HISTORY_SIZE];
+sparkplugb_arduino_history history;
+const char* metric_names[] = {"fibonacci"};
+
+const int ledPin = 13;
+bool ledVal;
+int32_t fib;
+int32_t fib_a;
+int32_t fib_b;
+uint64_t uptime_ms; // stands in for a real clock
+
+// ============== MQTT Subscription callback ===================================
+void callback(char* topic, byte* payload, unsigned int length){
+  // this example does not accept incomming data
+}
+
+// ============== Setup all objects ============================================
+void setup() {
+  // --------- TAHU -----------------
+  spark.set_payload(&payload);
+  spark.set_metrics(metrics, 1);
+  metrics[0] = org_eclipse_tahu_protobuf_Payload_Metric_init_zero;
+  metrics[0].name = (char*)metric_names[0];
+  metrics[0].has_timestamp = true;
+  metrics[0].has_datatype = true;
+  metrics[0].datatype = METRIC_DATA_TYPE_INT32;
+  metrics[0].which_value = org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag;
+  metrics[0].value.int_value = 0;
+
+  // queue samples in RAM, metrics without an alias are found by name
+  history.begin(history_samples, HISTORY_SIZE);
+  history.set_metric_names(metric_names, 1);
+  history.set_batch_budget(BINARY_BUFFER_SIZE);
+  // ------- END TAHU --------------
+
+  fib = 0;
+  fib_a = 0;
+  fib_b = 1;
+  uptime_ms = 0;
+
+  pinMode(ledPin, OUTPUT);
+  ledVal = 1;
+
+  Ethernet.begin(mac, ip, dns, gateway, subnet);
+  mmqtClient.setServer(mqtt_server, 1883);
+  mmqtClient.setCallback(callback);
+  // batches fill up to BINARY_BUFFER_SIZE bytes, more than PubSubClient's
+  // default 256 byte packet buffer, which must also hold the MQTT header
+  // and the topic
+  mmqtClient.setBufferSize(BINARY_BUFFER_SIZE + SPARKPLUGB_PUBLISH_HEADROOM(strlen(MQTT_TOPIC)));
+}
+
+void loop(){
+  size_t message_length;
+
+  // compute next value in fibonacci sequence
+  fib = fib_a + fib_b;
+  if(fib < fib_b){
+    fib = 0;
+    fib_a = 0;
+    fib_b = 1;
+  }
+  else{
+    fib_a = fib_b;
+    fib_b = fib;
+  }
+  uptime_ms += 1000;
+  metrics[0].value.int_value = fib;
+  metrics[0].timestamp = uptime_ms;
+  payload.has_timestamp = true;
+  payload.timestamp = uptime_ms;
+
+  if(!mmqtClient.connected()){
+    mmqtClient.connect("Teensy1");
+  }
+
+  if(mmqtClient.connected()){
+    // send the backlog first, oldest samples in the first batch
+    while(history.available() > 0 && mmqtClient.connected()){
+      message_length = history.encode_batch(binary_buffer, BINARY_BUFFER_SIZE,
+                                            uptime_ms, payload.seq++);
+      if(message_length == (size_t)-1) break;
+      if(!mmqtClient.publish(MQTT_TOPIC, binary_buffer, message_length, 0)) break;
+      history.consume(); // published, drop the batch from the queue
+      mmqtClient.loop();
+    }
+
+    message_length = spark.encode(binary_buffer, BINARY_BUFFER_SIZE);
+    payload.seq++;
+    if(message_length == (size_t)-1 ||
+       !mmqtClient.publish(MQTT_TOPIC, binary_buffer, message_length, 0))
+    {
+      history.store(&payload);
+    }
+    mmqtClient.loop();
+    ledVal = !ledVal;
+  }
+  else{
+    // offline, keep the sample for later
+    history.store(&payload);
+    ledVal = 1;
+  }
+  digitalWrite(ledPin, ledVal);
+  delay(1000); // wait a second before looping
+}
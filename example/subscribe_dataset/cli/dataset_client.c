@@ -32,6 +32,7 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <signal.h>
 #include <inttypes.h>
 #include <math.h>
 #include "mosquitto.h"
@@ -39,6 +40,7 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "tahu.pb.h"
 #include "pb_decode.h"
 #include "pb_encode.h"
+#include "payload_log.h"
 
 /* Mosquitto Callbacks */
 void my_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *message);
@@ -48,6 +50,7 @@ void my_log_callback(struct mosquitto *mosq, void *userdata, int level, const ch
 
 /* Local Functions */
 void publisher(struct mosquitto *mosq, char *topic, void *buf, unsigned len);
+void stop_capture(int signum);
 //void publish_ddata_message(struct mosquitto *mosq);
 
 org_eclipse_tahu_protobuf_Payload payload;
@@ -70,6 +73,11 @@ enum alias_map {
 
 uint8_t binary_buffer[4096];
 
+// capture of received payloads, enabled by the SPARKPLUG_CAPTURE variable
+payload_log_writer_t capture_log;
+bool capturing = false;
+volatile sig_atomic_t capture_running = 1;
+
 int main(int argc, char *argv[]) {
 
 	// MQTT Parameters
@@ -116,6 +124,10 @@ int main(int argc, char *argv[]) {
   mosquitto_log_callback_set(mosq, my_log_callback);
   mosquitto_connect_callback_set(mosq, my_connect_callback);
   mosquitto_message_callback_set(mosq, my_message_callback);
+  if(getenv("SPARKPLUG_CAPTURE") != NULL){
+    capturing = (payload_log_create(&capture_log, getenv("SPARKPLUG_CAPTURE"), 0) == 0);
+    if(!capturing) fprintf(stderr, "Unable to create capture log.\n");
+  }
   mosquitto_subscribe_callback_set(mosq, my_subscribe_callback);
   //mosquitto_username_pw_set(mosq,"admin","changeme");
   mosquitto_will_set(mosq, "spBv1.0/dev/NDEATH/client", 0, NULL, 0, false);
@@ -201,7 +213,22 @@ int main(int argc, char *argv[]) {
 	int total = sizeof(payload) + sizeof(metrics) + sizeof(row_data) + sizeof(elements);
 	total += sizeof(column_keys) + sizeof(datatypes);
 	printf("total size: %i\n\n", total);
+
+	// With capture enabled, stay connected and record what arrives on
+	// spBv1.0/# (subscribed in my_connect_callback) until Ctrl-C
+	if(capturing){
+		signal(SIGINT, stop_capture);
+		printf("capturing to %s, Ctrl-C to stop\n", getenv("SPARKPLUG_CAPTURE"));
+		while(capture_running){
+			if(mosquitto_loop(mosq, 100, 1) != MOSQ_ERR_SUCCESS){
+				fprintf(stderr, "Connection lost, capture stopped.\n");
+				break;
+			}
+		}
+	}
+
 	// Close and cleanup
+	if(capturing) payload_log_close(&capture_log);
 	mosquitto_destroy(mosq);
 	mosquitto_lib_cleanup();
 
@@ -216,11 +243,21 @@ void publisher(struct mosquitto *mosq, char *topic, void *buf, unsigned len) {
 	mosquitto_publish(mosq, NULL, topic, len, buf, 0, false);
 }
 
+/*
+ * SIGINT handler that ends the capture loop
+ */
+void stop_capture(int signum) {
+	capture_running = 0;
+}
+
 /*
  * Callback for incoming MQTT messages. Since this is a Sparkplug implementation these will be NCMD and DCMD messages
  */
 void my_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *message) {
-
+	if(capturing){
+		payload_log_append(&capture_log, message->topic, message->payload,
+						   message->payloadlen, payload_log_timestamp());
+	}
 }
 
 /*
@@ -228,7 +265,10 @@ void my_message_callback(struct mosquitto *mosq, void *userdata, const struct mo
  * A production application should handle MQTT connect failures and reattempt as necessary.
  */
 void my_connect_callback(struct mosquitto *mosq, void *userdata, int result) {
-
+	// the network loop, and so this callback, only runs while capturing
+	if(capturing && result == 0){
+		mosquitto_subscribe(mosq, NULL, "spBv1.0/#", 0);
+	}
 }
 
 /*
@@ -49,6 +49,7 @@ const char* MQTT_TOPIC = "spBv1.0/dev/DCMD/Teensy1/data";
 
 // Sparkplug
 sparkplugb_arduino_decoder spark; // splarkplug b encoder object
+sparkplugb_arduino_dataset_reader table; // typed view of the received DataSet
 #define BINARY_BUFFER_SIZE 2048
 uint8_t binary_buffer[BINARY_BUFFER_SIZE]; // buffer for writing data to the network
 char metric_str_bufs[2][32];
@@ -115,8 +116,11 @@ void callback(char* topic, byte* payload, unsigned int length){
         mqtt_msg += "N_columns: " + String(nCol) + "<br>";
         mqtt_msg += "N_rows: " + String(nRow) + "<br>";
         t0 = millis();
-        for(i=0;i<nRow;i++){
-          data[i] = (int)spark.payload.metrics[0].value.dataset_value.rows[i].elements[0].value.int_value;
+        // first column as int32, type checked once for the whole column
+        if(!table.set_dataset(&spark.payload.metrics[0].value.dataset_value) ||
+           table.read_column(0, data, 0, 250) == (size_t)-1)
+        {
+          mqtt_msg += "column 0 is not an integer column<br>";
         }
         dt = millis() - t0;
         mqtt_msg += "Copy time: " + String(dt) + "<br>";
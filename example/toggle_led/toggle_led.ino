@@ -60,10 +60,13 @@ bool ledVal;
 void callback(char* topic, byte* payload, unsigned int length){
   // this is where we would put code to handle an incomming MQTT message
   // but this example does not accept incomming data
+  bool led;
+
   if(spark.decode(payload, length)){
     if(String(topic).compareTo(MQTT_TOPIC) == 0){
-      if(spark.payload.metrics_count == 1){
-        if(spark.payload.metrics[0].value.boolean_value)
+      // false unless the metric is there and holds a boolean
+      if(spark.get(METRICS_NAME, &led)){
+        if(led)
           ledState = 1;
         else
           ledState = 0;
@@ -47,6 +47,17 @@
  * the string processing slightly and slightly increases code size. */
 /* #define PB_VALIDATE_UTF8 1 */
 
+/* Disable the per-message tag lookup tables used by pb_field_iter_find().
+ * The tables cost RAM: a 32 byte entry per field with PB_FIELD_32BIT, plus
+ * a pb_size_t for every tag up to the largest one of the message, about
+ * 3.3 kB of .bss for tahu.pb.c. Without them every decoded tag is found by
+ * a linear search of the field descriptor. Disabled by default on Arduino,
+ * define PB_FIELD_LOOKUP to keep the tables there. */
+/* #define PB_NO_FIELD_LOOKUP 1 */
+#if defined(ARDUINO) && !defined(PB_FIELD_LOOKUP) && !defined(PB_NO_FIELD_LOOKUP)
+#define PB_NO_FIELD_LOOKUP 1
+#endif
+
 /******************************************************************
  * You usually don't need to change anything below this line.     *
  * Feel free to look around and use the defined macros, though.   *
@@ -276,6 +287,44 @@ typedef struct pb_field_iter_s pb_field_iter_t;
 /* This structure is used in auto-generated constants
  * to specify struct fields.
  */
+#ifndef PB_NO_FIELD_LOOKUP
+/* Field information unpacked from the field_info words, together with the
+ * iterator indexes that lead up to the field. Filled in at runtime by
+ * pb_field_lookup_init(), so that the iterator can jump straight to a field.
+ */
+typedef struct pb_field_lookup_entry_s pb_field_lookup_entry_t;
+struct pb_field_lookup_entry_s {
+    uint32_t data_offset;
+    pb_size_t field_info_index;
+    pb_size_t required_field_index;
+    pb_size_t submessage_index;
+    pb_size_t tag;
+    pb_size_t data_size;
+    pb_size_t array_size;
+    pb_type_t type;
+    int_least8_t size_offset;
+};
+
+/* Per-message lookup table. tag_index[tag] holds field index + 1 for every
+ * non-extension field with tag <= largest_tag, or 0 if there is no such field.
+ * 'complete' is false if some field did not fit in tag_index, in which case a
+ * miss in the table falls back to the linear search.
+ * 'state' is one of PB_LOOKUP_EMPTY, _BUILDING and _READY; the other members
+ * are only read once an acquire load of it returns PB_LOOKUP_READY.
+ */
+#define PB_LOOKUP_EMPTY 0
+#define PB_LOOKUP_BUILDING 1
+#define PB_LOOKUP_READY 2
+typedef struct pb_field_lookup_s pb_field_lookup_t;
+struct pb_field_lookup_s {
+    uint8_t state;
+    bool complete;
+    pb_size_t largest_tag;
+    pb_field_lookup_entry_t *fields;
+    pb_size_t *tag_index;
+};
+#endif
+
 PB_PACKED_STRUCT_START
 typedef struct pb_msgdesc_s pb_msgdesc_t;
 struct pb_msgdesc_s {
@@ -285,6 +334,10 @@ struct pb_msgdesc_s {
     const pb_byte_t *default_value;
 
     bool (*field_callback)(pb_istream_t *istream, pb_ostream_t *ostream, const pb_field_iter_t *field);
+
+#ifndef PB_NO_FIELD_LOOKUP
+    pb_field_lookup_t *field_lookup;
+#endif
 } pb_packed;
 PB_PACKED_STRUCT_END
 
@@ -431,13 +484,17 @@ struct pb_extension_s {
 #define pb_extension_init_zero {NULL,NULL,NULL,false}
 
 /* Memory allocation functions to use. You can define pb_realloc and
- * pb_free to custom functions if you want. */
+ * pb_free to custom functions if you want. By default they go through
+ * the allocator installed with pb_set_allocator(), see pb_decode.h. */
 #ifdef PB_ENABLE_MALLOC
 #   ifndef pb_realloc
-#       define pb_realloc(ptr, size) realloc(ptr, size)
+#       define pb_realloc(ptr, size) pb_allocator_realloc(ptr, size)
+#       define pb_realloc_field(ptr, size, field) pb_allocator_realloc_field(ptr, size, field)
+#   else
+#       define pb_realloc_field(ptr, size, field) pb_realloc(ptr, size)
 #   endif
 #   ifndef pb_free
-#       define pb_free(ptr) free(ptr)
+#       define pb_free(ptr) pb_allocator_free(ptr)
 #   endif
 #endif
 
@@ -457,6 +514,7 @@ struct pb_extension_s {
 
 /* Binding of a message field set into a specific structure */
 #define PB_BIND(msgname, structname, width) \
+    PB_GEN_FIELD_LOOKUP(msgname, structname) \
     const uint32_t structname ## _field_info[] PB_PROGMEM = \
     { \
         msgname ## _FIELDLIST(PB_GEN_FIELD_INFO_ ## width, structname) \
@@ -474,11 +532,36 @@ struct pb_extension_s {
        structname ## _submsg_info, \
        msgname ## _DEFAULT, \
        msgname ## _CALLBACK, \
+       PB_FIELD_LOOKUP_REF(structname) \
     }; \
     msgname ## _FIELDLIST(PB_GEN_FIELD_INFO_ASSERT_ ## width, structname)
 
 #define PB_GEN_FIELD_COUNT(structname, atype, htype, ltype, fieldname, tag) +1
 
+/* Evaluates to the tag of the last field in the list, which is the largest
+ * tag when the generator emits the fields in tag order. */
+#define PB_GEN_LARGEST_TAG(structname, atype, htype, ltype, fieldname, tag) * 0 + tag
+
+/* Storage for the lookup table of each message, see PB_NO_FIELD_LOOKUP for
+ * its size. The descriptor itself stays constant; the table is filled in by
+ * pb_field_lookup_init(). */
+#ifndef PB_NO_FIELD_LOOKUP
+#define PB_GEN_FIELD_LOOKUP(msgname, structname) \
+    static pb_field_lookup_entry_t structname ## _lookup_fields[0 msgname ## _FIELDLIST(PB_GEN_FIELD_COUNT, structname)]; \
+    static pb_size_t structname ## _lookup_tags[(0 msgname ## _FIELDLIST(PB_GEN_LARGEST_TAG, structname)) + 1]; \
+    static pb_field_lookup_t structname ## _field_lookup = \
+    { \
+       PB_LOOKUP_EMPTY, false, \
+       0 msgname ## _FIELDLIST(PB_GEN_LARGEST_TAG, structname), \
+       structname ## _lookup_fields, \
+       structname ## _lookup_tags \
+    };
+#define PB_FIELD_LOOKUP_REF(structname) &structname ## _field_lookup,
+#else
+#define PB_GEN_FIELD_LOOKUP(msgname, structname)
+#define PB_FIELD_LOOKUP_REF(structname)
+#endif
+
 #define PB_GEN_FIELD_INFO_1(structname, atype, htype, ltype, fieldname, tag) \
     PB_GEN_FIELD_INFO(1, structname, atype, htype, ltype, fieldname, tag)
 
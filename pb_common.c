@@ -5,73 +5,143 @@
 
 #include "pb_common.h"
 
-static bool load_descriptor_values(pb_field_iter_t *iter)
-{
-    uint32_t word0;
+/* Unpacked contents of one field_info entry. */
+typedef struct {
     uint32_t data_offset;
-    uint_least8_t format;
+    pb_size_t tag;
+    pb_size_t data_size;
+    pb_size_t array_size;
+    pb_type_t type;
     int_least8_t size_offset;
+} field_info_t;
 
-    if (iter->index >= iter->descriptor->field_count)
-        return false;
+static void unpack_field_info(const pb_msgdesc_t *desc, pb_size_t field_info_index, field_info_t *info)
+{
+    uint32_t word0;
+    uint_least8_t format;
 
-    word0 = PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index]);
+    word0 = PB_PROGMEM_READU32(desc->field_info[field_info_index]);
     format = word0 & 3;
-    iter->tag = (pb_size_t)((word0 >> 2) & 0x3F);
-    iter->type = (pb_type_t)((word0 >> 8) & 0xFF);
+    info->tag = (pb_size_t)((word0 >> 2) & 0x3F);
+    info->type = (pb_type_t)((word0 >> 8) & 0xFF);
 
     if (format == 0)
     {
         /* 1-word format */
-        iter->array_size = 1;
-        size_offset = (int_least8_t)((word0 >> 24) & 0x0F);
-        data_offset = (word0 >> 16) & 0xFF;
-        iter->data_size = (pb_size_t)((word0 >> 28) & 0x0F);
+        info->array_size = 1;
+        info->size_offset = (int_least8_t)((word0 >> 24) & 0x0F);
+        info->data_offset = (word0 >> 16) & 0xFF;
+        info->data_size = (pb_size_t)((word0 >> 28) & 0x0F);
     }
     else if (format == 1)
     {
         /* 2-word format */
-        uint32_t word1 = PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index + 1]);
+        uint32_t word1 = PB_PROGMEM_READU32(desc->field_info[field_info_index + 1]);
 
-        iter->array_size = (pb_size_t)((word0 >> 16) & 0x0FFF);
-        iter->tag = (pb_size_t)(iter->tag | ((word1 >> 28) << 6));
-        size_offset = (int_least8_t)((word0 >> 28) & 0x0F);
-        data_offset = word1 & 0xFFFF;
-        iter->data_size = (pb_size_t)((word1 >> 16) & 0x0FFF);
+        info->array_size = (pb_size_t)((word0 >> 16) & 0x0FFF);
+        info->tag = (pb_size_t)(info->tag | ((word1 >> 28) << 6));
+        info->size_offset = (int_least8_t)((word0 >> 28) & 0x0F);
+        info->data_offset = word1 & 0xFFFF;
+        info->data_size = (pb_size_t)((word1 >> 16) & 0x0FFF);
     }
     else if (format == 2)
     {
         /* 4-word format */
-        uint32_t word1 = PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index + 1]);
-        uint32_t word2 = PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index + 2]);
-        uint32_t word3 = PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index + 3]);
-
-        iter->array_size = (pb_size_t)(word0 >> 16);
-        iter->tag = (pb_size_t)(iter->tag | ((word1 >> 8) << 6));
-        size_offset = (int_least8_t)(word1 & 0xFF);
-        data_offset = word2;
-        iter->data_size = (pb_size_t)word3;
+        uint32_t word1 = PB_PROGMEM_READU32(desc->field_info[field_info_index + 1]);
+        uint32_t word2 = PB_PROGMEM_READU32(desc->field_info[field_info_index + 2]);
+        uint32_t word3 = PB_PROGMEM_READU32(desc->field_info[field_info_index + 3]);
+
+        info->array_size = (pb_size_t)(word0 >> 16);
+        info->tag = (pb_size_t)(info->tag | ((word1 >> 8) << 6));
+        info->size_offset = (int_least8_t)(word1 & 0xFF);
+        info->data_offset = word2;
+        info->data_size = (pb_size_t)word3;
     }
     else
     {
         /* 8-word format */
-        uint32_t word1 = PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index + 1]);
-        uint32_t word2 = PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index + 2]);
-        uint32_t word3 = PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index + 3]);
-        uint32_t word4 = PB_PROGMEM_READU32(iter->descriptor->field_info[iter->field_info_index + 4]);
-
-        iter->array_size = (pb_size_t)word4;
-        iter->tag = (pb_size_t)(iter->tag | ((word1 >> 8) << 6));
-        size_offset = (int_least8_t)(word1 & 0xFF);
-        data_offset = word2;
-        iter->data_size = (pb_size_t)word3;
+        uint32_t word1 = PB_PROGMEM_READU32(desc->field_info[field_info_index + 1]);
+        uint32_t word2 = PB_PROGMEM_READU32(desc->field_info[field_info_index + 2]);
+        uint32_t word3 = PB_PROGMEM_READU32(desc->field_info[field_info_index + 3]);
+        uint32_t word4 = PB_PROGMEM_READU32(desc->field_info[field_info_index + 4]);
+
+        info->array_size = (pb_size_t)word4;
+        info->tag = (pb_size_t)(info->tag | ((word1 >> 8) << 6));
+        info->size_offset = (int_least8_t)(word1 & 0xFF);
+        info->data_offset = word2;
+        info->data_size = (pb_size_t)word3;
+    }
+}
+
+#ifndef PB_NO_FIELD_LOOKUP
+/* The table entries are written before a release store of PB_LOOKUP_READY
+ * and only read after an acquire load sees it. */
+#if defined(__GNUC__) || defined(__clang__)
+#define PB_LOOKUP_IS_READY(lookup) \
+    (__atomic_load_n(&(lookup)->state, __ATOMIC_ACQUIRE) == PB_LOOKUP_READY)
+#define PB_LOOKUP_CLAIM(lookup, expected) \
+    __atomic_compare_exchange_n(&(lookup)->state, &(expected), PB_LOOKUP_BUILDING, \
+                                false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+#define PB_LOOKUP_PUBLISH(lookup) \
+    __atomic_store_n(&(lookup)->state, PB_LOOKUP_READY, __ATOMIC_RELEASE)
+#else
+#define PB_LOOKUP_IS_READY(lookup) ((lookup)->state == PB_LOOKUP_READY)
+#define PB_LOOKUP_CLAIM(lookup, expected) \
+    ((expected = (lookup)->state) == PB_LOOKUP_EMPTY ? ((lookup)->state = PB_LOOKUP_BUILDING, true) : false)
+#define PB_LOOKUP_PUBLISH(lookup) ((lookup)->state = PB_LOOKUP_READY)
+#endif
+
+static const pb_field_lookup_t *ready_lookup(const pb_msgdesc_t *desc)
+{
+    const pb_field_lookup_t *lookup = desc->field_lookup;
+
+    if (lookup == NULL)
+        return NULL;
+
+    if (!PB_LOOKUP_IS_READY(lookup))
+    {
+        if (!pb_field_lookup_init(desc))
+            return NULL;
     }
 
-    iter->pField = (char*)iter->message + data_offset;
+    return lookup;
+}
+#endif
+
+static bool load_descriptor_values(pb_field_iter_t *iter)
+{
+    field_info_t info;
+
+    if (iter->index >= iter->descriptor->field_count)
+        return false;
+
+#ifndef PB_NO_FIELD_LOOKUP
+    if (iter->descriptor->field_lookup != NULL && PB_LOOKUP_IS_READY(iter->descriptor->field_lookup))
+    {
+        /* Pre-unpacked by pb_field_lookup_init() */
+        const pb_field_lookup_entry_t *entry = &iter->descriptor->field_lookup->fields[iter->index];
+        info.data_offset = entry->data_offset;
+        info.tag = entry->tag;
+        info.data_size = entry->data_size;
+        info.array_size = entry->array_size;
+        info.type = entry->type;
+        info.size_offset = entry->size_offset;
+    }
+    else
+#endif
+    {
+        unpack_field_info(iter->descriptor, iter->field_info_index, &info);
+    }
+
+    iter->tag = info.tag;
+    iter->type = info.type;
+    iter->array_size = info.array_size;
+    iter->data_size = info.data_size;
+    iter->pField = (char*)iter->message + info.data_offset;
 
-    if (size_offset)
+    if (info.size_offset)
     {
-        iter->pSize = (char*)iter->pField - size_offset;
+        iter->pSize = (char*)iter->pField - info.size_offset;
     }
     else if (PB_HTYPE(iter->type) == PB_HTYPE_REPEATED &&
              (PB_ATYPE(iter->type) == PB_ATYPE_STATIC ||
@@ -118,6 +188,15 @@ static void advance_iterator(pb_field_iter_t *iter)
         iter->submessage_index = 0;
         iter->required_field_index = 0;
     }
+#ifndef PB_NO_FIELD_LOOKUP
+    else if (iter->descriptor->field_lookup != NULL && PB_LOOKUP_IS_READY(iter->descriptor->field_lookup))
+    {
+        const pb_field_lookup_entry_t *entry = &iter->descriptor->field_lookup->fields[iter->index];
+        iter->field_info_index = entry->field_info_index;
+        iter->required_field_index = entry->required_field_index;
+        iter->submessage_index = entry->submessage_index;
+    }
+#endif
     else
     {
         /* Increment indexes based on previous field type.
@@ -144,6 +223,78 @@ static void advance_iterator(pb_field_iter_t *iter)
     }
 }
 
+#ifndef PB_NO_FIELD_LOOKUP
+bool pb_field_lookup_init(const pb_msgdesc_t *desc)
+{
+    pb_field_lookup_t *lookup = desc->field_lookup;
+    pb_size_t field_info_index = 0;
+    pb_size_t required_field_index = 0;
+    pb_size_t submessage_index = 0;
+    bool complete = true;
+    pb_size_t i;
+    uint8_t state = PB_LOOKUP_EMPTY;
+
+    if (lookup == NULL)
+        return false;
+
+    /* Only the thread that moves the state from EMPTY to BUILDING writes
+     * the table; meanwhile other threads see it as not ready and use the
+     * linear search. */
+    if (!PB_LOOKUP_CLAIM(lookup, state))
+        return state == PB_LOOKUP_READY;
+
+    for (i = 0; i < desc->field_count; i++)
+    {
+        pb_field_lookup_entry_t *entry = &lookup->fields[i];
+        field_info_t info;
+        uint32_t word0;
+
+        unpack_field_info(desc, field_info_index, &info);
+        entry->data_offset = info.data_offset;
+        entry->field_info_index = field_info_index;
+        entry->required_field_index = required_field_index;
+        entry->submessage_index = submessage_index;
+        entry->tag = info.tag;
+        entry->data_size = info.data_size;
+        entry->array_size = info.array_size;
+        entry->type = info.type;
+        entry->size_offset = info.size_offset;
+
+        /* Extension ranges are never a match for pb_field_iter_find() */
+        if (PB_LTYPE(info.type) != PB_LTYPE_EXTENSION)
+        {
+            if (info.tag <= lookup->largest_tag)
+                lookup->tag_index[info.tag] = (pb_size_t)(i + 1);
+            else
+                complete = false;
+        }
+
+        word0 = PB_PROGMEM_READU32(desc->field_info[field_info_index]);
+        field_info_index = (pb_size_t)(field_info_index + (1 << (word0 & 3)));
+
+        if (PB_HTYPE(info.type) == PB_HTYPE_REQUIRED)
+            required_field_index++;
+
+        if (PB_LTYPE_IS_SUBMSG(info.type))
+            submessage_index++;
+    }
+
+    lookup->complete = complete;
+
+    /* Submessage tables are claimed one by one, so recursive message types
+     * (Template -> Metric -> Template) stop at the one already claimed. */
+    PB_LOOKUP_PUBLISH(lookup);
+
+    for (i = 0; i < submessage_index; i++)
+    {
+        if (desc->submsg_info[i] != NULL)
+            (void)pb_field_lookup_init(desc->submsg_info[i]);
+    }
+
+    return true;
+}
+#endif
+
 bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_msgdesc_t *desc, void *message)
 {
     memset(iter, 0, sizeof(*iter));
@@ -194,6 +345,32 @@ bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag)
         pb_size_t start = iter->index;
         uint32_t fieldinfo;
 
+#ifndef PB_NO_FIELD_LOOKUP
+        const pb_field_lookup_t *lookup = ready_lookup(iter->descriptor);
+
+        if (lookup != NULL)
+        {
+            pb_size_t found = (tag <= lookup->largest_tag) ? lookup->tag_index[tag] : 0;
+
+            if (found != 0)
+            {
+                /* Jump directly to the field */
+                const pb_field_lookup_entry_t *entry = &lookup->fields[found - 1];
+                iter->index = (pb_size_t)(found - 1);
+                iter->field_info_index = entry->field_info_index;
+                iter->required_field_index = entry->required_field_index;
+                iter->submessage_index = entry->submessage_index;
+                (void)load_descriptor_values(iter);
+                return true;
+            }
+            else if (lookup->complete)
+            {
+                /* Iterator is left where it was, as after a full search. */
+                return false;
+            }
+        }
+#endif
+
         do
         {
             /* Advance iterator but don't load values yet */
@@ -32,6 +32,17 @@ bool pb_field_iter_next(pb_field_iter_t *iter);
  * Returns false if no such field exists. */
 bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag);
 
+#ifndef PB_NO_FIELD_LOOKUP
+/* Build the tag lookup table of a message type and of all its submessage
+ * types. pb_field_iter_find() does this lazily on first use. With gcc or
+ * clang that is thread-safe: one thread builds a table while the others
+ * keep using the linear search. Other compilers need it called once before
+ * decoding from several threads.
+ * Returns false if the descriptor has no lookup table, or if another thread
+ * is building it. */
+bool pb_field_lookup_init(const pb_msgdesc_t *desc);
+#endif
+
 #ifdef PB_VALIDATE_UTF8
 /* Validate UTF-8 text string */
 bool pb_validate_utf8(const char *s);
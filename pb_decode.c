@@ -45,7 +45,7 @@ static bool checkreturn pb_skip_varint(pb_istream_t *stream);
 static bool checkreturn pb_skip_string(pb_istream_t *stream);
 
 #ifdef PB_ENABLE_MALLOC
-static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t data_size, size_t array_size);
+static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t data_size, size_t array_size, const pb_field_iter_t *field);
 static void initialize_pointer_field(void *pItem, pb_field_iter_t *field);
 static bool checkreturn pb_release_union_field(pb_istream_t *stream, pb_field_iter_t *field);
 static void pb_release_single_field(pb_field_iter_t *field);
@@ -167,11 +167,89 @@ pb_istream_t pb_istream_from_buffer(const pb_byte_t *buf, size_t bufsize)
  * Helper functions *
  ********************/
 
+/* Varints in memory buffers with at least 8 bytes left are decoded from a
+ * single 64-bit load: the first byte without the continuation bit ends the
+ * varint, and the 7-bit groups are packed together without a loop. Longer
+ * varints, short buffers and other streams use the byte at a time loop. */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ \
+    && !defined(PB_NO_FAST_VARINT)
+#define PB_FAST_VARINT 1
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+static bool pb_is_buffer_stream(const pb_istream_t *stream)
+{
+#ifdef PB_BUFFER_ONLY
+    PB_UNUSED(stream);
+    return true;
+#else
+    return stream->callback == buf_read;
+#endif
+}
+
+/* Decode the varint at the stream position without consuming it. Returns
+ * its length, or 0 if it does not fit the fast path. */
+static size_t pb_fast_varint(const pb_istream_t *stream, uint64_t *dest)
+{
+    uint64_t word, stop;
+
+    if (stream->bytes_left < 8 || !pb_is_buffer_stream(stream))
+        return 0;
+
+    memcpy(&word, stream->state, 8);
+    stop = ~word & UINT64_C(0x8080808080808080);
+    if (stop == 0)
+        return 0;
+    /* keep the bytes up to and including the last one */
+    word &= stop ^ (stop - 1);
+#if defined(__BMI2__)
+    *dest = _pext_u64(word, UINT64_C(0x7F7F7F7F7F7F7F7F));
+#else
+    *dest = (word & UINT64_C(0x7F)) | ((word >> 1) & UINT64_C(0x3F80)) | ((word >> 2) & UINT64_C(0x1FC000)) |
+            ((word >> 3) & UINT64_C(0xFE00000)) | ((word >> 4) & UINT64_C(0x7F0000000)) |
+            ((word >> 5) & UINT64_C(0x3F800000000)) | ((word >> 6) & UINT64_C(0x1FC0000000000)) |
+            ((word >> 7) & UINT64_C(0xFE000000000000));
+#endif
+    return ((size_t)__builtin_ctzll(stop) >> 3) + 1;
+}
+
+static void pb_fast_skip(pb_istream_t *stream, size_t count)
+{
+    stream->state = (pb_byte_t*)stream->state + count;
+    stream->bytes_left -= count;
+}
+#endif
+
 static bool checkreturn pb_decode_varint32_eof(pb_istream_t *stream, uint32_t *dest, bool *eof)
 {
     pb_byte_t byte;
     uint32_t result;
     
+#ifdef PB_FAST_VARINT
+    if (stream->bytes_left > 0 && pb_is_buffer_stream(stream))
+    {
+        uint64_t value;
+        size_t length;
+
+        /* 1 byte values, e.g. most tags */
+        if (*(const pb_byte_t*)stream->state < 0x80)
+        {
+            *dest = *(const pb_byte_t*)stream->state;
+            pb_fast_skip(stream, 1);
+            return true;
+        }
+        /* overlong and sign extended values take the checked loop below */
+        length = pb_fast_varint(stream, &value);
+        if (length != 0 && length <= 5 && value <= UINT32_MAX)
+        {
+            *dest = (uint32_t)value;
+            pb_fast_skip(stream, length);
+            return true;
+        }
+    }
+#endif
+
     if (!pb_readbyte(stream, &byte))
     {
         if (stream->bytes_left == 0)
@@ -241,6 +319,15 @@ bool checkreturn pb_decode_varint(pb_istream_t *stream, uint64_t *dest)
     uint_fast8_t bitpos = 0;
     uint64_t result = 0;
     
+#ifdef PB_FAST_VARINT
+    size_t length = pb_fast_varint(stream, dest);
+    if (length != 0)
+    {
+        pb_fast_skip(stream, length);
+        return true;
+    }
+#endif
+
     do
     {
         if (bitpos >= 64)
@@ -542,8 +629,9 @@ static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t
 /* Allocate storage for the field and store the pointer at iter->pData.
  * array_size is the number of entries to reserve in an array.
  * Zero size is not allowed, use pb_free() for releasing.
+ * field is passed on to the allocator as a hint of what is being allocated.
  */
-static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t data_size, size_t array_size)
+static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t data_size, size_t array_size, const pb_field_iter_t *field)
 {    
     void *ptr = *(void**)pData;
     
@@ -580,7 +668,7 @@ static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t
     /* Allocate new or expand previous allocation */
     /* Note: on failure the old pointer will remain in the structure,
      * the message must be freed by caller also on error return. */
-    ptr = pb_realloc(ptr, array_size * data_size);
+    ptr = pb_realloc_field(ptr, array_size * data_size, field);
     if (ptr == NULL)
         PB_RETURN_ERROR(stream, "realloc failed");
     
@@ -647,7 +735,7 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
             }
             else
             {
-                if (!allocate_field(stream, field->pField, field->data_size, 1))
+                if (!allocate_field(stream, field->pField, field->data_size, 1, field))
                     return false;
                 
                 field->pData = *(void**)field->pField;
@@ -690,7 +778,7 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
                         else
                             allocated_size += 1;
                         
-                        if (!allocate_field(&substream, field->pField, field->data_size, allocated_size))
+                        if (!allocate_field(&substream, field->pField, field->data_size, allocated_size, field))
                         {
                             status = false;
                             break;
@@ -724,7 +812,7 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
                 if (!check_wire_type(wire_type, field))
                     PB_RETURN_ERROR(stream, "wrong wire type");
 
-                if (!allocate_field(stream, field->pField, field->data_size, (size_t)(*size + 1)))
+                if (!allocate_field(stream, field->pField, field->data_size, (size_t)(*size + 1), field))
                     return false;
             
                 field->pData = *(char**)field->pField + field->data_size * (*size);
@@ -1328,6 +1416,56 @@ void pb_release(const pb_msgdesc_t *fields, void *dest_struct)
         pb_release_single_field(&iter);
     } while (pb_field_iter_next(&iter));
 }
+
+/* Thread local storage for the installed allocator, where available. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__) && \
+    (defined(__linux__) || defined(__APPLE__) || defined(_WIN32))
+#define PB_THREAD_LOCAL _Thread_local
+#else
+#define PB_THREAD_LOCAL
+#endif
+
+static PB_THREAD_LOCAL const pb_allocator_t *current_allocator = NULL;
+
+const pb_allocator_t *pb_set_allocator(const pb_allocator_t *allocator)
+{
+    const pb_allocator_t *previous = current_allocator;
+    current_allocator = allocator;
+    return previous;
+}
+
+void *pb_allocator_realloc(void *ptr, size_t size)
+{
+    const pb_allocator_t *allocator = current_allocator;
+
+    if (allocator == NULL)
+        return realloc(ptr, size);
+
+    return allocator->realloc_fn(allocator->ctx, ptr, size);
+}
+
+void *pb_allocator_realloc_field(void *ptr, size_t size, const pb_field_iter_t *field)
+{
+    const pb_allocator_t *allocator = current_allocator;
+
+    if (allocator == NULL)
+        return realloc(ptr, size);
+
+    if (allocator->field_realloc_fn != NULL)
+        return allocator->field_realloc_fn(allocator->ctx, ptr, size, field);
+
+    return allocator->realloc_fn(allocator->ctx, ptr, size);
+}
+
+void pb_allocator_free(void *ptr)
+{
+    const pb_allocator_t *allocator = current_allocator;
+
+    if (allocator == NULL)
+        free(ptr);
+    else
+        allocator->free_fn(allocator->ctx, ptr);
+}
 #endif
 
 /* Field decoders */
@@ -1532,7 +1670,7 @@ static bool checkreturn pb_dec_bytes(pb_istream_t *stream, const pb_field_iter_t
         if (stream->bytes_left < size)
             PB_RETURN_ERROR(stream, "end-of-stream");
 
-        if (!allocate_field(stream, field->pData, alloc_size, 1))
+        if (!allocate_field(stream, field->pData, alloc_size, 1, field))
             return false;
         dest = *(pb_bytes_array_t**)field->pData;
 #endif
@@ -1574,7 +1712,7 @@ static bool checkreturn pb_dec_string(pb_istream_t *stream, const pb_field_iter_
         if (stream->bytes_left < size)
             PB_RETURN_ERROR(stream, "end-of-stream");
 
-        if (!allocate_field(stream, field->pData, alloc_size, 1))
+        if (!allocate_field(stream, field->pData, alloc_size, 1, field))
             return false;
         dest = *(pb_byte_t**)field->pData;
 #endif
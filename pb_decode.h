@@ -113,6 +113,31 @@ bool pb_decode_ex(pb_istream_t *stream, const pb_msgdesc_t *fields, void *dest_s
  * pb_decode() returns with an error, the message is already released.
  */
 void pb_release(const pb_msgdesc_t *fields, void *dest_struct);
+
+/* Pluggable allocator behind the default pb_realloc() and pb_free().
+ * realloc_fn must behave like realloc(), free_fn like free(); ctx is passed
+ * through unchanged. field_realloc_fn is optional: if set, it is used instead
+ * of realloc_fn for the pointer fields of a message being decoded, and gets
+ * the field as a hint of what is allocated (field->data_size is the size of
+ * one array entry, field->submsg_desc the type of submessage entries). */
+typedef struct pb_allocator_s pb_allocator_t;
+struct pb_allocator_s {
+    void *(*realloc_fn)(void *ctx, void *ptr, size_t size);
+    void (*free_fn)(void *ctx, void *ptr);
+    void *ctx;
+    void *(*field_realloc_fn)(void *ctx, void *ptr, size_t size, const pb_field_iter_t *field);
+};
+
+/* Install an allocator for the calling thread (on targets without thread
+ * local storage, for the whole program). NULL restores realloc()/free().
+ * Returns the previously installed allocator. Memory must be released with
+ * the same allocator that allocated it. */
+const pb_allocator_t *pb_set_allocator(const pb_allocator_t *allocator);
+
+/* Allocate/release through the currently installed allocator. */
+void *pb_allocator_realloc(void *ptr, size_t size);
+void *pb_allocator_realloc_field(void *ptr, size_t size, const pb_field_iter_t *field);
+void pb_allocator_free(void *ptr);
 #endif
 
 
@@ -14,16 +14,70 @@
  ********************************************************************************/
 
 #include "string.h"
+#include "stdlib.h"
 #include "sparkplugb_arduino.hpp"
 #include "pb.h"
 #include "pb_encode.h"
 #include "pb_decode.h"
+#include "pb_common.h"
+
+#ifdef ARDUINO
+#include <Arduino.h> // millis() for sparkplugb_arduino_clock, yield()
+#include <Client.h> // transport of sparkplugb_arduino_mqtt
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+// POSIX hosts: memory-mapped history files, yielding while waiting
+#define SPARKPLUGB_HAVE_POSIX 1
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#if defined(__BMI2__)
+#include <immintrin.h> // _pdep_u64 for the DataSet varint writer
+#endif
+
+#ifdef SPARKPLUGB_HAVE_POSIX
+//------------------------------ Worker threads ------------------------------//
+// rows or metrics a worker claims at a time
+#define SPARKPLUGB_PARALLEL_CHUNK 256
+// upper bound on worker threads
+#define SPARKPLUGB_PARALLEL_MAX_THREADS 64
+
+// run worker(job) on threads threads, the calling thread being one of them,
+// and wait for them all; fewer run if threads can not be created
+static void run_workers(void* (*worker)(void*), void* job, unsigned threads){
+  pthread_t workers[SPARKPLUGB_PARALLEL_MAX_THREADS];
+  unsigned started, t;
+
+  if(threads > SPARKPLUGB_PARALLEL_MAX_THREADS) threads = SPARKPLUGB_PARALLEL_MAX_THREADS;
+  for(started=0; started+1<threads; started++){
+    if(pthread_create(&workers[started], NULL, worker, job) != 0) break;
+  }
+  worker(job);
+  for(t=0; t<started; t++) pthread_join(workers[t], NULL);
+}
+#endif
 
 //----------------------------------------------------------------------------//
 //                               Encoder
 //----------------------------------------------------------------------------//
 sparkplugb_arduino_encoder::sparkplugb_arduino_encoder(){
   this->payload = NULL;
+  this->omit_timestamps = false;
+  this->encode_threads = 0;
+  this->pool_capacity = 0;
 }
 
 // set the payload pointer
@@ -61,7 +115,7 @@ size_t sparkplugb_arduino_encoder::encode(
 
   // Create the stream
   node_stream = pb_ostream_from_buffer(buffer, buffer_length);
-  node_status = pb_encode(&node_stream, org_eclipse_tahu_protobuf_Payload_fields, p);
+  node_status = this->encode_payload(&node_stream, p);
   message_length = node_stream.bytes_written;
 
   if (!node_status)
@@ -70,15 +124,559 @@ size_t sparkplugb_arduino_encoder::encode(
   return message_length;
 }
 
+// encode after the headroom, then put the header in front of the payload
+size_t sparkplugb_arduino_encoder::encode_publish(const char* topic, uint8_t* buffer,
+    size_t buffer_length, uint8_t** frame)
+{
+  size_t headroom;
+  size_t payload_length;
+
+  if(topic == NULL || buffer == NULL || frame == NULL) return -1;
+  headroom = SPARKPLUGB_PUBLISH_HEADROOM(strlen(topic));
+  if(buffer_length < headroom) return -1;
+
+  payload_length = this->encode(buffer + headroom, buffer_length - headroom);
+  if(payload_length == (size_t)-1) return -1;
+  return publish_header(buffer + headroom, payload_length, topic, 0, 0, frame);
+}
+
+// Written back to front: payload, packet id, topic, topic length, then the
+// remaining length, whose size is only known once the rest is
+size_t sparkplugb_arduino_encoder::publish_header(uint8_t* payload, size_t payload_length,
+    const char* topic, uint8_t flags, uint16_t packet_id, uint8_t** frame)
+{
+  uint8_t length_bytes[4];
+  uint8_t* p = payload;
+  size_t topic_length;
+  size_t remaining;
+  uint32_t n = 0;
+
+  if(topic == NULL || frame == NULL) return -1;
+  topic_length = strlen(topic);
+  if(topic_length > 0xFFFF) return -1;
+
+  if(flags & (SPARKPLUGB_MQTT_QOS1 | SPARKPLUGB_MQTT_QOS2)){
+    *--p = (uint8_t)packet_id;
+    *--p = (uint8_t)(packet_id >> 8);
+  }
+  p -= topic_length;
+  memcpy(p, topic, topic_length);
+  *--p = (uint8_t)topic_length;
+  *--p = (uint8_t)(topic_length >> 8);
+
+  // remaining length: at most 268435455, 7 bits per byte, low bits first
+  remaining = (size_t)(payload - p) + payload_length;
+  if(remaining > 268435455u) return -1;
+  do{
+    length_bytes[n] = (uint8_t)(remaining & 0x7F);
+    remaining >>= 7;
+    if(remaining > 0) length_bytes[n] |= 0x80;
+    n++;
+  }while(remaining > 0);
+  p -= n;
+  memcpy(p, length_bytes, n);
+  *--p = (uint8_t)(0x30 | (flags & 0x07)); // PUBLISH
+
+  *frame = p;
+  return (size_t)(payload - p) + payload_length;
+}
+
+// pb_encode the payload, unless metric timestamps are omitted, a metric is
+// a DataSet or the metrics are encoded on several threads: then timestamp and
+// metrics, the first two payload fields, are written by hand and pb_encode
+// writes the remaining fields
+bool sparkplugb_arduino_encoder::encode_payload(pb_ostream_t* stream,
+    org_eclipse_tahu_protobuf_Payload* p)
+{
+  org_eclipse_tahu_protobuf_Payload rest;
+  bool omit = this->omit_timestamps && p->has_timestamp;
+  bool by_hand = omit || (this->encode_threads > 1 && p->metrics_count >= SPARKPLUGB_PARALLEL_MIN_METRICS);
+  pb_size_t i;
+
+  for(i=0; i<p->metrics_count && !by_hand; i++){
+    by_hand = p->metrics[i].which_value == org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag;
+  }
+  if(!by_hand) return pb_encode(stream, org_eclipse_tahu_protobuf_Payload_fields, p);
+
+  if(p->has_timestamp &&
+     (!pb_encode_tag(stream, PB_WT_VARINT, org_eclipse_tahu_protobuf_Payload_timestamp_tag) ||
+      !pb_encode_varint(stream, p->timestamp)))
+    return false;
+
+  if(!this->encode_metrics(stream, p, omit)) return false;
+
+  rest = *p;
+  rest.has_timestamp = false;
+  rest.metrics = NULL;
+  rest.metrics_count = 0;
+  return pb_encode(stream, org_eclipse_tahu_protobuf_Payload_fields, &rest);
+}
+
+// true if the metric's timestamp is left out, see set_omit_metric_timestamps()
+static inline bool omit_metric_timestamp(const org_eclipse_tahu_protobuf_Payload* p,
+    const org_eclipse_tahu_protobuf_Payload_Metric* metric, bool omit)
+{
+  return omit && metric->has_timestamp && metric->timestamp == p->timestamp;
+}
+
+// write payload.metrics, on several threads for large payloads going to a buffer
+bool sparkplugb_arduino_encoder::encode_metrics(pb_ostream_t* stream,
+    org_eclipse_tahu_protobuf_Payload* p, bool omit)
+{
+  pb_size_t i;
+
+#ifdef SPARKPLUGB_HAVE_POSIX
+  if(this->encode_threads > 1 && p->metrics_count >= SPARKPLUGB_PARALLEL_MIN_METRICS &&
+     stream->callback == pb_ostream_from_buffer(NULL, 0).callback)
+    return this->encode_metrics_parallel(stream, p, omit);
+#endif
+  for(i=0; i<p->metrics_count; i++){
+    if(!this->encode_metric(stream, &p->metrics[i], omit_metric_timestamp(p, &p->metrics[i], omit)))
+      return false;
+  }
+  return true;
+}
+
+// write one payload.metrics entry, without its timestamp if omit_timestamp
+bool sparkplugb_arduino_encoder::encode_metric(pb_ostream_t* stream,
+    const org_eclipse_tahu_protobuf_Payload_Metric* metric, bool omit_timestamp)
+{
+  org_eclipse_tahu_protobuf_Payload_Metric m;
+
+  if(omit_timestamp){
+    m = *metric;
+    m.has_timestamp = false;
+    metric = &m;
+  }
+  if(metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag)
+    return encode_dataset_metric(stream, metric);
+  return pb_encode_tag(stream, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_metrics_tag) &&
+         pb_encode_submessage(stream, org_eclipse_tahu_protobuf_Payload_Metric_fields, metric);
+}
+
+//------------------------- DataSet rows kernel ------------------------------//
+// Each DataSet cell is a DataSetValue submessage of its own, so pb_encode
+// walks the field descriptors of every cell twice, once to size it and once
+// to write it. Rows whose cells all hold numbers or booleans are instead
+// sized and written here directly, with the same bytes pb_encode would give.
+
+// keys of the fields written by the kernel
+#define SPARKPLUGB_KEY_ROWS ((org_eclipse_tahu_protobuf_Payload_DataSet_rows_tag << 3) | PB_WT_STRING)
+#define SPARKPLUGB_KEY_ELEMENTS ((org_eclipse_tahu_protobuf_Payload_DataSet_Row_elements_tag << 3) | PB_WT_STRING)
+#define SPARKPLUGB_CELL_KEY(field, wire_type) \
+  ((org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_##field##_tag << 3) | wire_type)
+// rows are staged here and handed to pb_write in chunks
+#define SPARKPLUGB_ROWS_CHUNK 256
+// a cell is at most 13 bytes, plus 8 for the whole-word varint store
+#define SPARKPLUGB_CELL_MAX 24
+
+// little endian bytes of a float or double, as protobuf fixed32/fixed64
+static inline void write_fixed(uint8_t* p, const void* value, uint32_t size){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(p, value, size);
+#else
+  const uint8_t* bytes = (const uint8_t*)value;
+  uint32_t i;
+
+  for(i=0; i<size; i++) p[i] = bytes[size - 1 - i];
+#endif
+}
+
+static inline uint32_t varint_size(uint64_t value){
+  if(value < 0x80) return 1;
+  return (uint32_t)(63 - __builtin_clzll(value)) / 7 + 1;
+}
+
+// write a varint; values below 2^56 are built in one 64-bit word and stored
+// at once, so p must have 8 bytes of room
+static inline uint32_t write_varint(uint8_t* p, uint64_t value){
+  uint32_t size = varint_size(value);
+  uint64_t word;
+  uint32_t i;
+
+  if(size <= 8){
+#if defined(__BMI2__)
+    word = _pdep_u64(value, 0x7F7F7F7F7F7F7F7FULL);
+#else
+    word = (value & 0x7F) | ((value << 1) & 0x7F00) | ((value << 2) & 0x7F0000) |
+           ((value << 3) & 0x7F000000ULL) | ((value << 4) & 0x7F00000000ULL) |
+           ((value << 5) & 0x7F0000000000ULL) | ((value << 6) & 0x7F000000000000ULL) |
+           ((value << 7) & 0x7F00000000000000ULL);
+#endif
+    // continuation bit on every byte but the last
+    word |= 0x8080808080808080ULL & ((1ULL << (8 * (size - 1))) - 1);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(p, &word, 8);
+#else
+    for(i=0; i<8; i++) p[i] = (uint8_t)(word >> (8 * i));
+#endif
+    return size;
+  }
+  for(i=0; value >= 0x80; i++){
+    p[i] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  p[i] = (uint8_t)value;
+  return i + 1;
+}
+
+// bytes of a cell after its length, or -1 if the kernel does not handle it
+static inline int32_t cell_body_size(const org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue* cell){
+  switch(cell->which_value){
+    case 0: return 0;
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_int_value_tag:
+      return 1 + varint_size(cell->value.int_value);
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_long_value_tag:
+      return 1 + varint_size(cell->value.long_value);
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_float_value_tag: return 1 + 4;
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_double_value_tag: return 1 + 8;
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_boolean_value_tag: return 1 + 1;
+    default: return -1; // strings and extensions are left to pb_encode
+  }
+}
+
+// encoded size of a row's cells, or -1 if the kernel does not handle it
+static int64_t row_size(const org_eclipse_tahu_protobuf_Payload_DataSet_Row* row){
+  int64_t size = 0;
+  int32_t body;
+  pb_size_t c;
+
+  if(row->extensions != NULL || (row->elements_count > 0 && row->elements == NULL)) return -1;
+  for(c=0; c<row->elements_count; c++){
+    body = cell_body_size(&row->elements[c]);
+    if(body < 0) return -1;
+    size += 2 + body; // key and one byte length
+  }
+  return size;
+}
+
+static inline uint32_t write_cell(uint8_t* p,
+    const org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue* cell)
+{
+  uint32_t n = 3;
+
+  p[0] = SPARKPLUGB_KEY_ELEMENTS;
+  switch(cell->which_value){
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_int_value_tag:
+      p[2] = SPARKPLUGB_CELL_KEY(int_value, PB_WT_VARINT);
+      n += write_varint(p + 3, cell->value.int_value);
+      break;
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_long_value_tag:
+      p[2] = SPARKPLUGB_CELL_KEY(long_value, PB_WT_VARINT);
+      n += write_varint(p + 3, cell->value.long_value);
+      break;
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_float_value_tag:
+      p[2] = SPARKPLUGB_CELL_KEY(float_value, PB_WT_32BIT);
+      n += 4;
+      write_fixed(p + 3, &cell->value.float_value, 4);
+      break;
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_double_value_tag:
+      p[2] = SPARKPLUGB_CELL_KEY(double_value, PB_WT_64BIT);
+      n += 8;
+      write_fixed(p + 3, &cell->value.double_value, 8);
+      break;
+    case org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_boolean_value_tag:
+      p[2] = SPARKPLUGB_CELL_KEY(boolean_value, PB_WT_VARINT);
+      p[3] = cell->value.boolean_value ? 1 : 0;
+      n += 1;
+      break;
+    default: // empty cell
+      n = 2;
+      break;
+  }
+  p[1] = (uint8_t)(n - 2);
+  return n;
+}
+
+// sum of the encoded rows field, or -1 if a row is not handled by the kernel
+static int64_t dataset_rows_size(const org_eclipse_tahu_protobuf_Payload_DataSet* dataset){
+  int64_t total = 0;
+  int64_t size;
+  pb_size_t r;
+
+  if(dataset->rows_count > 0 && dataset->rows == NULL) return -1;
+  for(r=0; r<dataset->rows_count; r++){
+    size = row_size(&dataset->rows[r]);
+    if(size < 0) return -1;
+    total += 1 + varint_size((uint64_t)size) + size;
+  }
+  return total;
+}
+
+// write the rows field of a DataSet accepted by dataset_rows_size()
+static bool write_dataset_rows(pb_ostream_t* stream, const org_eclipse_tahu_protobuf_Payload_DataSet* dataset){
+  uint8_t chunk[SPARKPLUGB_ROWS_CHUNK + SPARKPLUGB_CELL_MAX];
+  const org_eclipse_tahu_protobuf_Payload_DataSet_Row* row;
+  uint32_t used = 0;
+  pb_size_t r, c;
+
+  for(r=0; r<dataset->rows_count; r++){
+    row = &dataset->rows[r];
+    chunk[used++] = SPARKPLUGB_KEY_ROWS;
+    used += write_varint(chunk + used, (uint64_t)row_size(row));
+    for(c=0; c<row->elements_count; c++){
+      if(used > SPARKPLUGB_ROWS_CHUNK - SPARKPLUGB_CELL_MAX){
+        if(!pb_write(stream, chunk, used)) return false;
+        used = 0;
+      }
+      used += write_cell(chunk + used, &row->elements[c]);
+    }
+    if(used > SPARKPLUGB_ROWS_CHUNK - SPARKPLUGB_CELL_MAX){
+      if(!pb_write(stream, chunk, used)) return false;
+      used = 0;
+    }
+  }
+  return pb_write(stream, chunk, used);
+}
+
+// write a DataSet metric: pb_encode writes the metric and DataSet fields
+// before the rows, the kernel writes the rows
+bool sparkplugb_arduino_encoder::encode_dataset_metric(pb_ostream_t* stream,
+    const org_eclipse_tahu_protobuf_Payload_Metric* metric)
+{
+  org_eclipse_tahu_protobuf_Payload_Metric head;
+  org_eclipse_tahu_protobuf_Payload_DataSet dataset_head;
+  const org_eclipse_tahu_protobuf_Payload_DataSet* dataset = &metric->value.dataset_value;
+  size_t head_size, dataset_head_size, dataset_size, metric_size;
+  int64_t rows_size;
+
+  rows_size = (dataset->extensions == NULL) ? dataset_rows_size(dataset) : -1;
+  if(rows_size < 0){
+    return pb_encode_tag(stream, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_metrics_tag) &&
+           pb_encode_submessage(stream, org_eclipse_tahu_protobuf_Payload_Metric_fields, metric);
+  }
+
+  // dataset_value is the last metric field and rows the last DataSet field,
+  // so the bytes come out in the same order as from pb_encode
+  head = *metric;
+  head.which_value = 0;
+  if(!pb_get_encoded_size(&head_size, org_eclipse_tahu_protobuf_Payload_Metric_fields, &head))
+    return false;
+  dataset_head = *dataset;
+  dataset_head.rows_count = 0;
+  if(!pb_get_encoded_size(&dataset_head_size, org_eclipse_tahu_protobuf_Payload_DataSet_fields, &dataset_head))
+    return false;
+  dataset_size = dataset_head_size + (size_t)rows_size;
+  metric_size = head_size + varint_size((org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag << 3) | PB_WT_STRING) +
+                varint_size(dataset_size) + dataset_size;
+
+  if(!pb_encode_tag(stream, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_metrics_tag) ||
+     !pb_encode_varint(stream, metric_size))
+    return false;
+  if(stream->callback == NULL){
+    // sizing only
+    return pb_write(stream, NULL, metric_size);
+  }
+  if(!pb_encode(stream, org_eclipse_tahu_protobuf_Payload_Metric_fields, &head) ||
+     !pb_encode_tag(stream, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag) ||
+     !pb_encode_varint(stream, dataset_size))
+    return false;
+  return pb_encode(stream, org_eclipse_tahu_protobuf_Payload_DataSet_fields, &dataset_head) &&
+         write_dataset_rows(stream, dataset);
+}
+
+#ifdef SPARKPLUGB_HAVE_POSIX
+//------------------------ Parallel metric encode ----------------------------//
+// The metrics are cut into ranges of SPARKPLUGB_PARALLEL_CHUNK. Workers first
+// size every range, then each range is written straight to its offset in the
+// output buffer, so nothing is copied after the workers are done. The size of
+// each metric is kept from the first pass, so the second pass writes it
+// without sizing it again as pb_encode_submessage() would.
+
+struct sparkplugb_metric_job{
+  sparkplugb_arduino_encoder* encoder;
+  org_eclipse_tahu_protobuf_Payload* payload;
+  bool omit;
+  pb_byte_t* out; // NULL while sizing
+  size_t* sizes; // bytes of each range
+  size_t* offsets; // offset of each range in out
+  size_t* metric_sizes; // Metric submessage size of each metric
+  size_t ranges;
+  size_t next; // next unclaimed range, shared by all workers
+  bool failed;
+};
+
+void* sparkplugb_arduino_encoder::encode_metric_ranges(void* arg){
+  sparkplugb_metric_job* job = (sparkplugb_metric_job*)arg;
+  org_eclipse_tahu_protobuf_Payload* p = job->payload;
+  const org_eclipse_tahu_protobuf_Payload_Metric* metric;
+  org_eclipse_tahu_protobuf_Payload_Metric m;
+  pb_ostream_t stream;
+  size_t range, first, last, i;
+  bool omit, ok;
+
+  for(;;){
+    range = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if(range >= job->ranges || __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) break;
+    first = range * SPARKPLUGB_PARALLEL_CHUNK;
+    last = first + SPARKPLUGB_PARALLEL_CHUNK < p->metrics_count ? first + SPARKPLUGB_PARALLEL_CHUNK : p->metrics_count;
+    if(job->out == NULL){
+      stream = PB_OSTREAM_SIZING;
+    }
+    else{
+      stream = pb_ostream_from_buffer(job->out + job->offsets[range], job->sizes[range]);
+    }
+    for(i=first; i<last; i++){
+      metric = &p->metrics[i];
+      omit = omit_metric_timestamp(p, metric, job->omit);
+      if(metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag){
+        if(!job->encoder->encode_metric(&stream, metric, omit)) break;
+        continue;
+      }
+      // the payload is shared by all workers, so it is only read
+      if(omit){
+        m = *metric;
+        m.has_timestamp = false;
+        metric = &m;
+      }
+      if(job->out == NULL){
+        ok = pb_get_encoded_size(&job->metric_sizes[i], org_eclipse_tahu_protobuf_Payload_Metric_fields, metric) &&
+             pb_encode_tag(&stream, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_metrics_tag) &&
+             pb_encode_varint(&stream, job->metric_sizes[i]) &&
+             pb_write(&stream, NULL, job->metric_sizes[i]);
+      }
+      else{
+        ok = pb_encode_tag(&stream, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_metrics_tag) &&
+             pb_encode_varint(&stream, job->metric_sizes[i]) &&
+             pb_encode(&stream, org_eclipse_tahu_protobuf_Payload_Metric_fields, metric);
+      }
+      if(!ok) break;
+    }
+    if(i < last || (job->out != NULL && stream.bytes_written != job->sizes[range])){
+      __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+      break;
+    }
+    if(job->out == NULL) job->sizes[range] = stream.bytes_written;
+  }
+  return NULL;
+}
+
+// write payload.metrics on encode_threads threads; stream writes to a buffer
+bool sparkplugb_arduino_encoder::encode_metrics_parallel(pb_ostream_t* stream,
+    org_eclipse_tahu_protobuf_Payload* p, bool omit)
+{
+  sparkplugb_metric_job job;
+  unsigned threads = this->encode_threads;
+  size_t total = 0, r;
+
+  job.encoder = this;
+  job.payload = p;
+  job.omit = omit;
+  job.out = NULL;
+  job.ranges = (p->metrics_count + SPARKPLUGB_PARALLEL_CHUNK - 1) / SPARKPLUGB_PARALLEL_CHUNK;
+  job.sizes = (size_t*)malloc((2 * job.ranges + p->metrics_count) * sizeof(size_t));
+  job.offsets = job.sizes + job.ranges;
+  job.metric_sizes = job.offsets + job.ranges;
+  job.next = 0;
+  job.failed = false;
+  if(job.sizes == NULL) return false;
+  if(threads > job.ranges) threads = job.ranges;
+
+  run_workers(encode_metric_ranges, &job, threads);
+  for(r=0; r<job.ranges; r++){
+    job.offsets[r] = total;
+    total += job.sizes[r];
+  }
+  if(job.failed || total > stream->max_size - stream->bytes_written){
+    free(job.sizes);
+    return false;
+  }
+
+  job.out = (pb_byte_t*)stream->state;
+  job.next = 0;
+  run_workers(encode_metric_ranges, &job, threads);
+  free(job.sizes);
+  if(job.failed) return false;
+
+  // advance the buffer stream past the metrics, as pb_write() would
+  stream->state = job.out + total;
+  stream->bytes_written += total;
+  return true;
+}
+#endif
+
+void sparkplugb_arduino_encoder::set_omit_metric_timestamps(bool enable){
+  this->omit_timestamps = enable;
+}
+
+void sparkplugb_arduino_encoder::set_encode_threads(unsigned threads){
+  this->encode_threads = threads;
+}
+
 // assign payload.metrics and payload.metrics_count
 bool sparkplugb_arduino_encoder::set_metrics(org_eclipse_tahu_protobuf_Payload_Metric* metrics, int count){
   if(this->payload == NULL) return false;
 
   this->payload->metrics = metrics;
   this->payload->metrics_count = count;
+  this->pool_capacity = count;
+  return true;
+}
+
+// assign an empty metric pool to be filled by add()
+bool sparkplugb_arduino_encoder::set_metric_pool(org_eclipse_tahu_protobuf_Payload_Metric* metrics, int capacity){
+  if(this->payload == NULL || capacity < 0) return false;
+
+  this->payload->metrics = metrics;
+  this->payload->metrics_count = 0;
+  this->pool_capacity = (metrics == NULL) ? 0 : capacity;
   return true;
 }
 
+void sparkplugb_arduino_encoder::clear_metrics(){
+  if(this->payload != NULL) this->payload->metrics_count = 0;
+}
+
+// claim the next pool entry and fill in everything but the value
+org_eclipse_tahu_protobuf_Payload_Metric* sparkplugb_arduino_encoder::next_metric(const char* name,
+    bool has_alias, uint64_t alias, uint32_t datatype)
+{
+  org_eclipse_tahu_protobuf_Payload_Metric* metric;
+
+  if(this->payload == NULL || this->payload->metrics == NULL ||
+     this->payload->metrics_count >= this->pool_capacity) return NULL;
+
+  metric = &this->payload->metrics[this->payload->metrics_count++];
+  *metric = org_eclipse_tahu_protobuf_Payload_Metric_init_zero;
+  metric->name = (char*)name;
+  metric->has_alias = has_alias;
+  metric->alias = alias;
+  metric->has_datatype = true;
+  metric->datatype = datatype;
+  return metric;
+}
+
+org_eclipse_tahu_protobuf_Payload_Metric* sparkplugb_arduino_encoder::add_null(const char* name, uint32_t datatype){
+  org_eclipse_tahu_protobuf_Payload_Metric* metric = this->next_metric(name, false, 0, datatype);
+
+  if(metric == NULL) return NULL;
+  metric->has_is_null = true;
+  metric->is_null = true;
+  return metric;
+}
+
+org_eclipse_tahu_protobuf_Payload_Metric* sparkplugb_arduino_encoder::add_dataset(const char* name,
+    uint32_t columns, const char* const* column_names, const uint32_t* types,
+    org_eclipse_tahu_protobuf_Payload_DataSet_Row* rows, uint32_t rows_count)
+{
+  org_eclipse_tahu_protobuf_Payload_Metric* metric;
+  org_eclipse_tahu_protobuf_Payload_DataSet* dataset;
+
+  metric = this->next_metric(name, false, 0, METRIC_DATA_TYPE_DATASET);
+  if(metric == NULL) return NULL;
+  metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag;
+  dataset = &metric->value.dataset_value;
+  dataset->has_num_of_columns = true;
+  dataset->num_of_columns = columns;
+  dataset->columns_count = columns;
+  dataset->columns = (char**)column_names;
+  dataset->types_count = columns;
+  dataset->types = (uint32_t*)types;
+  dataset->rows_count = rows_count;
+  dataset->rows = rows;
+  return metric;
+}
+
 // zero out payload and all metrics
 void sparkplugb_arduino_encoder::clear_payload(){
   unsigned int i;
@@ -90,30 +688,2922 @@ void sparkplugb_arduino_encoder::clear_payload(){
   *this->payload = org_eclipse_tahu_protobuf_Payload_init_zero;
 }
 
+//----------------------------------------------------------------------------//
+//                              Birth Cache
+//----------------------------------------------------------------------------//
+// buffer layout: [headroom: timestamp, bdSeq metric][metrics][seq, uuid, body]
+// the first two parts are written right-aligned against the cached metrics
+#define SPARKPLUGB_FNV_OFFSET 0xcbf29ce484222325ULL
+#define SPARKPLUGB_FNV_PRIME 0x100000001b3ULL
+
+// FNV-1a over length bytes, continuing from hash
+static uint64_t sparkplugb_hash(uint64_t hash, const char* data, size_t length){
+  size_t i;
+  for(i=0; i<length; i++){
+    hash ^= (uint8_t)data[i];
+    hash *= SPARKPLUGB_FNV_PRIME;
+  }
+  return hash;
+}
+
+// a whole word in one FNV step; like the byte steps it is a bijection of
+// hash, so a change in any one hashed value always changes the result
+static uint64_t sparkplugb_hash_u64(uint64_t hash, uint64_t value){
+  return (hash ^ value) * SPARKPLUGB_FNV_PRIME;
+}
+
+// the terminator is hashed too, so that "ab","c" and "a","bc" differ
+static uint64_t sparkplugb_hash_string(uint64_t hash, const char* s){
+  if(s == NULL) return sparkplugb_hash_u64(hash, 0);
+  return sparkplugb_hash(hash, s, strlen(s) + 1);
+}
+
+static uint64_t sparkplugb_hash_properties(uint64_t hash,
+    const org_eclipse_tahu_protobuf_Payload_PropertySet* set);
+
+static uint64_t sparkplugb_hash_property(uint64_t hash,
+    const org_eclipse_tahu_protobuf_Payload_PropertyValue* value)
+{
+  pb_size_t i;
+  hash = sparkplugb_hash_u64(hash, value->has_type ? value->type : UINT64_MAX);
+  hash = sparkplugb_hash_u64(hash, value->has_is_null ? value->is_null : 2);
+  hash = sparkplugb_hash_u64(hash, value->which_value);
+  switch(value->which_value){
+  case org_eclipse_tahu_protobuf_Payload_PropertyValue_int_value_tag:
+    return sparkplugb_hash_u64(hash, value->value.int_value);
+  case org_eclipse_tahu_protobuf_Payload_PropertyValue_long_value_tag:
+    return sparkplugb_hash_u64(hash, value->value.long_value);
+  case org_eclipse_tahu_protobuf_Payload_PropertyValue_float_value_tag:
+    return sparkplugb_hash(hash, (const char*)&value->value.float_value, sizeof(float));
+  case org_eclipse_tahu_protobuf_Payload_PropertyValue_double_value_tag:
+    return sparkplugb_hash(hash, (const char*)&value->value.double_value, sizeof(double));
+  case org_eclipse_tahu_protobuf_Payload_PropertyValue_boolean_value_tag:
+    return sparkplugb_hash_u64(hash, value->value.boolean_value);
+  case org_eclipse_tahu_protobuf_Payload_PropertyValue_string_value_tag:
+    return sparkplugb_hash_string(hash, value->value.string_value);
+  case org_eclipse_tahu_protobuf_Payload_PropertyValue_propertyset_value_tag:
+    return sparkplugb_hash_properties(hash, &value->value.propertyset_value);
+  case org_eclipse_tahu_protobuf_Payload_PropertyValue_propertysets_value_tag:
+    for(i=0; i<value->value.propertysets_value.propertyset_count; i++){
+      hash = sparkplugb_hash_properties(hash, &value->value.propertysets_value.propertyset[i]);
+    }
+    return hash;
+  default:
+    return hash;
+  }
+}
+
+static uint64_t sparkplugb_hash_properties(uint64_t hash,
+    const org_eclipse_tahu_protobuf_Payload_PropertySet* set)
+{
+  pb_size_t i;
+  hash = sparkplugb_hash_u64(hash, set->keys_count);
+  for(i=0; i<set->keys_count; i++){
+    hash = sparkplugb_hash_string(hash, set->keys[i]);
+  }
+  hash = sparkplugb_hash_u64(hash, set->values_count);
+  for(i=0; i<set->values_count; i++){
+    hash = sparkplugb_hash_property(hash, &set->values[i]);
+  }
+  return hash;
+}
+
+// names, aliases, datatypes and properties of the metrics, the parts of a
+// BIRTH that change when the metric set is redefined
+static uint64_t sparkplugb_birth_fingerprint(const org_eclipse_tahu_protobuf_Payload* p){
+  uint64_t hash = sparkplugb_hash_u64(SPARKPLUGB_FNV_OFFSET, p->metrics_count);
+  const org_eclipse_tahu_protobuf_Payload_Metric* metric;
+  pb_size_t i;
+  for(i=0; i<p->metrics_count; i++){
+    metric = &p->metrics[i];
+    hash = sparkplugb_hash_string(hash, metric->name);
+    hash = sparkplugb_hash_u64(hash, metric->has_alias ? metric->alias : UINT64_MAX);
+    hash = sparkplugb_hash_u64(hash, metric->has_datatype ? metric->datatype : UINT64_MAX);
+    hash = sparkplugb_hash_u64(hash, metric->has_properties);
+    if(metric->has_properties) hash = sparkplugb_hash_properties(hash, &metric->properties);
+  }
+  return hash;
+}
+
+sparkplugb_arduino_birth_cache::sparkplugb_arduino_birth_cache(){
+  this->buffer = NULL;
+  this->size = 0;
+  this->head_length = 0;
+  this->invalidate();
+}
+
+void sparkplugb_arduino_birth_cache::begin(uint8_t* buffer, size_t size){
+  this->buffer = buffer;
+  this->size = (buffer == NULL) ? 0 : size;
+  this->head_length = 0;
+  this->invalidate();
+}
+
+void sparkplugb_arduino_birth_cache::invalidate(){
+  this->cached = false;
+  this->metrics = NULL;
+  this->metrics_count = 0;
+  this->bdseq = 0;
+  this->fingerprint = 0;
+  this->metrics_length = 0;
+}
+
+bool sparkplugb_arduino_birth_cache::valid(){
+  return this->cached;
+}
+
+const uint8_t* sparkplugb_arduino_birth_cache::data(){
+  if(this->buffer == NULL) return NULL;
+  return this->buffer + SPARKPLUGB_BIRTH_HEADROOM - this->head_length;
+}
+
+// encode every metric but bdSeq after the headroom; metric timestamps are
+// kept even if omitted timestamps are enabled, since they would only be
+// implied by this BIRTH's payload timestamp and not by the next one's
+bool sparkplugb_arduino_birth_cache::encode_metrics(sparkplugb_arduino_encoder* encoder,
+    org_eclipse_tahu_protobuf_Payload* p, uint64_t fingerprint)
+{
+  org_eclipse_tahu_protobuf_Payload part = *p;
+  pb_ostream_t stream = pb_ostream_from_buffer(this->buffer + SPARKPLUGB_BIRTH_HEADROOM,
+                                               this->size - SPARKPLUGB_BIRTH_HEADROOM);
+  pb_size_t i;
+
+  this->bdseq = p->metrics_count;
+  for(i=0; i<p->metrics_count; i++){
+    if(p->metrics[i].name != NULL && strcmp(p->metrics[i].name, "bdSeq") == 0){
+      this->bdseq = i;
+      break;
+    }
+  }
+
+  // the metrics before and after bdSeq
+  part.metrics_count = this->bdseq;
+  if(!encoder->encode_metrics(&stream, &part, false)) return false;
+  if(this->bdseq < p->metrics_count){
+    part.metrics = p->metrics + this->bdseq + 1;
+    part.metrics_count = p->metrics_count - this->bdseq - 1;
+    if(!encoder->encode_metrics(&stream, &part, false)) return false;
+  }
+  this->metrics = p->metrics;
+  this->metrics_count = p->metrics_count;
+  this->fingerprint = fingerprint;
+  this->metrics_length = stream.bytes_written;
+  this->cached = true;
+  return true;
+}
+
+size_t sparkplugb_arduino_birth_cache::encode(sparkplugb_arduino_encoder* encoder,
+    org_eclipse_tahu_protobuf_Payload* p)
+{
+  org_eclipse_tahu_protobuf_Payload rest;
+  org_eclipse_tahu_protobuf_Payload_Metric* bdseq;
+  uint8_t head[SPARKPLUGB_BIRTH_HEADROOM];
+  pb_ostream_t stream;
+  uint64_t fingerprint;
+  size_t tail;
+  bool omit;
+
+  if(encoder == NULL || p == NULL || this->size < SPARKPLUGB_BIRTH_HEADROOM) return -1;
+  omit = encoder->omit_timestamps && p->has_timestamp;
+
+  fingerprint = sparkplugb_birth_fingerprint(p);
+  if(this->cached && (p->metrics != this->metrics || p->metrics_count != this->metrics_count ||
+                      fingerprint != this->fingerprint))
+    this->invalidate();
+  if(!this->cached && !this->encode_metrics(encoder, p, fingerprint)){
+    this->invalidate();
+    return -1;
+  }
+
+  // payload timestamp and bdSeq metric, the fields in front of the others
+  stream = pb_ostream_from_buffer(head, sizeof(head));
+  if(p->has_timestamp &&
+     (!pb_encode_tag(&stream, PB_WT_VARINT, org_eclipse_tahu_protobuf_Payload_timestamp_tag) ||
+      !pb_encode_varint(&stream, p->timestamp)))
+    return -1;
+  if(this->bdseq < p->metrics_count){
+    bdseq = &p->metrics[this->bdseq];
+    if(!encoder->encode_metric(&stream, bdseq, omit_metric_timestamp(p, bdseq, omit)))
+      return -1;
+  }
+  this->head_length = stream.bytes_written;
+  memcpy(this->buffer + SPARKPLUGB_BIRTH_HEADROOM - this->head_length, head, this->head_length);
+
+  // seq and the fields after it
+  rest = *p;
+  rest.has_timestamp = false;
+  rest.metrics = NULL;
+  rest.metrics_count = 0;
+  tail = SPARKPLUGB_BIRTH_HEADROOM + this->metrics_length;
+  stream = pb_ostream_from_buffer(this->buffer + tail, this->size - tail);
+  if(!pb_encode(&stream, org_eclipse_tahu_protobuf_Payload_fields, &rest)) return -1;
+  return this->head_length + this->metrics_length + stream.bytes_written;
+}
+
 
 //----------------------------------------------------------------------------//
 //                               Decoder
 //----------------------------------------------------------------------------//
+// size header placed in front of each tracked allocation, padded so that the
+// memory handed to nanopb keeps the alignment malloc() would give it
+union sparkplugb_alloc_header{
+  size_t size;
+  long double align_ld;
+  uint64_t align_u64;
+  void* align_ptr;
+};
+
+// deepest nesting of submessages accepted when limits are enabled
+#define SPARKPLUGB_DECODE_MAX_DEPTH 32
+
+// zeroed storage large enough for any Sparkplug message, so check_limits can
+// walk the field descriptors without a real message behind them
+union sparkplugb_scan_scratch{
+  org_eclipse_tahu_protobuf_Payload payload;
+  org_eclipse_tahu_protobuf_Payload_Template template_value;
+  org_eclipse_tahu_protobuf_Payload_Template_Parameter parameter;
+  org_eclipse_tahu_protobuf_Payload_DataSet dataset;
+  org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue dataset_value;
+  org_eclipse_tahu_protobuf_Payload_DataSet_Row row;
+  org_eclipse_tahu_protobuf_Payload_PropertyValue property_value;
+  org_eclipse_tahu_protobuf_Payload_PropertySet property_set;
+  org_eclipse_tahu_protobuf_Payload_PropertySetList property_set_list;
+  org_eclipse_tahu_protobuf_Payload_MetaData metadata;
+  org_eclipse_tahu_protobuf_Payload_Metric metric;
+};
+static const sparkplugb_scan_scratch scan_scratch = {};
+
 sparkplugb_arduino_decoder::sparkplugb_arduino_decoder(){
   this->payload = org_eclipse_tahu_protobuf_Payload_init_zero;
+  this->allocator = NULL;
+  this->tracking_allocator.realloc_fn = tracked_realloc;
+  this->tracking_allocator.free_fn = tracked_free;
+  this->tracking_allocator.ctx = this;
+  this->tracking_allocator.field_realloc_fn = NULL;
+  this->tracking = false;
+  this->payload_tracked = false;
+  memset(&this->stats, 0, sizeof(this->stats));
+  memset(&this->limits, 0, sizeof(this->limits));
+  this->scan_metrics = 0;
+  this->scan_cells = 0;
+  this->error = NULL;
+  this->fill_timestamps = false;
+  this->decode_threads = 0;
+#ifndef PB_NO_FIELD_LOOKUP
+  // build the tag lookup tables up front instead of on the first decode
+  pb_field_lookup_init(org_eclipse_tahu_protobuf_Payload_fields);
+#endif
 }
 
 // perform the decode and save to payload
 bool sparkplugb_arduino_decoder::decode(const pb_byte_t *binary_payload,
                   size_t binary_payloadlen)
 {
-  pb_istream_t node_stream = pb_istream_from_buffer(binary_payload, binary_payloadlen);
-	const bool decode_result = pb_decode(&node_stream, org_eclipse_tahu_protobuf_Payload_fields, &this->payload);
+  const pb_allocator_t* previous;
 
-  if(!decode_result){
-    return false;
+  memset(&this->stats, 0, sizeof(this->stats));
+  this->error = NULL;
+  this->payload_tracked = this->tracking || this->limits.max_bytes != 0;
+
+  // reject oversized payloads before anything is allocated
+  if(this->limits.max_metrics != 0 || this->limits.max_string_length != 0 ||
+     this->limits.max_dataset_cells != 0){
+    pb_istream_t scan_stream = pb_istream_from_buffer(binary_payload, binary_payloadlen);
+    this->scan_metrics = 0;
+    this->scan_cells = 0;
+    if(!this->check_limits(&scan_stream, org_eclipse_tahu_protobuf_Payload_fields, 0)){
+      if(this->error == NULL) this->error = PB_GET_ERROR(&scan_stream);
+      return false;
+    }
+  }
+
+  bool handled = false;
+#ifdef SPARKPLUGB_HAVE_POSIX
+  // worker threads allocate with the default allocator
+  if(this->decode_threads > 1 && this->active_allocator(this->payload_tracked) == NULL){
+    if(!this->decode_parallel(binary_payload, binary_payloadlen, &handled)) return false;
+  }
+#endif
+
+  if(!handled){
+    pb_istream_t node_stream = pb_istream_from_buffer(binary_payload, binary_payloadlen);
+    previous = pb_set_allocator(this->active_allocator(this->payload_tracked));
+    const bool decode_result = pb_decode(&node_stream, org_eclipse_tahu_protobuf_Payload_fields, &this->payload);
+    pb_set_allocator(previous);
+
+    if(!decode_result){
+      // a heap budget failure shows up as "realloc failed", keep the precise one
+      if(this->error == NULL) this->error = PB_GET_ERROR(&node_stream);
+      return false;
+    }
+
+    if(node_stream.bytes_left != 0){
+      this->error = "trailing bytes after payload";
+      return false;
+    }
   }
 
-  return (node_stream.bytes_left == 0);
+  if(this->fill_timestamps && this->payload.has_timestamp){
+    pb_size_t i;
+    for(i=0; i<this->payload.metrics_count; i++){
+      if(this->payload.metrics[i].has_timestamp) continue;
+      this->payload.metrics[i].has_timestamp = true;
+      this->payload.metrics[i].timestamp = this->payload.timestamp;
+    }
+  }
+  return true;
 }
 
 // free dynamiclly alloated memory and zero payload data
 void sparkplugb_arduino_decoder::free_payload(){
+  const pb_allocator_t* previous;
+
+  previous = pb_set_allocator(this->active_allocator(this->payload_tracked));
   pb_release(org_eclipse_tahu_protobuf_Payload_fields, &this->payload);
+  pb_set_allocator(previous);
   this->payload = org_eclipse_tahu_protobuf_Payload_init_zero;
 }
+
+void sparkplugb_arduino_decoder::set_allocator(const pb_allocator_t* allocator){
+  this->allocator = allocator;
+}
+
+void sparkplugb_arduino_decoder::set_fill_metric_timestamps(bool enable){
+  this->fill_timestamps = enable;
+}
+
+void sparkplugb_arduino_decoder::set_decode_threads(unsigned threads){
+  this->decode_threads = threads;
+}
+
+void sparkplugb_arduino_decoder::track_allocations(bool enable){
+  this->tracking = enable;
+}
+
+sparkplugb_arduino_alloc_stats sparkplugb_arduino_decoder::get_alloc_stats(){
+  return this->stats;
+}
+
+void sparkplugb_arduino_decoder::set_limits(sparkplugb_arduino_decode_limits limits){
+  this->limits = limits;
+}
+
+const char* sparkplugb_arduino_decoder::get_error(){
+  return this->error;
+}
+
+const org_eclipse_tahu_protobuf_Payload_Metric* sparkplugb_arduino_decoder::find(const char* name){
+  pb_size_t i;
+
+  if(name == NULL || this->payload.metrics == NULL) return NULL;
+  for(i=0; i<this->payload.metrics_count; i++){
+    if(this->payload.metrics[i].name != NULL &&
+       strcmp(this->payload.metrics[i].name, name) == 0)
+    {
+      return &this->payload.metrics[i];
+    }
+  }
+  return NULL;
+}
+
+const org_eclipse_tahu_protobuf_Payload_Metric* sparkplugb_arduino_decoder::find(uint64_t alias){
+  pb_size_t i;
+
+  if(this->payload.metrics == NULL) return NULL;
+  for(i=0; i<this->payload.metrics_count; i++){
+    if(this->payload.metrics[i].has_alias && this->payload.metrics[i].alias == alias){
+      return &this->payload.metrics[i];
+    }
+  }
+  return NULL;
+}
+
+uint32_t sparkplugb_arduino_decoder::value_datatype(pb_size_t which_value){
+  switch(which_value){
+    case org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag: return METRIC_DATA_TYPE_INT32;
+    case org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag: return METRIC_DATA_TYPE_INT64;
+    case org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag: return METRIC_DATA_TYPE_FLOAT;
+    case org_eclipse_tahu_protobuf_Payload_Metric_double_value_tag: return METRIC_DATA_TYPE_DOUBLE;
+    case org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag: return METRIC_DATA_TYPE_BOOLEAN;
+    case org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag: return METRIC_DATA_TYPE_STRING;
+    case org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag: return METRIC_DATA_TYPE_BYTES;
+    case org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag: return METRIC_DATA_TYPE_DATASET;
+    case org_eclipse_tahu_protobuf_Payload_Metric_template_value_tag: return METRIC_DATA_TYPE_TEMPLATE;
+    default: return METRIC_DATA_TYPE_UNKNOWN;
+  }
+}
+
+// walk one message of the binary payload, counting metrics and cells and
+// checking string lengths, without decoding or allocating anything
+bool sparkplugb_arduino_decoder::check_limits(pb_istream_t* stream,
+    const pb_msgdesc_t* fields, int depth)
+{
+  pb_field_iter_t iter;
+  bool has_fields;
+
+  if(depth > SPARKPLUGB_DECODE_MAX_DEPTH){
+    this->error = "payload nested too deeply";
+    return false;
+  }
+  if(fields == org_eclipse_tahu_protobuf_Payload_Metric_fields){
+    this->scan_metrics++;
+    if(this->limits.max_metrics != 0 && this->scan_metrics > this->limits.max_metrics){
+      this->error = "payload exceeds metric limit";
+      return false;
+    }
+  }
+  else if(fields == org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_fields){
+    this->scan_cells++;
+    if(this->limits.max_dataset_cells != 0 && this->scan_cells > this->limits.max_dataset_cells){
+      this->error = "payload exceeds DataSet cell limit";
+      return false;
+    }
+  }
+
+  has_fields = pb_field_iter_begin_const(&iter, fields, &scan_scratch);
+
+  while(stream->bytes_left){
+    pb_wire_type_t wire_type;
+    uint32_t tag;
+    bool eof;
+
+    if(!pb_decode_tag(stream, &wire_type, &tag, &eof)){
+      if(eof) break;
+      return false;
+    }
+
+    if(!has_fields || wire_type != PB_WT_STRING || !pb_field_iter_find(&iter, tag)){
+      if(!pb_skip_field(stream, wire_type)) return false;
+      continue;
+    }
+
+    if(PB_LTYPE(iter.type) == PB_LTYPE_STRING){
+      uint32_t length;
+      if(!pb_decode_varint32(stream, &length)) return false;
+      if(this->limits.max_string_length != 0 && length > this->limits.max_string_length){
+        this->error = "payload exceeds string length limit";
+        return false;
+      }
+      if(!pb_read(stream, NULL, length)) return false;
+    }
+    else if(PB_LTYPE_IS_SUBMSG(iter.type)){
+      pb_istream_t substream;
+      bool ok;
+      if(!pb_make_string_substream(stream, &substream)) return false;
+      ok = this->check_limits(&substream, iter.submsg_desc, depth + 1);
+      if(!pb_close_string_substream(stream, &substream)) return false;
+      if(!ok){
+        if(this->error == NULL) this->error = PB_GET_ERROR(&substream);
+        return false;
+      }
+    }
+    else{
+      if(!pb_skip_field(stream, wire_type)) return false;
+    }
+  }
+  return true;
+}
+
+// allocator to install for a decode/release
+const pb_allocator_t* sparkplugb_arduino_decoder::active_allocator(bool tracked){
+  if(tracked) return &this->tracking_allocator;
+  return this->allocator;
+}
+
+void* sparkplugb_arduino_decoder::raw_realloc(void* ptr, size_t size){
+  if(this->allocator == NULL) return realloc(ptr, size);
+  return this->allocator->realloc_fn(this->allocator->ctx, ptr, size);
+}
+
+void sparkplugb_arduino_decoder::raw_free(void* ptr){
+  if(this->allocator == NULL) free(ptr);
+  else this->allocator->free_fn(this->allocator->ctx, ptr);
+}
+
+void* sparkplugb_arduino_decoder::tracked_realloc(void* ctx, void* ptr, size_t size){
+  sparkplugb_arduino_decoder* self = (sparkplugb_arduino_decoder*)ctx;
+  sparkplugb_alloc_header* header = NULL;
+  size_t old_size = 0;
+
+  if(ptr != NULL){
+    header = (sparkplugb_alloc_header*)ptr - 1;
+    old_size = header->size;
+  }
+  if(size > (size_t)-1 - sizeof(sparkplugb_alloc_header)) return NULL;
+  if(self->limits.max_bytes != 0 &&
+     self->stats.live_bytes - old_size + size > self->limits.max_bytes){
+    self->error = "payload exceeds heap budget";
+    return NULL;
+  }
+
+  header = (sparkplugb_alloc_header*)self->raw_realloc(header, size + sizeof(sparkplugb_alloc_header));
+  if(header == NULL) return NULL;
+  header->size = size;
+
+  self->stats.allocations++;
+  self->stats.bytes += size;
+  self->stats.live_bytes = self->stats.live_bytes - old_size + size;
+  if(self->stats.live_bytes > self->stats.peak_bytes)
+    self->stats.peak_bytes = self->stats.live_bytes;
+
+  return header + 1;
+}
+
+void sparkplugb_arduino_decoder::tracked_free(void* ctx, void* ptr){
+  sparkplugb_arduino_decoder* self = (sparkplugb_arduino_decoder*)ctx;
+  sparkplugb_alloc_header* header;
+
+  if(ptr == NULL) return;
+  header = (sparkplugb_alloc_header*)ptr - 1;
+  self->stats.frees++;
+  self->stats.live_bytes -= header->size;
+  self->raw_free(header);
+}
+
+
+#ifdef SPARKPLUGB_HAVE_POSIX
+//------------------------ Parallel DataSet decode ---------------------------//
+
+// a length-delimited field of the binary payload
+struct sparkplugb_span{
+  size_t key; // offset of the field key
+  size_t start; // offset of the body, after the length
+  size_t end;
+};
+
+// a DataSet whose rows are decoded in parallel
+struct sparkplugb_split_dataset{
+  pb_size_t metric; // index in payload.metrics
+  size_t first_row; // index of its first row in the row span array
+  size_t rows;
+};
+
+struct sparkplugb_split{
+  sparkplugb_span* rows; // body of every row of every split DataSet
+  size_t rows_count;
+  size_t rows_capacity;
+  sparkplugb_split_dataset* datasets;
+  size_t datasets_count;
+  size_t datasets_capacity;
+};
+
+struct sparkplugb_row_job{
+  const pb_byte_t* buffer;
+  const sparkplugb_span* spans;
+  org_eclipse_tahu_protobuf_Payload_DataSet_Row* rows;
+  size_t count;
+  size_t next; // next unclaimed row, shared by all workers
+  bool failed;
+};
+
+static size_t stream_offset(const pb_istream_t* stream, const pb_byte_t* buffer){
+  return (size_t)((const pb_byte_t*)stream->state - buffer);
+}
+
+// grow an array of size bytes entries to hold one more
+static bool grow_array(void** array, size_t* capacity, size_t count, size_t size){
+  void* grown;
+  size_t wanted;
+
+  if(count < *capacity) return true;
+  wanted = *capacity ? *capacity * 2 : 64;
+  grown = realloc(*array, wanted * size);
+  if(grown == NULL) return false;
+  *array = grown;
+  *capacity = wanted;
+  return true;
+}
+
+// record the rows of the DataSet in [start, end); returns the row count
+static bool scan_dataset(const pb_byte_t* buffer, size_t start, size_t end,
+                         sparkplugb_split* split, size_t* rows)
+{
+  pb_istream_t stream = pb_istream_from_buffer(buffer + start, end - start);
+  pb_wire_type_t wire_type;
+  uint32_t tag, length;
+  size_t key, offset;
+  bool eof;
+
+  *rows = 0;
+  while(stream.bytes_left){
+    key = start + stream_offset(&stream, buffer + start);
+    if(!pb_decode_tag(&stream, &wire_type, &tag, &eof)) return eof;
+    if(tag != org_eclipse_tahu_protobuf_Payload_DataSet_rows_tag || wire_type != PB_WT_STRING){
+      if(!pb_skip_field(&stream, wire_type)) return false;
+      continue;
+    }
+    if(!pb_decode_varint32(&stream, &length)) return false;
+    offset = start + stream_offset(&stream, buffer + start);
+    if(!pb_read(&stream, NULL, length)) return false;
+    if(!grow_array((void**)&split->rows, &split->rows_capacity, split->rows_count, sizeof(sparkplugb_span)))
+      return false;
+    split->rows[split->rows_count].key = key;
+    split->rows[split->rows_count].start = offset;
+    split->rows[split->rows_count].end = offset + length;
+    split->rows_count++;
+    (*rows)++;
+  }
+  return true;
+}
+
+// Copy the payload to out, leaving out the rows of every DataSet metric of
+// at least SPARKPLUGB_PARALLEL_MIN_ROWS rows and fixing up the lengths of the
+// enclosing DataSet and metric; record the rows left out in split. With out
+// NULL only split is filled in. Returns the copy's length, or -1 if the
+// payload could not be parsed.
+static int64_t split_payload(const pb_byte_t* buffer, size_t length, pb_byte_t* out,
+                             sparkplugb_split* split)
+{
+  pb_istream_t stream = pb_istream_from_buffer(buffer, length);
+  pb_ostream_t copy = pb_ostream_from_buffer(out, out ? length : 0);
+  pb_wire_type_t wire_type;
+  uint32_t tag, field_length;
+  size_t field_start, body_start, body_end;
+  pb_size_t metric = 0;
+  bool eof;
+
+  if(out == NULL) copy.callback = NULL;
+  split->rows_count = 0;
+  split->datasets_count = 0;
+  while(stream.bytes_left){
+    field_start = stream_offset(&stream, buffer);
+    if(!pb_decode_tag(&stream, &wire_type, &tag, &eof)){
+      if(eof) break;
+      return -1;
+    }
+    if(tag != org_eclipse_tahu_protobuf_Payload_metrics_tag || wire_type != PB_WT_STRING){
+      if(!pb_skip_field(&stream, wire_type)) return -1;
+      if(!pb_write(&copy, buffer + field_start, stream_offset(&stream, buffer) - field_start)) return -1;
+      continue;
+    }
+
+    // find the metric's DataSet, if it has one
+    if(!pb_decode_varint32(&stream, &field_length)) return -1;
+    body_start = stream_offset(&stream, buffer);
+    body_end = body_start + field_length;
+    if(field_length > stream.bytes_left) return -1;
+    pb_istream_t metric_stream = pb_istream_from_buffer(buffer + body_start, field_length);
+    size_t dataset_key = 0, dataset_start = 0, dataset_end = 0;
+    while(metric_stream.bytes_left){
+      size_t key = body_start + stream_offset(&metric_stream, buffer + body_start);
+      if(!pb_decode_tag(&metric_stream, &wire_type, &tag, &eof)){
+        if(eof) break;
+        return -1;
+      }
+      if(tag == org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag && wire_type == PB_WT_STRING){
+        uint32_t dataset_length;
+        if(!pb_decode_varint32(&metric_stream, &dataset_length)) return -1;
+        dataset_key = key;
+        dataset_start = body_start + stream_offset(&metric_stream, buffer + body_start);
+        dataset_end = dataset_start + dataset_length;
+        if(!pb_read(&metric_stream, NULL, dataset_length)) return -1;
+      }
+      else if(!pb_skip_field(&metric_stream, wire_type)){
+        return -1;
+      }
+    }
+    if(!pb_read(&stream, NULL, field_length)) return -1;
+
+    size_t first_row = split->rows_count, rows = 0, rows_bytes = 0, i;
+    if(dataset_end != 0 && !scan_dataset(buffer, dataset_start, dataset_end, split, &rows)) return -1;
+    if(rows < SPARKPLUGB_PARALLEL_MIN_ROWS){
+      // small or no DataSet, copied as is
+      split->rows_count = first_row;
+      if(!pb_write(&copy, buffer + field_start, body_end - field_start)) return -1;
+      metric++;
+      continue;
+    }
+    if(!grow_array((void**)&split->datasets, &split->datasets_capacity, split->datasets_count,
+                   sizeof(sparkplugb_split_dataset)))
+      return -1;
+    split->datasets[split->datasets_count].metric = metric;
+    split->datasets[split->datasets_count].first_row = first_row;
+    split->datasets[split->datasets_count].rows = rows;
+    split->datasets_count++;
+
+    // rows fields in full: key, length and body
+    for(i=first_row; i<first_row+rows; i++){
+      rows_bytes += split->rows[i].end - split->rows[i].key;
+    }
+    size_t dataset_length = dataset_end - dataset_start - rows_bytes;
+    size_t dataset_field = varint_size((org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag << 3) | PB_WT_STRING) +
+                           varint_size(dataset_length) + dataset_length;
+    size_t metric_length = field_length - (dataset_end - dataset_key) + dataset_field;
+
+    // metric key and length, fields before the DataSet, DataSet key and length
+    if(!pb_encode_tag(&copy, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_metrics_tag) ||
+       !pb_encode_varint(&copy, metric_length) ||
+       !pb_write(&copy, buffer + body_start, dataset_key - body_start) ||
+       !pb_encode_tag(&copy, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag) ||
+       !pb_encode_varint(&copy, dataset_length))
+      return -1;
+    // DataSet fields other than rows, then the metric fields after the DataSet
+    size_t from = dataset_start;
+    for(i=first_row; i<first_row+rows; i++){
+      if(!pb_write(&copy, buffer + from, split->rows[i].key - from)) return -1;
+      from = split->rows[i].end;
+    }
+    if(!pb_write(&copy, buffer + from, dataset_end - from) ||
+       !pb_write(&copy, buffer + dataset_end, body_end - dataset_end))
+      return -1;
+    metric++;
+  }
+  return (int64_t)copy.bytes_written;
+}
+
+static void* decode_rows(void* arg){
+  sparkplugb_row_job* job = (sparkplugb_row_job*)arg;
+  size_t first, last, i;
+
+  for(;;){
+    first = __atomic_fetch_add(&job->next, SPARKPLUGB_PARALLEL_CHUNK, __ATOMIC_RELAXED);
+    if(first >= job->count || __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) break;
+    last = first + SPARKPLUGB_PARALLEL_CHUNK < job->count ? first + SPARKPLUGB_PARALLEL_CHUNK : job->count;
+    for(i=first; i<last; i++){
+      pb_istream_t stream = pb_istream_from_buffer(job->buffer + job->spans[i].start,
+                                                   job->spans[i].end - job->spans[i].start);
+      if(!pb_decode(&stream, org_eclipse_tahu_protobuf_Payload_DataSet_Row_fields, &job->rows[i])){
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        break;
+      }
+    }
+  }
+  return NULL;
+}
+
+// decode the rows of one split DataSet on up to threads threads
+static bool decode_dataset_rows(const pb_byte_t* buffer, const sparkplugb_span* spans,
+    org_eclipse_tahu_protobuf_Payload_DataSet_Row* rows, size_t count, unsigned threads)
+{
+  sparkplugb_row_job job;
+
+  job.buffer = buffer;
+  job.spans = spans;
+  job.rows = rows;
+  job.count = count;
+  job.next = 0;
+  job.failed = false;
+  run_workers(decode_rows, &job, threads);
+  return !job.failed;
+}
+
+// decode with the rows of large DataSets split off and decoded on
+// decode_threads threads; *handled is false if there are no such DataSets
+bool sparkplugb_arduino_decoder::decode_parallel(const pb_byte_t* binary_payload,
+    size_t binary_payloadlen, bool* handled)
+{
+  sparkplugb_split split;
+  org_eclipse_tahu_protobuf_Payload_Metric* metric;
+  pb_byte_t* copy;
+  int64_t copy_length;
+  pb_istream_t node_stream;
+  const pb_allocator_t* previous;
+  size_t d;
+  bool ok;
+
+  memset(&split, 0, sizeof(split));
+  *handled = false;
+  // a payload that does not parse is left to pb_decode to report
+  if(split_payload(binary_payload, binary_payloadlen, NULL, &split) < 0 || split.datasets_count == 0){
+    free(split.rows);
+    free(split.datasets);
+    return true;
+  }
+  *handled = true;
+
+  copy = (pb_byte_t*)malloc(binary_payloadlen);
+  copy_length = (copy == NULL) ? -1 : split_payload(binary_payload, binary_payloadlen, copy, &split);
+  if(copy_length < 0){
+    this->error = "out of memory splitting DataSets";
+    ok = false;
+  }
+  else{
+    node_stream = pb_istream_from_buffer(copy, (size_t)copy_length);
+    previous = pb_set_allocator(NULL);
+    ok = pb_decode(&node_stream, org_eclipse_tahu_protobuf_Payload_fields, &this->payload);
+    pb_set_allocator(previous);
+    if(!ok) this->error = PB_GET_ERROR(&node_stream);
+  }
+  free(copy);
+
+  // one row array per DataSet, each set up before its workers start so that
+  // free_payload() releases whatever they decoded if one fails
+  for(d=0; ok && d<split.datasets_count; d++){
+    metric = (split.datasets[d].metric < this->payload.metrics_count) ?
+             &this->payload.metrics[split.datasets[d].metric] : NULL;
+    if(metric == NULL || metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag ||
+       metric->value.dataset_value.rows_count != 0)
+    {
+      this->error = "DataSet split does not match the payload";
+      ok = false;
+      break;
+    }
+    metric->value.dataset_value.rows = (org_eclipse_tahu_protobuf_Payload_DataSet_Row*)calloc(
+        split.datasets[d].rows, sizeof(org_eclipse_tahu_protobuf_Payload_DataSet_Row));
+    if(metric->value.dataset_value.rows == NULL){
+      this->error = "out of memory for DataSet rows";
+      ok = false;
+      break;
+    }
+    metric->value.dataset_value.rows_count = split.datasets[d].rows;
+    if(!decode_dataset_rows(binary_payload, split.rows + split.datasets[d].first_row,
+                            metric->value.dataset_value.rows, split.datasets[d].rows,
+                            this->decode_threads))
+    {
+      this->error = "DataSet row decode failed";
+      ok = false;
+    }
+  }
+  if(!ok) this->free_payload();
+
+  free(split.rows);
+  free(split.datasets);
+  return ok;
+}
+#endif
+
+//----------------------------------------------------------------------------//
+//                              DataSet Reader
+//----------------------------------------------------------------------------//
+sparkplugb_arduino_dataset_reader::sparkplugb_arduino_dataset_reader(){
+  this->dataset = NULL;
+  this->column_count = 0;
+  this->row_count = 0;
+}
+
+bool sparkplugb_arduino_dataset_reader::set_dataset(
+    const org_eclipse_tahu_protobuf_Payload_DataSet* dataset)
+{
+  uint64_t columns;
+  pb_size_t r;
+
+  this->dataset = NULL;
+  this->column_count = 0;
+  this->row_count = 0;
+  if(dataset == NULL) return false;
+
+  columns = dataset->has_num_of_columns ? dataset->num_of_columns : dataset->types_count;
+  if(columns > dataset->types_count || (columns > 0 && dataset->types == NULL)) return false;
+  if(dataset->rows_count > 0 && dataset->rows == NULL) return false;
+  // checked once here so that the column loops need no bounds checks
+  for(r=0; r<dataset->rows_count; r++){
+    if(dataset->rows[r].elements_count < columns) return false;
+    if(columns > 0 && dataset->rows[r].elements == NULL) return false;
+  }
+  this->dataset = dataset;
+  this->column_count = (uint32_t)columns;
+  this->row_count = dataset->rows_count;
+  return true;
+}
+
+uint32_t sparkplugb_arduino_dataset_reader::type(uint32_t column){
+  if(column >= this->column_count) return DATA_SET_DATA_TYPE_UNKNOWN;
+  return this->dataset->types[column];
+}
+
+const char* sparkplugb_arduino_dataset_reader::column_name(uint32_t column){
+  if(column >= this->column_count || column >= this->dataset->columns_count ||
+     this->dataset->columns == NULL)
+  {
+    return NULL;
+  }
+  return this->dataset->columns[column];
+}
+
+// the DATA_SET_DATA_TYPE_* selecting the cell reader of a column
+uint32_t sparkplugb_arduino_dataset_reader::cell_kind(uint32_t column){
+  switch(this->type(column)){
+    case DATA_SET_DATA_TYPE_DATETIME: return DATA_SET_DATA_TYPE_UINT64;
+    case DATA_SET_DATA_TYPE_TEXT: return DATA_SET_DATA_TYPE_STRING;
+    case DATA_SET_DATA_TYPE_UINT32:
+      // long_value per the specification, some encoders use int_value
+      if(this->row_count > 0 && this->dataset->rows[0].elements[column].which_value ==
+         org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_long_value_tag)
+      {
+        return CELL_UINT32_LONG;
+      }
+      return DATA_SET_DATA_TYPE_UINT32;
+    default: return this->type(column);
+  }
+}
+
+
+// rows converted at a time by to_matrix_f64(), small enough that the rows of
+// a block stay in the cache while each column is read
+#define SPARKPLUGB_MATRIX_BLOCK 64
+
+size_t sparkplugb_arduino_dataset_reader::to_matrix_f64(double* out, uint32_t first_row, uint32_t count){
+  uint32_t block, n, c;
+
+  if(first_row >= this->row_count) return 0;
+  if(count > this->row_count - first_row) count = this->row_count - first_row;
+  for(block=0; block<count; block+=n){
+    n = count - block < SPARKPLUGB_MATRIX_BLOCK ? count - block : SPARKPLUGB_MATRIX_BLOCK;
+    for(c=0; c<this->column_count; c++){
+      if(this->read_column(c, out + (size_t)c * count + block, first_row + block, n) == (size_t)-1){
+        return (size_t)-1;
+      }
+    }
+  }
+  return count;
+}
+
+//----------------------------------------------------------------------------//
+//                               Static Pool
+//----------------------------------------------------------------------------//
+// alignment of blocks in the byte pool
+#define SPARKPLUGB_POOL_ALIGN 8
+// each block of the byte pool starts with its reserved size, padded to keep
+// the block aligned
+#define SPARKPLUGB_POOL_HEADER SPARKPLUGB_POOL_ALIGN
+
+sparkplugb_arduino_pool::sparkplugb_arduino_pool(){
+  memset(&this->metrics, 0, sizeof(this->metrics));
+  memset(&this->rows, 0, sizeof(this->rows));
+  memset(&this->cells, 0, sizeof(this->cells));
+  memset(&this->bytes, 0, sizeof(this->bytes));
+  this->allocator.realloc_fn = pool_realloc;
+  this->allocator.free_fn = pool_free;
+  this->allocator.field_realloc_fn = pool_field_realloc;
+  this->allocator.ctx = this;
+  this->error = NULL;
+}
+
+void sparkplugb_arduino_pool::init(
+    org_eclipse_tahu_protobuf_Payload_Metric* metrics, size_t metrics_count,
+    org_eclipse_tahu_protobuf_Payload_DataSet_Row* rows, size_t rows_count,
+    org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue* cells, size_t cells_count,
+    uint8_t* bytes, size_t bytes_count)
+{
+  this->metrics.base = (uint8_t*)metrics;
+  this->metrics.capacity = metrics_count * sizeof(*metrics);
+  this->metrics.error = "static pool out of metrics";
+  this->rows.base = (uint8_t*)rows;
+  this->rows.capacity = rows_count * sizeof(*rows);
+  this->rows.error = "static pool out of DataSet rows";
+  this->cells.base = (uint8_t*)cells;
+  this->cells.capacity = cells_count * sizeof(*cells);
+  this->cells.error = "static pool out of DataSet cells";
+  this->bytes.base = bytes;
+  this->bytes.capacity = bytes_count;
+  this->bytes.error = "static pool out of bytes";
+  this->reset();
+}
+
+void sparkplugb_arduino_pool::reset(){
+  this->metrics.used = this->metrics.last = 0;
+  this->rows.used = this->rows.last = 0;
+  this->cells.used = this->cells.last = 0;
+  this->bytes.used = this->bytes.last = 0;
+  this->error = NULL;
+}
+
+const char* sparkplugb_arduino_pool::get_error(){
+  return this->error;
+}
+
+size_t sparkplugb_arduino_pool::bytes_used(){
+  return this->bytes.used;
+}
+
+// find the region a block was handed out from
+sparkplugb_arduino_pool::region* sparkplugb_arduino_pool::region_of(void* ptr){
+  region* regions[4] = {&this->metrics, &this->rows, &this->cells, &this->bytes};
+  int i;
+  for(i=0; i<4; i++){
+    if((uint8_t*)ptr >= regions[i]->base && (uint8_t*)ptr < regions[i]->base + regions[i]->capacity)
+      return regions[i];
+  }
+  return NULL;
+}
+
+// bump allocation for the metric, row and cell pools; the most recent block
+// grows in place, any other block is moved to the end of the region and its
+// old space is abandoned until reset
+void* sparkplugb_arduino_pool::region_realloc(region* r, void* ptr, size_t size){
+  size_t offset;
+
+  if(ptr != NULL && (uint8_t*)ptr == r->base + r->last){
+    if(size > r->capacity - r->last){
+      this->error = r->error;
+      return NULL;
+    }
+    r->used = r->last + size;
+    return ptr;
+  }
+
+  offset = (r->used + SPARKPLUGB_POOL_ALIGN - 1) & ~(size_t)(SPARKPLUGB_POOL_ALIGN - 1);
+  if(offset > r->capacity || size > r->capacity - offset){
+    this->error = r->error;
+    return NULL;
+  }
+  if(ptr != NULL){
+    // the old size is unknown, but the old block lies below offset, so
+    // copying size bytes stays inside the region and keeps the old contents
+    memmove(r->base + offset, ptr, size);
+  }
+  r->last = offset;
+  r->used = offset + size;
+  return r->base + offset;
+}
+
+// Repeated strings and small submessages (DataSet columns, property keys and
+// values, template parameters) share the byte pool with their own contents,
+// so such an array is usually not the most recent block when nanopb adds an
+// entry. A block that has to move is given twice its old room, so an array
+// of n entries moves about log2(n) times and the abandoned copies add up to
+// less than its final size, instead of growing with n squared.
+void* sparkplugb_arduino_pool::bytes_realloc(void* ptr, size_t size){
+  region* r = &this->bytes;
+  size_t reserved = 0;
+  size_t offset, room;
+  uint8_t* block;
+
+  if(ptr != NULL){
+    block = (uint8_t*)ptr - SPARKPLUGB_POOL_HEADER;
+    memcpy(&reserved, block, sizeof(reserved));
+    if(size <= reserved) return ptr;
+    if(block == r->base + r->last){
+      // the most recent block grows in place
+      if(size > r->capacity - r->last - SPARKPLUGB_POOL_HEADER){
+        this->error = r->error;
+        return NULL;
+      }
+      memcpy(block, &size, sizeof(size));
+      r->used = r->last + SPARKPLUGB_POOL_HEADER + size;
+      return ptr;
+    }
+  }
+
+  offset = (r->used + SPARKPLUGB_POOL_ALIGN - 1) & ~(size_t)(SPARKPLUGB_POOL_ALIGN - 1);
+  if(offset > r->capacity || SPARKPLUGB_POOL_HEADER > r->capacity - offset ||
+     size > r->capacity - offset - SPARKPLUGB_POOL_HEADER){
+    this->error = r->error;
+    return NULL;
+  }
+  room = size;
+  if(ptr != NULL && reserved <= (r->capacity - offset - SPARKPLUGB_POOL_HEADER) / 2 && 2 * reserved > size)
+    room = 2 * reserved;
+  block = r->base + offset;
+  memcpy(block, &room, sizeof(room));
+  if(ptr != NULL) memcpy(block + SPARKPLUGB_POOL_HEADER, ptr, reserved);
+  r->last = offset;
+  r->used = offset + SPARKPLUGB_POOL_HEADER + room;
+  return block + SPARKPLUGB_POOL_HEADER;
+}
+
+void* sparkplugb_arduino_pool::pool_realloc(void* ctx, void* ptr, size_t size){
+  sparkplugb_arduino_pool* self = (sparkplugb_arduino_pool*)ctx;
+  region* r = &self->bytes;
+
+  if(ptr != NULL){
+    r = self->region_of(ptr);
+    if(r == NULL) return NULL; // not ours
+  }
+  if(r == &self->bytes) return self->bytes_realloc(ptr, size);
+  return self->region_realloc(r, ptr, size);
+}
+
+void* sparkplugb_arduino_pool::pool_field_realloc(void* ctx, void* ptr, size_t size,
+    const pb_field_iter_t* field)
+{
+  sparkplugb_arduino_pool* self = (sparkplugb_arduino_pool*)ctx;
+  region* r = &self->bytes;
+
+  if(ptr != NULL){
+    r = self->region_of(ptr);
+    if(r == NULL) return NULL; // not ours
+  }
+  else if(PB_HTYPE(field->type) == PB_HTYPE_REPEATED && PB_LTYPE_IS_SUBMSG(field->type)){
+    // arrays of the three bulky message types get their own pools
+    if(field->submsg_desc == org_eclipse_tahu_protobuf_Payload_Metric_fields)
+      r = &self->metrics;
+    else if(field->submsg_desc == org_eclipse_tahu_protobuf_Payload_DataSet_Row_fields)
+      r = &self->rows;
+    else if(field->submsg_desc == org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_fields)
+      r = &self->cells;
+  }
+  if(r == &self->bytes) return self->bytes_realloc(ptr, size);
+  return self->region_realloc(r, ptr, size);
+}
+
+void sparkplugb_arduino_pool::pool_free(void* ctx, void* ptr){
+  // memory is reclaimed all at once by reset()
+  (void)ctx;
+  (void)ptr;
+}
+
+
+//----------------------------------------------------------------------------//
+//                           Store and Forward
+//----------------------------------------------------------------------------//
+// identifies a history file, "SPBH"
+#define SPARKPLUGB_HISTORY_MAGIC 0x48425053
+
+sparkplugb_arduino_history::sparkplugb_arduino_history(){
+  memset(&this->local_header, 0, sizeof(this->local_header));
+  this->header = NULL;
+  this->samples = NULL;
+  this->map = NULL;
+  this->map_length = 0;
+  this->names = NULL;
+  this->names_count = 0;
+  this->budget = 0;
+  this->omit_timestamps = false;
+  this->batch_end = 0;
+}
+
+sparkplugb_arduino_history::~sparkplugb_arduino_history(){
+  this->close();
+}
+
+// use a caller-provided array as the ring buffer
+void sparkplugb_arduino_history::begin(sparkplugb_arduino_history_sample* samples, uint32_t count){
+  this->close();
+  memset(&this->local_header, 0, sizeof(this->local_header));
+  this->local_header.magic = SPARKPLUGB_HISTORY_MAGIC;
+  this->local_header.sample_size = sizeof(sparkplugb_arduino_history_sample);
+  this->local_header.capacity = (samples == NULL) ? 0 : count;
+  this->header = &this->local_header;
+  this->samples = samples;
+}
+
+// map a file holding the ring header followed by the samples
+bool sparkplugb_arduino_history::open(const char* path, uint32_t count){
+#ifdef SPARKPLUGB_HAVE_POSIX
+  int fd;
+  struct stat st;
+  size_t length;
+  void* map;
+  ring_header* h;
+
+  this->close();
+  if(path == NULL || count == 0) return false;
+
+  length = sizeof(ring_header) + (size_t)count * sizeof(sparkplugb_arduino_history_sample);
+  fd = ::open(path, O_RDWR | O_CREAT, 0644);
+  if(fd < 0) return false;
+  if(fstat(fd, &st) != 0 || ((size_t)st.st_size != length && ftruncate(fd, length) != 0)){
+    ::close(fd);
+    return false;
+  }
+  map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(map == MAP_FAILED) return false;
+
+  // start over unless the file holds a consistent queue of the same shape
+  h = (ring_header*)map;
+  if(h->magic != SPARKPLUGB_HISTORY_MAGIC ||
+     h->sample_size != sizeof(sparkplugb_arduino_history_sample) ||
+     h->capacity != count || h->head < h->tail || h->head - h->tail > count)
+  {
+    memset(h, 0, sizeof(*h));
+    h->magic = SPARKPLUGB_HISTORY_MAGIC;
+    h->sample_size = sizeof(sparkplugb_arduino_history_sample);
+    h->capacity = count;
+  }
+
+  this->map = map;
+  this->map_length = length;
+  this->header = h;
+  this->samples = (sparkplugb_arduino_history_sample*)((uint8_t*)map + sizeof(ring_header));
+  return true;
+#else
+  (void)path;
+  (void)count;
+  return false;
+#endif
+}
+
+void sparkplugb_arduino_history::close(){
+#ifdef SPARKPLUGB_HAVE_POSIX
+  if(this->map != NULL){
+    munmap(this->map, this->map_length);
+  }
+#endif
+  this->map = NULL;
+  this->map_length = 0;
+  this->header = NULL;
+  this->samples = NULL;
+  this->batch_end = 0;
+}
+
+void sparkplugb_arduino_history::sync(){
+#ifdef SPARKPLUGB_HAVE_POSIX
+  if(this->map != NULL){
+    msync(this->map, this->map_length, MS_SYNC);
+  }
+#endif
+}
+
+void sparkplugb_arduino_history::set_metric_names(const char* const* names, uint32_t count){
+  this->names = names;
+  this->names_count = (names == NULL) ? 0 : count;
+}
+
+void sparkplugb_arduino_history::set_omit_metric_timestamps(bool enable){
+  this->omit_timestamps = enable;
+}
+
+void sparkplugb_arduino_history::set_batch_budget(size_t bytes){
+  this->budget = bytes;
+}
+
+// Turn a scalar metric into a sample, identified by alias or by its index in
+// names. Shared by the history and the aggregator.
+static bool metric_to_sample(const org_eclipse_tahu_protobuf_Payload_Metric* metric, uint64_t timestamp,
+    const char* const* names, uint32_t names_count, sparkplugb_arduino_history_sample* sample)
+{
+  uint32_t i;
+  float f;
+
+  memset(sample, 0, sizeof(*sample));
+  if(metric->has_alias){
+    if(metric->alias > 0xFFFFFFFFu) return false;
+    sample->id = (uint32_t)metric->alias;
+    sample->flags = SPARKPLUGB_HISTORY_ALIAS;
+  }
+  else{
+    if(metric->name == NULL) return false;
+    for(i=0; i<names_count; i++){
+      if(names[i] != NULL && strcmp(names[i], metric->name) == 0) break;
+    }
+    if(i == names_count) return false; // not in the name table
+    sample->id = i;
+    sample->flags = SPARKPLUGB_HISTORY_NAME;
+  }
+
+  if(metric->has_is_null && metric->is_null){
+    sample->flags |= SPARKPLUGB_HISTORY_NULL;
+  }
+  else{
+    switch(metric->which_value){
+      case org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag:
+        sample->value = metric->value.int_value;
+        break;
+      case org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag:
+        sample->value = metric->value.long_value;
+        break;
+      case org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag:
+        f = metric->value.float_value;
+        memcpy(&sample->value, &f, sizeof(f));
+        break;
+      case org_eclipse_tahu_protobuf_Payload_Metric_double_value_tag:
+        memcpy(&sample->value, &metric->value.double_value, sizeof(double));
+        break;
+      case org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag:
+        sample->value = metric->value.boolean_value ? 1 : 0;
+        break;
+      default:
+        return false; // strings, bytes, datasets and templates are not buffered
+    }
+    sample->which_value = (uint8_t)metric->which_value;
+  }
+  sample->timestamp = metric->has_timestamp ? metric->timestamp : timestamp;
+  sample->datatype = metric->has_datatype ? (uint8_t)metric->datatype : 0;
+  return true;
+}
+
+// Rebuild the metric a sample was taken from, the inverse of metric_to_sample().
+// metric must be zeroed.
+static bool sample_to_metric(const sparkplugb_arduino_history_sample* sample,
+    const char* const* names, uint32_t names_count, org_eclipse_tahu_protobuf_Payload_Metric* metric)
+{
+  float f;
+
+  if(sample->flags & SPARKPLUGB_HISTORY_ALIAS){
+    metric->has_alias = true;
+    metric->alias = sample->id;
+  }
+  else{
+    // the name table may have changed since the sample was stored
+    if(sample->id >= names_count) return false;
+    metric->name = (char*)names[sample->id];
+  }
+  metric->has_timestamp = true;
+  metric->timestamp = sample->timestamp;
+  metric->has_datatype = (sample->datatype != 0);
+  metric->datatype = sample->datatype;
+
+  if(sample->flags & SPARKPLUGB_HISTORY_NULL){
+    metric->has_is_null = true;
+    metric->is_null = true;
+    return true;
+  }
+  metric->which_value = sample->which_value;
+  switch(sample->which_value){
+    case org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag:
+      metric->value.int_value = (uint32_t)sample->value;
+      break;
+    case org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag:
+      metric->value.long_value = sample->value;
+      break;
+    case org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag:
+      memcpy(&f, &sample->value, sizeof(f));
+      metric->value.float_value = f;
+      break;
+    case org_eclipse_tahu_protobuf_Payload_Metric_double_value_tag:
+      memcpy(&metric->value.double_value, &sample->value, sizeof(double));
+      break;
+    case org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag:
+      metric->value.boolean_value = (sample->value != 0);
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+// copy a scalar metric into the ring, overwriting the oldest sample if full
+bool sparkplugb_arduino_history::store(const org_eclipse_tahu_protobuf_Payload_Metric* metric,
+    uint64_t timestamp)
+{
+  sparkplugb_arduino_history_sample sample;
+
+  if(this->header == NULL || this->header->capacity == 0 || metric == NULL) return false;
+  if(!metric_to_sample(metric, timestamp, this->names, this->names_count, &sample)) return false;
+
+  if(this->header->head - this->header->tail >= this->header->capacity){
+    this->header->tail++;
+    this->header->dropped++;
+  }
+  this->samples[this->header->head % this->header->capacity] = sample;
+  this->header->head++;
+  return true;
+}
+
+uint32_t sparkplugb_arduino_history::store(const org_eclipse_tahu_protobuf_Payload* payload){
+  uint32_t i;
+  uint32_t stored = 0;
+  uint64_t timestamp;
+
+  if(payload == NULL) return 0;
+
+  timestamp = payload->has_timestamp ? payload->timestamp : 0;
+  for(i=0; i<payload->metrics_count; i++){
+    if(this->store(&payload->metrics[i], timestamp)) stored++;
+  }
+  return stored;
+}
+
+// rebuild the metric a sample was taken from, flagged as historical
+bool sparkplugb_arduino_history::sample_metric(const sparkplugb_arduino_history_sample* sample,
+    org_eclipse_tahu_protobuf_Payload_Metric* metric)
+{
+  *metric = org_eclipse_tahu_protobuf_Payload_Metric_init_zero;
+  metric->has_is_historical = true;
+  metric->is_historical = true;
+  return sample_to_metric(sample, this->names, this->names_count, metric);
+}
+
+// Write the payload field by field (timestamp, metrics, seq) in the order
+// pb_encode() uses, so that no metric array is needed and each metric can be
+// checked against the byte budget before it is written.
+size_t sparkplugb_arduino_history::encode_batch(uint8_t* buffer, size_t buffer_length,
+    uint64_t timestamp, uint64_t seq)
+{
+  pb_ostream_t stream;
+  pb_ostream_t sizing = PB_OSTREAM_SIZING;
+  org_eclipse_tahu_protobuf_Payload_Metric metric;
+  size_t limit;
+  size_t metric_size;
+  size_t seq_size;
+  size_t needed;
+  uint64_t i;
+  uint32_t count = 0;
+  uint32_t encoded = 0;
+
+  if(this->header == NULL || buffer == NULL) return -1;
+  if(this->header->head == this->header->tail) return 0;
+
+  limit = buffer_length;
+  if(this->budget != 0 && this->budget < limit) limit = this->budget;
+
+  // bytes needed for the seq field that closes the payload
+  if(!pb_encode_tag(&sizing, PB_WT_VARINT, org_eclipse_tahu_protobuf_Payload_seq_tag) ||
+     !pb_encode_varint(&sizing, seq))
+    return -1;
+  seq_size = sizing.bytes_written;
+
+  stream = pb_ostream_from_buffer(buffer, buffer_length);
+  if(!pb_encode_tag(&stream, PB_WT_VARINT, org_eclipse_tahu_protobuf_Payload_timestamp_tag) ||
+     !pb_encode_varint(&stream, timestamp))
+    return -1;
+
+  for(i=this->header->tail; i<this->header->head; i++){
+    if(!this->sample_metric(&this->samples[i % this->header->capacity], &metric)){
+      count++; // unusable sample, skip it when the batch is consumed
+      continue;
+    }
+    if(this->omit_timestamps && metric.timestamp == timestamp){
+      metric.has_timestamp = false; // readers fall back to the payload timestamp
+    }
+    if(!pb_get_encoded_size(&metric_size, org_eclipse_tahu_protobuf_Payload_Metric_fields, &metric))
+      return -1;
+
+    // tag, length prefix and the metric itself
+    sizing = PB_OSTREAM_SIZING;
+    pb_encode_tag(&sizing, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_metrics_tag);
+    pb_encode_varint(&sizing, metric_size);
+    needed = stream.bytes_written + sizing.bytes_written + metric_size + seq_size;
+    if(needed > limit){
+      if(encoded != 0) break;
+      // a sample over the budget goes alone so that it does not block the
+      // queue, one that does not fit in the buffer can never be sent
+      if(needed > buffer_length){
+        count++;
+        continue;
+      }
+    }
+
+    if(!pb_encode_tag(&stream, PB_WT_STRING, org_eclipse_tahu_protobuf_Payload_metrics_tag) ||
+       !pb_encode_submessage(&stream, org_eclipse_tahu_protobuf_Payload_Metric_fields, &metric))
+      return -1;
+    count++;
+    encoded++;
+    if(needed > limit) break;
+  }
+
+  if(!pb_encode_tag(&stream, PB_WT_VARINT, org_eclipse_tahu_protobuf_Payload_seq_tag) ||
+     !pb_encode_varint(&stream, seq))
+    return -1;
+
+  this->batch_end = this->header->tail + count;
+  return stream.bytes_written;
+}
+
+void sparkplugb_arduino_history::consume(){
+  if(this->header == NULL) return;
+  // samples overwritten since the batch was encoded already moved the tail
+  if(this->batch_end > this->header->tail && this->batch_end <= this->header->head){
+    this->header->tail = this->batch_end;
+  }
+  this->batch_end = 0;
+}
+
+uint32_t sparkplugb_arduino_history::available(){
+  if(this->header == NULL) return 0;
+  return (uint32_t)(this->header->head - this->header->tail);
+}
+
+uint32_t sparkplugb_arduino_history::dropped(){
+  if(this->header == NULL) return 0;
+  return this->header->dropped;
+}
+
+
+//----------------------------------------------------------------------------//
+//                              Aggregator
+//----------------------------------------------------------------------------//
+// Latest-value mode keeps one sample per metric in an open addressing table
+// on the metric id; history mode appends the samples in order. The reserved
+// byte of each sample holds its state.
+#define SPARKPLUGB_SLOT_FREE 0 // unused table slot
+#define SPARKPLUGB_SLOT_PENDING 1 // value not sent yet
+#define SPARKPLUGB_SLOT_BATCH 2 // value in the last encode()
+#define SPARKPLUGB_SLOT_IDLE 3 // value sent, metric keeps its slot
+
+sparkplugb_arduino_aggregator::sparkplugb_arduino_aggregator(){
+  this->samples = NULL;
+  this->count = 0;
+  this->names = NULL;
+  this->names_count = 0;
+  this->max_updates = 0;
+  this->max_age = 0;
+  this->keep_history = false;
+  this->used = 0;
+  this->updates = 0;
+  this->window_start = 0;
+  this->batch_end = 0;
+}
+
+void sparkplugb_arduino_aggregator::begin(sparkplugb_arduino_history_sample* samples, uint32_t count){
+  this->samples = samples;
+  this->count = (samples == NULL) ? 0 : count;
+  this->set_keep_history(this->keep_history);
+}
+
+void sparkplugb_arduino_aggregator::set_metric_names(const char* const* names, uint32_t count){
+  this->names = names;
+  this->names_count = (names == NULL) ? 0 : count;
+}
+
+void sparkplugb_arduino_aggregator::set_window(uint32_t updates, uint64_t age_ms){
+  this->max_updates = updates;
+  this->max_age = age_ms;
+}
+
+void sparkplugb_arduino_aggregator::set_keep_history(bool enable){
+  this->keep_history = enable;
+  if(this->count > 0) memset(this->samples, 0, this->count * sizeof(*this->samples));
+  this->used = 0;
+  this->updates = 0;
+  this->window_start = 0;
+  this->batch_end = 0;
+}
+
+// table slot of the sample's metric, or a free one; -1 if the table is full
+int32_t sparkplugb_arduino_aggregator::slot(const sparkplugb_arduino_history_sample* sample){
+  const uint8_t kind = SPARKPLUGB_HISTORY_ALIAS | SPARKPLUGB_HISTORY_NAME;
+  uint32_t i;
+  uint32_t slot;
+
+  slot = (uint32_t)((((uint64_t)sample->id << 1) | ((sample->flags & SPARKPLUGB_HISTORY_NAME) ? 1 : 0)) % this->count);
+  for(i=0; i<this->count; i++){
+    if(this->samples[slot].reserved == SPARKPLUGB_SLOT_FREE) return slot;
+    if(this->samples[slot].id == sample->id &&
+       (this->samples[slot].flags & kind) == (sample->flags & kind))
+      return slot;
+    slot++;
+    if(slot == this->count) slot = 0;
+  }
+  return -1;
+}
+
+bool sparkplugb_arduino_aggregator::update(const org_eclipse_tahu_protobuf_Payload_Metric* metric,
+    uint64_t timestamp)
+{
+  sparkplugb_arduino_history_sample sample;
+  int32_t found;
+  uint8_t state;
+
+  if(this->count == 0 || metric == NULL) return false;
+  if(!metric_to_sample(metric, timestamp, this->names, this->names_count, &sample)) return false;
+  sample.reserved = SPARKPLUGB_SLOT_PENDING;
+
+  if(this->keep_history){
+    if(this->used == this->count) return false;
+    this->samples[this->used++] = sample;
+  }
+  else{
+    found = this->slot(&sample);
+    if(found < 0) return false;
+    state = this->samples[found].reserved;
+    if(state == SPARKPLUGB_SLOT_FREE || state == SPARKPLUGB_SLOT_IDLE) this->used++;
+    this->samples[found] = sample; // a newer value replaces one in the batch
+  }
+  if(this->updates == 0) this->window_start = timestamp;
+  this->updates++;
+  return true;
+}
+
+uint32_t sparkplugb_arduino_aggregator::update(const org_eclipse_tahu_protobuf_Payload* payload){
+  uint32_t i;
+  uint32_t added = 0;
+  uint64_t timestamp;
+
+  if(payload == NULL) return 0;
+
+  timestamp = payload->has_timestamp ? payload->timestamp : 0;
+  for(i=0; i<payload->metrics_count; i++){
+    if(this->update(&payload->metrics[i], timestamp)) added++;
+  }
+  return added;
+}
+
+bool sparkplugb_arduino_aggregator::due(uint64_t now){
+  if(this->used == 0) return false;
+  if(this->max_updates != 0 && this->updates >= this->max_updates) return true;
+  if(this->max_age != 0 && now >= this->window_start && now - this->window_start >= this->max_age) return true;
+  return this->used == this->count; // no room for the next update
+}
+
+size_t sparkplugb_arduino_aggregator::encode(sparkplugb_arduino_encoder* encoder,
+    uint8_t* buffer, size_t buffer_length, uint64_t timestamp, uint64_t seq)
+{
+  org_eclipse_tahu_protobuf_Payload* p;
+  org_eclipse_tahu_protobuf_Payload_Metric* metric;
+  sparkplugb_arduino_history_sample* sample;
+  uint32_t limit;
+  uint32_t i;
+
+  if(encoder == NULL || encoder->payload == NULL || buffer == NULL) return -1;
+  if(this->used == 0) return 0;
+
+  p = encoder->payload;
+  encoder->clear_metrics();
+  limit = this->keep_history ? this->used : this->count;
+  for(i=0; i<limit; i++){
+    sample = &this->samples[i];
+    if(sample->reserved != SPARKPLUGB_SLOT_PENDING && sample->reserved != SPARKPLUGB_SLOT_BATCH) continue;
+    metric = encoder->next_metric(NULL, false, 0, 0);
+    if(metric == NULL) break; // metric pool is full, the rest goes in the next batch
+    if(!sample_to_metric(sample, this->names, this->names_count, metric)){
+      p->metrics_count--; // unusable sample, dropped with the batch
+    }
+    sample->reserved = SPARKPLUGB_SLOT_BATCH;
+  }
+  this->batch_end = i;
+
+  p->has_timestamp = true;
+  p->timestamp = timestamp;
+  p->has_seq = true;
+  p->seq = seq;
+  return encoder->encode(buffer, buffer_length);
+}
+
+void sparkplugb_arduino_aggregator::consume(){
+  uint32_t i;
+
+  if(this->keep_history){
+    if(this->batch_end > this->used) this->batch_end = this->used;
+    memmove(this->samples, this->samples + this->batch_end,
+            (this->used - this->batch_end) * sizeof(*this->samples));
+    this->used -= this->batch_end;
+  }
+  else{
+    for(i=0; i<this->count; i++){
+      if(this->samples[i].reserved == SPARKPLUGB_SLOT_BATCH){
+        this->samples[i].reserved = SPARKPLUGB_SLOT_IDLE;
+        this->used--;
+      }
+    }
+  }
+  this->batch_end = 0;
+  // what is left over opens the next window right away
+  this->updates = this->used;
+  if(this->used == 0) this->window_start = 0;
+}
+
+uint32_t sparkplugb_arduino_aggregator::pending(){
+  return this->used;
+}
+
+//----------------------------------------------------------------------------//
+//                               Session State
+//----------------------------------------------------------------------------//
+#define SPARKPLUGB_TOPIC_NAMESPACE "spBv1.0/"
+
+// key of a node, never 0 since 0 marks a free slot
+static uint64_t sparkplugb_node_key(const char* group, size_t group_length,
+                                    const char* edge_node, size_t edge_node_length)
+{
+  uint64_t key = sparkplugb_hash(SPARKPLUGB_FNV_OFFSET, group, group_length);
+  key = sparkplugb_hash(key, "/", 1);
+  key = sparkplugb_hash(key, edge_node, edge_node_length);
+  return (key == 0) ? 1 : key;
+}
+
+sparkplugb_arduino_session::sparkplugb_arduino_session(){
+  this->nodes = NULL;
+  this->count = 0;
+}
+
+void sparkplugb_arduino_session::begin(sparkplugb_arduino_node_state* nodes, uint32_t count){
+  this->nodes = nodes;
+  this->count = (nodes == NULL) ? 0 : count;
+  if(this->count > 0) memset(nodes, 0, count * sizeof(*nodes));
+}
+
+// open addressing with linear probing, adds the key if it is not found
+int32_t sparkplugb_arduino_session::lookup(uint64_t key){
+  uint32_t i;
+  uint32_t slot;
+
+  if(this->count == 0) return -1;
+  slot = (uint32_t)(key % this->count);
+  for(i=0; i<this->count; i++){
+    if(this->nodes[slot].key == key) return slot;
+    if(this->nodes[slot].key == 0){
+      memset(&this->nodes[slot], 0, sizeof(this->nodes[slot]));
+      this->nodes[slot].key = key;
+      return slot;
+    }
+    slot++;
+    if(slot == this->count) slot = 0;
+  }
+  return -1; // table is full
+}
+
+int32_t sparkplugb_arduino_session::node(const char* group, const char* edge_node){
+  if(group == NULL || edge_node == NULL) return -1;
+  return this->lookup(sparkplugb_node_key(group, strlen(group), edge_node, strlen(edge_node)));
+}
+
+int32_t sparkplugb_arduino_session::node(const char* topic, uint8_t* type){
+  const char* group;
+  const char* type_field;
+  const char* edge_node;
+  const char* end;
+  uint8_t msg_type;
+  size_t prefix = sizeof(SPARKPLUGB_TOPIC_NAMESPACE) - 1;
+
+  if(type != NULL) *type = SPARKPLUGB_MSG_UNKNOWN;
+  if(topic == NULL || strncmp(topic, SPARKPLUGB_TOPIC_NAMESPACE, prefix) != 0) return -1;
+
+  group = topic + prefix;
+  if(strcmp(group, "STATE") == 0 || strncmp(group, "STATE/", 6) == 0){
+    // host application state, not tied to an edge node
+    if(type != NULL) *type = SPARKPLUGB_MSG_STATE;
+    return -1;
+  }
+
+  // spBv1.0/group/type/edge_node[/device]
+  type_field = strchr(group, '/');
+  if(type_field == NULL || type_field == group) return -1;
+  type_field++;
+  edge_node = strchr(type_field, '/');
+  if(edge_node == NULL) return -1;
+
+  msg_type = message_type(type_field, edge_node - type_field);
+  if(type != NULL) *type = msg_type;
+  if(msg_type == SPARKPLUGB_MSG_UNKNOWN) return -1;
+
+  edge_node++;
+  end = strchr(edge_node, '/');
+  if(end == NULL) end = edge_node + strlen(edge_node);
+  if(end == edge_node) return -1;
+  return this->lookup(sparkplugb_node_key(group, type_field - 1 - group,
+                                          edge_node, end - edge_node));
+}
+
+uint8_t sparkplugb_arduino_session::message_type(const char* type, size_t length){
+  static const char* const names[] = {
+    "NBIRTH", "NDEATH", "DBIRTH", "DDEATH", "NDATA", "DDATA", "NCMD", "DCMD", "STATE"
+  };
+  uint8_t i;
+
+  for(i=0; i<sizeof(names)/sizeof(names[0]); i++){
+    if(strlen(names[i]) == length && strncmp(names[i], type, length) == 0)
+      return i + 1; // SPARKPLUGB_MSG_* follow the order of names
+  }
+  return SPARKPLUGB_MSG_UNKNOWN;
+}
+
+uint8_t sparkplugb_arduino_session::next_seq(int32_t node){
+  if(node < 0 || (uint32_t)node >= this->count) return 0;
+  // wraps from 255 to 0 as Sparkplug requires
+  return __atomic_fetch_add(&this->nodes[node].seq, 1, __ATOMIC_RELAXED);
+}
+
+uint8_t sparkplugb_arduino_session::next_bdseq(int32_t node){
+  if(node < 0 || (uint32_t)node >= this->count) return 0;
+  __atomic_store_n(&this->nodes[node].seq, 0, __ATOMIC_RELAXED);
+  return __atomic_fetch_add(&this->nodes[node].bdseq, 1, __ATOMIC_RELAXED);
+}
+
+sparkplugb_arduino_seq_status sparkplugb_arduino_session::check(int32_t node, uint8_t type,
+    uint8_t seq, uint8_t bdseq)
+{
+  sparkplugb_arduino_node_state* st;
+  uint8_t ahead;
+
+  if(node < 0 || (uint32_t)node >= this->count) return SPARKPLUGB_SEQ_INVALID;
+  st = &this->nodes[node];
+
+  switch(type){
+    case SPARKPLUGB_MSG_NBIRTH:
+      // a birth starts a new session and clears any lost state
+      st->bdseq = bdseq;
+      st->seq = seq + 1;
+      st->flags = SPARKPLUGB_NODE_ONLINE;
+      return SPARKPLUGB_SEQ_OK;
+
+    case SPARKPLUGB_MSG_NDEATH:
+      // the broker may deliver the will of an older session late
+      if(!(st->flags & SPARKPLUGB_NODE_ONLINE) || bdseq != st->bdseq)
+        return SPARKPLUGB_SEQ_STALE_DEATH;
+      st->flags &= ~SPARKPLUGB_NODE_ONLINE;
+      return SPARKPLUGB_SEQ_OK;
+
+    case SPARKPLUGB_MSG_DBIRTH:
+    case SPARKPLUGB_MSG_DDEATH:
+    case SPARKPLUGB_MSG_NDATA:
+    case SPARKPLUGB_MSG_DDATA:
+      break;
+
+    case SPARKPLUGB_MSG_NCMD:
+    case SPARKPLUGB_MSG_DCMD:
+    case SPARKPLUGB_MSG_STATE:
+      return SPARKPLUGB_SEQ_OK; // not part of the node's sequence
+
+    default:
+      return SPARKPLUGB_SEQ_INVALID;
+  }
+
+  if(!(st->flags & SPARKPLUGB_NODE_ONLINE)){
+    st->flags |= SPARKPLUGB_NODE_REBIRTH;
+    st->errors++;
+    return SPARKPLUGB_SEQ_NO_BIRTH;
+  }
+  if(seq == st->seq){
+    st->seq++;
+    return SPARKPLUGB_SEQ_OK;
+  }
+
+  // seq wraps at 256, up to 127 ahead counts as lost messages
+  st->flags |= SPARKPLUGB_NODE_REBIRTH;
+  st->errors++;
+  ahead = (uint8_t)(seq - st->seq);
+  if(ahead < 128){
+    st->seq = seq + 1;
+    return SPARKPLUGB_SEQ_GAP;
+  }
+  return SPARKPLUGB_SEQ_REORDERED;
+}
+
+sparkplugb_arduino_seq_status sparkplugb_arduino_session::check(const char* topic,
+    const org_eclipse_tahu_protobuf_Payload* payload)
+{
+  const org_eclipse_tahu_protobuf_Payload_Metric* metric;
+  int32_t node;
+  uint8_t type;
+  uint8_t bdseq = 0;
+  uint32_t i;
+
+  node = this->node(topic, &type);
+  if(type == SPARKPLUGB_MSG_STATE) return SPARKPLUGB_SEQ_OK;
+  if(node < 0 || payload == NULL) return SPARKPLUGB_SEQ_INVALID;
+
+  if(type == SPARKPLUGB_MSG_NBIRTH || type == SPARKPLUGB_MSG_NDEATH){
+    for(i=0; i<payload->metrics_count; i++){
+      metric = &payload->metrics[i];
+      if(metric->name == NULL || strcmp(metric->name, "bdSeq") != 0) continue;
+      if(metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag)
+        bdseq = (uint8_t)metric->value.long_value;
+      else if(metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag)
+        bdseq = (uint8_t)metric->value.int_value;
+      break;
+    }
+  }
+  return this->check(node, type, payload->has_seq ? (uint8_t)payload->seq : 0, bdseq);
+}
+
+bool sparkplugb_arduino_session::rebirth_needed(int32_t node){
+  if(node < 0 || (uint32_t)node >= this->count) return false;
+  return (this->nodes[node].flags & SPARKPLUGB_NODE_REBIRTH) != 0;
+}
+
+const sparkplugb_arduino_node_state* sparkplugb_arduino_session::state(int32_t node){
+  if(node < 0 || (uint32_t)node >= this->count) return NULL;
+  return &this->nodes[node];
+}
+
+
+//----------------------------------------------------------------------------//
+//                              Metric Table
+//----------------------------------------------------------------------------//
+// The writer makes sequence odd, stores, then makes it even again; a reader
+// copies between two reads of the same even sequence. Slots are read and
+// written with relaxed atomics so that an overlapping copy is retried rather
+// than being a data race.
+
+// packs a metric value the way the table keeps it, see visit_value()
+struct sparkplugb_value_packer{
+  uint64_t value;
+  bool operator()(int8_t v){ this->value = (uint64_t)(int64_t)v; return true; }
+  bool operator()(int16_t v){ this->value = (uint64_t)(int64_t)v; return true; }
+  bool operator()(int32_t v){ this->value = (uint64_t)(int64_t)v; return true; }
+  bool operator()(int64_t v){ this->value = (uint64_t)v; return true; }
+  bool operator()(uint8_t v){ this->value = v; return true; }
+  bool operator()(uint16_t v){ this->value = v; return true; }
+  bool operator()(uint32_t v){ this->value = v; return true; }
+  bool operator()(uint64_t v){ this->value = v; return true; }
+  bool operator()(float v){ return (*this)((double)v); }
+  bool operator()(double v){ memcpy(&this->value, &v, sizeof(v)); return true; }
+  bool operator()(bool v){ this->value = v; return true; }
+  template<typename P> bool operator()(const P*){ return false; } // kept by reference only
+};
+
+// wait for an even sequence, the start of a read
+static inline uint32_t table_read_begin(const uint32_t* sequence){
+  uint32_t before;
+
+  while((before = __atomic_load_n(sequence, __ATOMIC_ACQUIRE)) & 1){
+#ifdef SPARKPLUGB_HAVE_POSIX
+    sched_yield();
+#endif
+  }
+  return before;
+}
+
+// true if no write started since table_read_begin()
+static inline bool table_read_end(const uint32_t* sequence, uint32_t before){
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(sequence, __ATOMIC_RELAXED) == before;
+}
+
+#define SPARKPLUGB_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define SPARKPLUGB_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+sparkplugb_arduino_metric_table::sparkplugb_arduino_metric_table(){
+  this->count = 0;
+  this->sequence = 0;
+  this->keys = NULL;
+  this->names = NULL;
+  this->values = NULL;
+  this->timestamps = NULL;
+  this->quality = NULL;
+  this->datatypes = NULL;
+  this->flags = NULL;
+}
+
+// carve the storage into one array per field, widest first
+void sparkplugb_arduino_metric_table::begin(void* storage, size_t size){
+  uint8_t* p = (uint8_t*)storage;
+  uint32_t count = (storage == NULL) ? 0 : (uint32_t)(size / SPARKPLUGB_METRIC_TABLE_BYTES(1));
+
+  this->count = count;
+  this->keys = (uint64_t*)p;
+  this->names = this->keys + count;
+  this->values = this->names + count;
+  this->timestamps = this->values + count;
+  this->quality = (uint16_t*)(this->timestamps + count);
+  this->datatypes = (uint8_t*)(this->quality + count);
+  this->flags = this->datatypes + count;
+  if(count > 0) memset(storage, 0, SPARKPLUGB_METRIC_TABLE_BYTES(count));
+}
+
+uint64_t sparkplugb_arduino_metric_table::name_key(const char* name){
+  if(name == NULL) return 0;
+  return sparkplugb_hash(SPARKPLUGB_FNV_OFFSET, name, strlen(name)) | SPARKPLUGB_METRIC_NAME_KEY;
+}
+
+// open addressing with linear probing, as the session table
+int32_t sparkplugb_arduino_metric_table::slot(uint64_t key, bool add){
+  uint64_t stored = key + 1;
+  uint64_t found;
+  uint32_t i;
+  uint32_t slot;
+
+  if(this->count == 0) return -1;
+  slot = (uint32_t)(key % this->count);
+  for(i=0; i<this->count; i++){
+    found = SPARKPLUGB_LOAD(this->keys[slot]);
+    if(found == stored) return slot;
+    if(found == 0){
+      if(!add) return -1;
+      SPARKPLUGB_STORE(this->keys[slot], stored);
+      return slot;
+    }
+    slot++;
+    if(slot == this->count) slot = 0;
+  }
+  return -1; // table is full
+}
+
+// a metric that has an alias referred to by its name only
+int32_t sparkplugb_arduino_metric_table::slot_by_name(uint64_t name){
+  uint32_t i;
+
+  for(i=0; i<this->count; i++){
+    if(SPARKPLUGB_LOAD(this->names[i]) == name) return i;
+  }
+  return -1;
+}
+
+// slot of a DATA metric: alias, name key, then name of an aliased metric
+int32_t sparkplugb_arduino_metric_table::slot(const org_eclipse_tahu_protobuf_Payload_Metric* metric){
+  uint64_t name;
+  int32_t found;
+
+  if(metric->has_alias) return this->slot(metric->alias, false);
+  if(metric->name == NULL) return -1;
+  name = name_key(metric->name);
+  found = this->slot(name, false);
+  return (found >= 0) ? found : this->slot_by_name(name);
+}
+
+// update value, timestamp, quality and null flag of a slot
+void sparkplugb_arduino_metric_table::store(int32_t slot,
+    const org_eclipse_tahu_protobuf_Payload_Metric* metric, uint64_t timestamp)
+{
+  org_eclipse_tahu_protobuf_Payload_Metric typed;
+  const org_eclipse_tahu_protobuf_Payload_PropertySet* properties = &metric->properties;
+  const org_eclipse_tahu_protobuf_Payload_PropertyValue* property;
+  sparkplugb_value_packer packer;
+  uint16_t quality = SPARKPLUGB_QUALITY_GOOD;
+  uint8_t datatype = SPARKPLUGB_LOAD(this->datatypes[slot]);
+  pb_size_t i;
+
+  if(metric->has_properties){
+    for(i=0; i<properties->keys_count && i<properties->values_count; i++){
+      property = &properties->values[i];
+      if(properties->keys[i] != NULL && strcmp(properties->keys[i], "Quality") == 0 &&
+         property->which_value == org_eclipse_tahu_protobuf_Payload_PropertyValue_int_value_tag)
+        quality = (uint16_t)property->value.int_value;
+    }
+  }
+  SPARKPLUGB_STORE(this->timestamps[slot], metric->has_timestamp ? metric->timestamp : timestamp);
+  SPARKPLUGB_STORE(this->quality[slot], quality);
+
+  if(metric->has_is_null && metric->is_null){
+    SPARKPLUGB_STORE(this->flags[slot], (uint8_t)SPARKPLUGB_METRIC_NULL);
+    return;
+  }
+  // DATA metrics usually leave the datatype to the BIRTH
+  if(!metric->has_datatype || metric->datatype != datatype){
+    typed = *metric;
+    typed.has_datatype = true;
+    typed.datatype = datatype;
+    metric = &typed;
+  }
+  if(sparkplugb_arduino_decoder::visit_value(metric, packer)){
+    SPARKPLUGB_STORE(this->values[slot], packer.value);
+    SPARKPLUGB_STORE(this->flags[slot], (uint8_t)0);
+  }
+}
+
+void sparkplugb_arduino_metric_table::copy(int32_t slot, sparkplugb_arduino_metric_value* value){
+  value->key = SPARKPLUGB_LOAD(this->keys[slot]) - 1;
+  value->value = SPARKPLUGB_LOAD(this->values[slot]);
+  value->timestamp = SPARKPLUGB_LOAD(this->timestamps[slot]);
+  value->quality = SPARKPLUGB_LOAD(this->quality[slot]);
+  value->datatype = SPARKPLUGB_LOAD(this->datatypes[slot]);
+  value->flags = SPARKPLUGB_LOAD(this->flags[slot]);
+}
+
+bool sparkplugb_arduino_metric_table::apply(uint8_t type,
+    const org_eclipse_tahu_protobuf_Payload* payload)
+{
+  const org_eclipse_tahu_protobuf_Payload_Metric* metric;
+  uint64_t timestamp;
+  uint32_t i;
+  int32_t found;
+  bool ok = true;
+
+  if(this->count == 0 || payload == NULL) return false;
+  timestamp = payload->has_timestamp ? payload->timestamp : 0;
+
+  SPARKPLUGB_STORE(this->sequence, this->sequence + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  switch(type){
+    case SPARKPLUGB_MSG_NBIRTH:
+    case SPARKPLUGB_MSG_DBIRTH:
+      // a birth redefines every metric
+      for(i=0; i<this->count; i++){
+        SPARKPLUGB_STORE(this->keys[i], (uint64_t)0);
+        SPARKPLUGB_STORE(this->names[i], (uint64_t)0);
+      }
+      for(i=0; i<payload->metrics_count; i++){
+        metric = &payload->metrics[i];
+        if(metric->has_alias) found = this->slot(metric->alias, true);
+        else if(metric->name != NULL) found = this->slot(name_key(metric->name), true);
+        else continue;
+        if(found < 0){
+          ok = false;
+          break;
+        }
+        SPARKPLUGB_STORE(this->names[found], name_key(metric->name));
+        SPARKPLUGB_STORE(this->datatypes[found], (uint8_t)(metric->has_datatype ? metric->datatype :
+            sparkplugb_arduino_decoder::value_datatype(metric->which_value)));
+        SPARKPLUGB_STORE(this->values[found], (uint64_t)0);
+        SPARKPLUGB_STORE(this->flags[found], (uint8_t)SPARKPLUGB_METRIC_NULL);
+        this->store(found, metric, timestamp);
+      }
+      break;
+
+    case SPARKPLUGB_MSG_NDATA:
+    case SPARKPLUGB_MSG_DDATA:
+      for(i=0; i<payload->metrics_count; i++){
+        metric = &payload->metrics[i];
+        if(metric->has_is_historical && metric->is_historical) continue; // not a current value
+        found = this->slot(metric);
+        if(found < 0){
+          ok = false;
+          continue;
+        }
+        this->store(found, metric, timestamp);
+      }
+      break;
+
+    case SPARKPLUGB_MSG_NDEATH:
+    case SPARKPLUGB_MSG_DDEATH:
+      for(i=0; i<this->count; i++){
+        if(SPARKPLUGB_LOAD(this->keys[i]) != 0)
+          SPARKPLUGB_STORE(this->quality[i], (uint16_t)SPARKPLUGB_QUALITY_STALE);
+      }
+      break;
+
+    default:
+      break;
+  }
+  __atomic_store_n(&this->sequence, this->sequence + 1, __ATOMIC_RELEASE);
+  return ok;
+}
+
+bool sparkplugb_arduino_metric_table::read(uint64_t alias, sparkplugb_arduino_metric_value* value){
+  uint32_t before;
+  int32_t found;
+
+  do{
+    before = table_read_begin(&this->sequence);
+    found = this->slot(alias, false);
+    if(found >= 0) this->copy(found, value);
+  }while(!table_read_end(&this->sequence, before));
+  return found >= 0;
+}
+
+bool sparkplugb_arduino_metric_table::read(const char* name, sparkplugb_arduino_metric_value* value){
+  uint64_t key = name_key(name);
+  uint32_t before;
+  int32_t found;
+
+  if(name == NULL) return false;
+  do{
+    before = table_read_begin(&this->sequence);
+    found = this->slot(key, false);
+    if(found < 0) found = this->slot_by_name(key);
+    if(found >= 0) this->copy(found, value);
+  }while(!table_read_end(&this->sequence, before));
+  return found >= 0;
+}
+
+uint32_t sparkplugb_arduino_metric_table::snapshot(sparkplugb_arduino_metric_value* values){
+  uint32_t before;
+  uint32_t copied;
+  uint32_t i;
+
+  do{
+    before = table_read_begin(&this->sequence);
+    copied = 0;
+    for(i=0; i<this->count; i++){
+      if(SPARKPLUGB_LOAD(this->keys[i]) != 0) this->copy(i, &values[copied++]);
+    }
+  }while(!table_read_end(&this->sequence, before));
+  return copied;
+}
+
+uint32_t sparkplugb_arduino_metric_table::size(){
+  return this->count;
+}
+
+uint32_t sparkplugb_arduino_metric_table::version(){
+  return __atomic_load_n(&this->sequence, __ATOMIC_ACQUIRE);
+}
+
+//----------------------------------------------------------------------------//
+//                               Sequencer
+//----------------------------------------------------------------------------//
+#define SPARKPLUGB_SEQ_TIME_SHIFT 24
+#define SPARKPLUGB_SEQ_TIME_MAX ((1ULL << 40) - 1)
+#define SPARKPLUGB_SEQ_SEQ_SHIFT 16
+#define SPARKPLUGB_SEQ_SEQ_MASK (0xFFULL << SPARKPLUGB_SEQ_SEQ_SHIFT)
+#define SPARKPLUGB_SEQ_TICKET_MASK 0xFFFFULL
+
+sparkplugb_arduino_sequencer::sparkplugb_arduino_sequencer(){
+  this->state = 0;
+  this->base = 0;
+  this->released = 0;
+}
+
+void sparkplugb_arduino_sequencer::rebirth(){
+  uint64_t old_state = __atomic_load_n(&this->state, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&this->state, &old_state,
+                                     old_state & ~SPARKPLUGB_SEQ_SEQ_MASK, true,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+  }
+}
+
+uint32_t sparkplugb_arduino_sequencer::stamp(org_eclipse_tahu_protobuf_Payload* payload, uint64_t now){
+  uint64_t old_state;
+  uint64_t new_state;
+  uint64_t base;
+  uint64_t elapsed;
+  uint64_t zero = 0;
+
+  // the first stamp fixes the base the 40-bit time field counts from
+  base = __atomic_load_n(&this->base, __ATOMIC_ACQUIRE);
+  if(base == 0){
+    if(__atomic_compare_exchange_n(&this->base, &zero, now, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      base = now;
+    else
+      base = zero; // another thread got there first
+  }
+  elapsed = (now > base) ? now - base : 0;
+  if(elapsed > SPARKPLUGB_SEQ_TIME_MAX) elapsed = SPARKPLUGB_SEQ_TIME_MAX;
+
+  old_state = __atomic_load_n(&this->state, __ATOMIC_RELAXED);
+  do{
+    new_state = old_state >> SPARKPLUGB_SEQ_TIME_SHIFT;
+    if(elapsed > new_state) new_state = elapsed; // never step back in time
+    new_state <<= SPARKPLUGB_SEQ_TIME_SHIFT;
+    new_state |= (old_state + (1ULL << SPARKPLUGB_SEQ_SEQ_SHIFT)) & SPARKPLUGB_SEQ_SEQ_MASK;
+    new_state |= (old_state + 1) & SPARKPLUGB_SEQ_TICKET_MASK;
+  }while(!__atomic_compare_exchange_n(&this->state, &old_state, new_state, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if(payload != NULL){
+    payload->has_seq = true;
+    payload->seq = (old_state & SPARKPLUGB_SEQ_SEQ_MASK) >> SPARKPLUGB_SEQ_SEQ_SHIFT;
+    payload->has_timestamp = true;
+    payload->timestamp = base + (new_state >> SPARKPLUGB_SEQ_TIME_SHIFT);
+  }
+  return (uint32_t)(old_state & SPARKPLUGB_SEQ_TICKET_MASK);
+}
+
+void sparkplugb_arduino_sequencer::wait_turn(uint32_t ticket){
+  while(__atomic_load_n(&this->released, __ATOMIC_ACQUIRE) != (uint16_t)ticket){
+#if defined(SPARKPLUGB_HAVE_POSIX)
+    sched_yield(); // let the thread holding the turn run
+#elif defined(ARDUINO)
+    yield(); // same for RTOS tasks, e.g. on the ESP32
+#endif
+  }
+}
+
+void sparkplugb_arduino_sequencer::release(uint32_t ticket){
+  __atomic_store_n(&this->released, (uint16_t)(ticket + 1), __ATOMIC_RELEASE);
+}
+
+
+//----------------------------------------------------------------------------//
+//                                 Clock
+//----------------------------------------------------------------------------//
+sparkplugb_arduino_clock::sparkplugb_arduino_clock(){
+  this->source = NULL;
+  this->ctx = NULL;
+  this->offset = 0;
+  this->cached = false;
+  this->cached_ms = 0;
+  this->last_millis = 0;
+  this->millis_wraps = 0;
+}
+
+void sparkplugb_arduino_clock::set_source(sparkplugb_arduino_clock_source source, void* ctx){
+  this->source = source;
+  this->ctx = ctx;
+  this->offset = 0;
+  if(this->cached) this->refresh();
+}
+
+void sparkplugb_arduino_clock::set_epoch(uint64_t now_ms){
+  this->offset = 0;
+  this->offset = now_ms - this->read();
+  if(this->cached) this->refresh();
+}
+
+void sparkplugb_arduino_clock::set_cached(bool enable){
+  if(enable) this->refresh();
+  this->cached = enable;
+}
+
+uint64_t sparkplugb_arduino_clock::refresh(){
+  this->cached_ms = this->read();
+  return this->cached_ms;
+}
+
+uint64_t sparkplugb_arduino_clock::now(){
+  if(this->cached) return this->cached_ms;
+  return this->read();
+}
+
+uint64_t sparkplugb_arduino_clock::stamp(org_eclipse_tahu_protobuf_Payload* payload){
+  uint64_t timestamp = this->cached ? this->cached_ms : this->read();
+  uint32_t i;
+
+  if(payload == NULL) return timestamp;
+  payload->has_timestamp = true;
+  payload->timestamp = timestamp;
+  for(i=0; i<payload->metrics_count; i++){
+    if(payload->metrics[i].has_timestamp) payload->metrics[i].timestamp = timestamp;
+  }
+  return timestamp;
+}
+
+// read the source and move it to Unix time
+uint64_t sparkplugb_arduino_clock::read(){
+  uint64_t ms;
+
+  if(this->source != NULL){
+    ms = this->source(this->ctx);
+  }
+  else{
+#if defined(ARDUINO)
+    // extend the 32-bit millis() count, which wraps every 49.7 days
+    uint32_t m = millis();
+    if(m < this->last_millis) this->millis_wraps++;
+    this->last_millis = m;
+    ms = ((uint64_t)this->millis_wraps << 32) | m;
+#elif defined(SPARKPLUGB_HAVE_POSIX)
+    struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    ms = 0; // no clock, set_source() or set_epoch() required
+#endif
+  }
+  return ms + this->offset;
+}
+
+
+//----------------------------------------------------------------------------//
+//                               MQTT client
+//----------------------------------------------------------------------------//
+// MQTT 3.1.1 control packet types, high nibble of the first byte
+#define SPARKPLUGB_MQTT_CONNECT 0x10
+#define SPARKPLUGB_MQTT_CONNACK 0x20
+#define SPARKPLUGB_MQTT_PUBLISH 0x30
+#define SPARKPLUGB_MQTT_PUBACK 0x40
+#define SPARKPLUGB_MQTT_SUBSCRIBE 0x82 // with the required flags
+#define SPARKPLUGB_MQTT_SUBACK 0x90
+#define SPARKPLUGB_MQTT_PINGREQ 0xC0
+#define SPARKPLUGB_MQTT_PINGRESP 0xD0
+#define SPARKPLUGB_MQTT_DISCONNECT 0xE0
+#define SPARKPLUGB_MQTT_MAX_LENGTH 268435455u // largest remaining length
+#define SPARKPLUGB_MQTT_READS 8 // transport reads per loop()
+
+// bytes taken by a remaining length
+static size_t mqtt_length_size(size_t length){
+  if(length < 128) return 1;
+  if(length < 16384) return 2;
+  if(length < 2097152) return 3;
+  return 4;
+}
+
+// write a fixed header, returns the bytes written
+static size_t mqtt_put_header(uint8_t* p, uint8_t type, size_t length){
+  size_t n = 0;
+
+  p[n++] = type;
+  do{
+    p[n] = (uint8_t)(length & 0x7F);
+    length >>= 7;
+    if(length > 0) p[n] |= 0x80;
+    n++;
+  }while(length > 0);
+  return n;
+}
+
+// write a length-prefixed string, returns the bytes written
+static size_t mqtt_put_string(uint8_t* p, const void* data, size_t length){
+  p[0] = (uint8_t)(length >> 8);
+  p[1] = (uint8_t)length;
+  memcpy(p + 2, data, length);
+  return length + 2;
+}
+
+#ifdef SPARKPLUGB_HAVE_POSIX
+static long socket_write(void* ctx, const uint8_t* data, size_t length){
+  int fd = *(int*)ctx;
+  ssize_t n;
+
+#ifdef MSG_NOSIGNAL
+  n = send(fd, data, length, MSG_NOSIGNAL);
+#else
+  n = send(fd, data, length, 0);
+#endif
+  if(n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+  return (long)n;
+}
+
+static long socket_read(void* ctx, uint8_t* data, size_t length){
+  int fd = *(int*)ctx;
+  ssize_t n = recv(fd, data, length, MSG_DONTWAIT);
+
+  if(n == 0) return -1; // closed by the broker
+  if(n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+  return (long)n;
+}
+#endif
+
+#ifdef ARDUINO
+static long client_write(void* ctx, const uint8_t* data, size_t length){
+  Client* client = (Client*)ctx;
+  size_t n = client->write(data, length);
+
+  if(n == 0 && !client->connected()) return -1;
+  return (long)n;
+}
+
+static long client_read(void* ctx, uint8_t* data, size_t length){
+  Client* client = (Client*)ctx;
+  int available = client->available();
+
+  if(available <= 0) return client->connected() ? 0 : -1;
+  if((size_t)available < length) length = available;
+  return client->read(data, length);
+}
+#endif
+
+sparkplugb_arduino_mqtt::sparkplugb_arduino_mqtt(){
+  this->write_fn = NULL;
+  this->read_fn = NULL;
+  this->transport_ctx = NULL;
+  this->callback = NULL;
+  this->callback_ctx = NULL;
+  this->tx = NULL;
+  this->tx_size = 0;
+  this->tx_start = 0;
+  this->tx_used = 0;
+  this->rx = NULL;
+  this->rx_size = 0;
+  this->rx_used = 0;
+  this->rx_skip = 0;
+  this->username = NULL;
+  this->password = NULL;
+  this->will_topic = NULL;
+  this->will_payload = NULL;
+  this->will_length = 0;
+  this->keep_alive = 60;
+  this->packet_id = 0;
+  this->status = SPARKPLUGB_MQTT_DISCONNECTED;
+  this->ping_outstanding = false;
+  this->wait_start = 0;
+  this->last_out = 0;
+  this->bytes_out = 0;
+  this->bytes_out_seen = 0;
+  this->socket_fd = -1;
+}
+
+sparkplugb_arduino_mqtt::~sparkplugb_arduino_mqtt(){
+  this->close();
+}
+
+void sparkplugb_arduino_mqtt::begin(uint8_t* tx, size_t tx_size, uint8_t* rx, size_t rx_size){
+  this->tx = tx;
+  this->tx_size = (tx == NULL) ? 0 : tx_size;
+  this->tx_start = 0;
+  this->tx_used = 0;
+  this->rx = rx;
+  this->rx_size = (rx == NULL) ? 0 : rx_size;
+  this->rx_used = 0;
+  this->rx_skip = 0;
+}
+
+void sparkplugb_arduino_mqtt::set_transport(sparkplugb_arduino_mqtt_write write,
+    sparkplugb_arduino_mqtt_read read, void* ctx)
+{
+  this->write_fn = write;
+  this->read_fn = read;
+  this->transport_ctx = ctx;
+  this->status = SPARKPLUGB_MQTT_DISCONNECTED;
+}
+
+#ifdef ARDUINO
+void sparkplugb_arduino_mqtt::set_client(Client* client){
+  this->set_transport(client_write, client_read, client);
+}
+#endif
+
+bool sparkplugb_arduino_mqtt::open(const char* host, uint16_t port){
+#ifdef SPARKPLUGB_HAVE_POSIX
+  struct addrinfo hints;
+  struct addrinfo* addresses;
+  struct addrinfo* a;
+  char service[8];
+  int fd = -1;
+  int one = 1;
+
+  this->close();
+  if(host == NULL) return false;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%u", (unsigned)port);
+  if(getaddrinfo(host, service, &hints, &addresses) != 0) return false;
+  for(a=addresses; a!=NULL; a=a->ai_next){
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if(fd < 0) continue;
+    if(::connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+    ::close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  if(fd < 0) return false;
+
+  // packets are already batched in the transmit buffer
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  this->socket_fd = fd;
+  this->set_transport(socket_write, socket_read, &this->socket_fd);
+  return true;
+#else
+  (void)host;
+  (void)port;
+  return false;
+#endif
+}
+
+void sparkplugb_arduino_mqtt::close(){
+#ifdef SPARKPLUGB_HAVE_POSIX
+  if(this->socket_fd >= 0){
+    ::close(this->socket_fd);
+    this->write_fn = NULL;
+    this->read_fn = NULL;
+    this->transport_ctx = NULL;
+  }
+#endif
+  this->socket_fd = -1;
+  this->status = SPARKPLUGB_MQTT_DISCONNECTED;
+}
+
+void sparkplugb_arduino_mqtt::set_callback(sparkplugb_arduino_mqtt_callback callback, void* ctx){
+  this->callback = callback;
+  this->callback_ctx = ctx;
+}
+
+void sparkplugb_arduino_mqtt::set_credentials(const char* username, const char* password){
+  this->username = username;
+  this->password = password;
+}
+
+void sparkplugb_arduino_mqtt::set_will(const char* topic, const uint8_t* payload, size_t length){
+  this->will_topic = topic;
+  this->will_payload = payload;
+  this->will_length = (payload == NULL) ? 0 : length;
+}
+
+void sparkplugb_arduino_mqtt::set_keep_alive(uint16_t seconds){
+  this->keep_alive = seconds;
+}
+
+bool sparkplugb_arduino_mqtt::connect(const char* client_id, uint64_t now){
+  size_t id_length;
+  size_t length;
+  uint8_t* p;
+  uint8_t flags = 0x02; // clean session
+
+  if(client_id == NULL || this->write_fn == NULL) return false;
+  id_length = strlen(client_id);
+  length = 10 + 2 + id_length;
+  if(this->will_topic != NULL){
+    length += 2 + strlen(this->will_topic) + 2 + this->will_length;
+    flags |= 0x04 | 0x08; // will, QoS 1
+  }
+  if(this->username != NULL){
+    length += 2 + strlen(this->username);
+    flags |= 0x80;
+  }
+  if(this->password != NULL){
+    length += 2 + strlen(this->password);
+    flags |= 0x40;
+  }
+  if(1 + mqtt_length_size(length) + length > this->tx_size) return false;
+
+  // a new connection starts with empty buffers
+  this->tx_start = 0;
+  this->rx_used = 0;
+  this->rx_skip = 0;
+  this->ping_outstanding = false;
+  p = this->tx;
+  p += mqtt_put_header(p, SPARKPLUGB_MQTT_CONNECT, length);
+  p += mqtt_put_string(p, "MQTT", 4);
+  *p++ = 4; // protocol level 3.1.1
+  *p++ = flags;
+  *p++ = (uint8_t)(this->keep_alive >> 8);
+  *p++ = (uint8_t)this->keep_alive;
+  p += mqtt_put_string(p, client_id, id_length);
+  if(this->will_topic != NULL){
+    p += mqtt_put_string(p, this->will_topic, strlen(this->will_topic));
+    p += mqtt_put_string(p, this->will_payload, this->will_length);
+  }
+  if(this->username != NULL) p += mqtt_put_string(p, this->username, strlen(this->username));
+  if(this->password != NULL) p += mqtt_put_string(p, this->password, strlen(this->password));
+  this->tx_used = p - this->tx;
+
+  this->status = SPARKPLUGB_MQTT_CONNECTING;
+  this->wait_start = now;
+  this->last_out = now;
+  return this->flush();
+}
+
+// Encode the payload behind the space its header needs at most, then write
+// the header in front of it
+bool sparkplugb_arduino_mqtt::encode_frame(sparkplugb_arduino_encoder* encoder, const char* topic,
+    size_t topic_length)
+{
+  uint8_t* start = this->tx + this->tx_used;
+  uint8_t* frame;
+  size_t space = this->tx_size - this->tx_used;
+  size_t header;
+  size_t length;
+
+  header = 3 + topic_length;
+  if(header + 1 >= space) return false;
+  header += mqtt_length_size(space - header + 2 + topic_length);
+  if(header >= space) return false;
+
+  length = encoder->encode(start + header, space - header);
+  if(length == (size_t)-1) return false;
+  length = sparkplugb_arduino_encoder::publish_header(start + header, length, topic, 0, 0, &frame);
+  if(length == (size_t)-1) return false;
+
+  if(frame != start){
+    // the remaining length is shorter than the worst case
+    if(this->tx_used == this->tx_start){
+      this->tx_start += frame - start; // nothing queued in front, skip the gap
+    }
+    else{
+      memmove(start, frame, length); // only small payloads with large buffers
+      frame = start;
+    }
+  }
+  this->tx_used = (frame - this->tx) + length;
+  return true;
+}
+
+bool sparkplugb_arduino_mqtt::publish(sparkplugb_arduino_encoder* encoder, const char* topic){
+  size_t topic_length;
+
+  if(encoder == NULL || topic == NULL || this->status != SPARKPLUGB_MQTT_CONNECTED) return false;
+  topic_length = strlen(topic);
+  if(topic_length > 0xFFFF) return false;
+  if(this->encode_frame(encoder, topic, topic_length)) return true;
+
+  // no room behind the queued packets, write them out and try again
+  if(this->tx_used == 0 || !this->flush() || this->tx_used != 0) return false;
+  return this->encode_frame(encoder, topic, topic_length);
+}
+
+bool sparkplugb_arduino_mqtt::publish(const char* topic, const uint8_t* payload, size_t length, bool retain){
+  size_t topic_length;
+  size_t remaining;
+  size_t total;
+  uint8_t* p;
+
+  if(topic == NULL || (payload == NULL && length > 0) ||
+     this->status != SPARKPLUGB_MQTT_CONNECTED) return false;
+  topic_length = strlen(topic);
+  remaining = 2 + topic_length + length;
+  if(topic_length > 0xFFFF || remaining > SPARKPLUGB_MQTT_MAX_LENGTH) return false;
+  total = 1 + mqtt_length_size(remaining) + remaining;
+
+  if(total > this->tx_size - this->tx_used && !this->make_room(this->tx_size)) return false;
+  if(total - length > this->tx_size) return false;
+
+  p = this->tx + this->tx_used;
+  p += mqtt_put_header(p, SPARKPLUGB_MQTT_PUBLISH | (retain ? SPARKPLUGB_MQTT_RETAIN : 0), remaining);
+  p += mqtt_put_string(p, topic, topic_length);
+  if(total <= this->tx_size - this->tx_used){
+    memcpy(p, payload, length);
+    this->tx_used += total;
+    return true;
+  }
+
+  // larger than the transmit buffer, send the header then the payload as is
+  this->tx_used = p - this->tx;
+  if(!this->write_all(this->tx, this->tx_used)) return false;
+  this->tx_used = 0;
+  return this->write_all(payload, length);
+}
+
+bool sparkplugb_arduino_mqtt::subscribe(const char* filter, uint8_t qos){
+  size_t filter_length;
+  size_t length;
+  uint8_t* p;
+
+  if(filter == NULL || this->status != SPARKPLUGB_MQTT_CONNECTED) return false;
+  filter_length = strlen(filter);
+  length = 2 + 2 + filter_length + 1;
+  if(filter_length > 0xFFFF) return false;
+  if(1 + mqtt_length_size(length) + length > this->tx_size - this->tx_used){
+    if(!this->flush() || 1 + mqtt_length_size(length) + length > this->tx_size - this->tx_used)
+      return false;
+  }
+
+  this->packet_id++;
+  if(this->packet_id == 0) this->packet_id = 1;
+  p = this->tx + this->tx_used;
+  p += mqtt_put_header(p, SPARKPLUGB_MQTT_SUBSCRIBE, length);
+  *p++ = (uint8_t)(this->packet_id >> 8);
+  *p++ = (uint8_t)this->packet_id;
+  p += mqtt_put_string(p, filter, filter_length);
+  *p++ = (qos > 0) ? 1 : 0;
+  this->tx_used = p - this->tx;
+  return this->flush();
+}
+
+bool sparkplugb_arduino_mqtt::flush(){
+  long n;
+
+  if(this->write_fn == NULL){
+    this->lost();
+    return false;
+  }
+  while(this->tx_start < this->tx_used){
+    n = this->write_fn(this->transport_ctx, this->tx + this->tx_start, this->tx_used - this->tx_start);
+    if(n < 0){
+      this->lost();
+      return false;
+    }
+    if(n == 0) break; // would block, keep the rest queued
+    this->tx_start += n;
+    this->bytes_out += n;
+  }
+  if(this->tx_start == this->tx_used){
+    this->tx_start = 0;
+    this->tx_used = 0;
+  }
+  else if(this->tx_start > 0){
+    memmove(this->tx, this->tx + this->tx_start, this->tx_used - this->tx_start);
+    this->tx_used -= this->tx_start;
+    this->tx_start = 0;
+  }
+  return true;
+}
+
+// free length bytes of the transmit buffer, writing what flush() could not
+// send blocking; false if the buffer is smaller or the connection is lost
+bool sparkplugb_arduino_mqtt::make_room(size_t length){
+  if(length > this->tx_size) return false;
+  if(length <= this->tx_size - this->tx_used) return true;
+  if(!this->flush()) return false;
+  if(length > this->tx_size - this->tx_used){
+    if(!this->write_all(this->tx, this->tx_used)) return false;
+    this->tx_start = 0;
+    this->tx_used = 0;
+  }
+  return true;
+}
+
+// write bytes that are not in the transmit buffer, blocking until done
+bool sparkplugb_arduino_mqtt::write_all(const uint8_t* data, size_t length){
+  long n;
+
+  while(length > 0){
+    n = this->write_fn(this->transport_ctx, data, length);
+    if(n < 0){
+      this->lost();
+      return false;
+    }
+#if defined(SPARKPLUGB_HAVE_POSIX)
+    if(n == 0) sched_yield();
+#elif defined(ARDUINO)
+    if(n == 0) yield(); // let the network stack and other tasks run
+#endif
+    data += n;
+    length -= n;
+    this->bytes_out += n;
+  }
+  return true;
+}
+
+bool sparkplugb_arduino_mqtt::loop(uint64_t now){
+  uint8_t* p;
+
+  if(this->status == SPARKPLUGB_MQTT_DISCONNECTED) return false;
+  if(!this->flush() || !this->receive()) return false;
+  if(this->tx_used != this->tx_start && !this->flush()) return false; // PUBACKs
+
+  if(this->bytes_out != this->bytes_out_seen){
+    this->bytes_out_seen = this->bytes_out;
+    this->last_out = now;
+  }
+  if(this->status == SPARKPLUGB_MQTT_CONNECTING || this->ping_outstanding){
+    if(now - this->wait_start > SPARKPLUGB_MQTT_TIMEOUT_MS){
+      this->lost(); // no CONNACK or PINGRESP
+      return false;
+    }
+  }
+  else if(this->keep_alive > 0 && now - this->last_out >= (uint64_t)this->keep_alive * 1000 &&
+          this->tx_size - this->tx_used >= 2)
+  {
+    p = this->tx + this->tx_used;
+    p[0] = SPARKPLUGB_MQTT_PINGREQ;
+    p[1] = 0;
+    this->tx_used += 2;
+    this->ping_outstanding = true;
+    this->wait_start = now;
+    if(!this->flush()) return false;
+  }
+  return this->status != SPARKPLUGB_MQTT_DISCONNECTED;
+}
+
+// Read what the transport has and handle every complete packet
+bool sparkplugb_arduino_mqtt::receive(){
+  size_t position;
+  size_t length;
+  size_t header;
+  size_t shift;
+  long n;
+  int reads;
+  uint8_t type;
+  uint8_t c;
+  bool complete;
+
+  if(this->read_fn == NULL || this->rx_size == 0) return true;
+  for(reads=0; reads<SPARKPLUGB_MQTT_READS; reads++){
+    n = this->read_fn(this->transport_ctx, this->rx + this->rx_used, this->rx_size - this->rx_used);
+    if(n < 0){
+      this->lost();
+      return false;
+    }
+    if(n == 0) break;
+    this->rx_used += n;
+
+    position = 0;
+    if(this->rx_skip > 0){
+      // drop the rest of a packet that did not fit
+      position = (this->rx_skip < this->rx_used) ? this->rx_skip : this->rx_used;
+      this->rx_skip -= position;
+    }
+    while(position < this->rx_used){
+      // fixed header: type and a remaining length of up to 4 bytes
+      length = 0;
+      header = 1;
+      shift = 0;
+      complete = false;
+      while(position + header < this->rx_used){
+        c = this->rx[position + header++];
+        length |= (size_t)(c & 0x7F) << shift;
+        if((c & 0x80) == 0){
+          complete = true;
+          break;
+        }
+        shift += 7;
+        if(header > 4){
+          this->lost(); // malformed remaining length
+          return false;
+        }
+      }
+      if(!complete) break;
+
+      if(header + length > this->rx_size){
+        this->rx_skip = header + length - (this->rx_used - position);
+        position = this->rx_used;
+        break;
+      }
+      if(position + header + length > this->rx_used) break;
+      type = this->rx[position];
+      this->handle(type, this->rx + position + header, length);
+      if(this->status == SPARKPLUGB_MQTT_DISCONNECTED) return false;
+      position += header + length;
+    }
+
+    // keep the start of an incomplete packet
+    this->rx_used -= position;
+    if(this->rx_used > 0 && position > 0) memmove(this->rx, this->rx + position, this->rx_used);
+  }
+  return true;
+}
+
+void sparkplugb_arduino_mqtt::handle(uint8_t type, uint8_t* body, size_t length){
+  size_t topic_length;
+  size_t offset;
+  uint8_t qos;
+  uint8_t* p;
+
+  switch(type & 0xF0){
+    case SPARKPLUGB_MQTT_CONNACK:
+      if(length < 2 || body[1] != 0){
+        this->lost(); // refused
+        return;
+      }
+      this->status = SPARKPLUGB_MQTT_CONNECTED;
+      break;
+    case SPARKPLUGB_MQTT_PUBLISH:
+      qos = (type >> 1) & 0x03;
+      if(length < 2) return;
+      topic_length = ((size_t)body[0] << 8) | body[1];
+      offset = 2 + topic_length + (qos > 0 ? 2 : 0);
+      if(offset > length) return;
+      if(this->callback != NULL){
+        this->callback(this->callback_ctx, (const char*)body + 2, topic_length,
+                       body + offset, length - offset);
+      }
+      // a full transmit buffer is written out rather than the PUBACK dropped,
+      // which would make the broker hold the message and send it again
+      if(qos == 1 && this->make_room(4)){
+        p = this->tx + this->tx_used;
+        p[0] = SPARKPLUGB_MQTT_PUBACK;
+        p[1] = 2;
+        p[2] = body[2 + topic_length];
+        p[3] = body[3 + topic_length];
+        this->tx_used += 4;
+      }
+      break;
+    case SPARKPLUGB_MQTT_PINGRESP:
+      this->ping_outstanding = false;
+      break;
+    default:
+      break; // SUBACK, PUBACK of the will, ...
+  }
+}
+
+void sparkplugb_arduino_mqtt::disconnect(){
+  uint8_t packet[2] = {SPARKPLUGB_MQTT_DISCONNECT, 0};
+
+  if(this->status == SPARKPLUGB_MQTT_DISCONNECTED) return;
+  if(this->flush() && this->tx_used == 0) this->write_all(packet, sizeof(packet));
+  this->status = SPARKPLUGB_MQTT_DISCONNECTED;
+}
+
+// the connection is gone, queued packets with it
+void sparkplugb_arduino_mqtt::lost(){
+  this->status = SPARKPLUGB_MQTT_DISCONNECTED;
+  this->tx_start = 0;
+  this->tx_used = 0;
+  this->rx_used = 0;
+  this->rx_skip = 0;
+  this->ping_outstanding = false;
+}
+
+uint8_t sparkplugb_arduino_mqtt::state(){
+  return this->status;
+}
+
+bool sparkplugb_arduino_mqtt::connected(){
+  return this->status == SPARKPLUGB_MQTT_CONNECTED;
+}
+
+size_t sparkplugb_arduino_mqtt::pending(){
+  return this->tx_used - this->tx_start;
+}
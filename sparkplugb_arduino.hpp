@@ -17,7 +17,9 @@ the Teensy 4.1.
 */
 #ifndef __SPARKPLUGB_ARDUINO_H__
 #define __SPARKPLUGB_ARDUINO_H__
+#include <string.h>
 #include "tahu.pb.h"
+#include "pb_decode.h"
 
 //----------------------------------------------------------------------------//
 // Constants
@@ -92,6 +94,124 @@ the Teensy 4.1.
 #define PROPERTY_DATA_TYPE_TEXT 14
 //----------------------------------------------------------------------------//
 
+/*
+@brief Compile-time mapping of C++ types to Sparkplug metric values
+
+datatype is the METRIC_DATA_TYPE_* written with the metric, which_value the
+union member holding it. Integers map by size and signedness: 8 to 32-bit
+signed and 8/16-bit unsigned values go in int_value (signed values sign
+extended to 32 bits), 64-bit and unsigned 32-bit values in long_value.
+Unsupported types have no specialization and fail to compile.
+*/
+template<typename T> struct sparkplugb_arduino_metric_type;
+
+template<size_t SIZE, bool SIGNED> struct sparkplugb_arduino_int_metric_type;
+
+// int_value holders
+template<size_t SIZE, uint32_t DATATYPE, bool SIGNED>
+struct sparkplugb_arduino_int_value_type{
+  static const uint32_t datatype = DATATYPE;
+  static const pb_size_t which_value = org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag;
+  template<typename T>
+  static void set(org_eclipse_tahu_protobuf_Payload_Metric* metric, T value){
+    metric->value.int_value = SIGNED ? (uint32_t)(int32_t)value : (uint32_t)value;
+  }
+};
+
+// long_value holders
+template<uint32_t DATATYPE, bool SIGNED>
+struct sparkplugb_arduino_long_value_type{
+  static const uint32_t datatype = DATATYPE;
+  static const pb_size_t which_value = org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag;
+  template<typename T>
+  static void set(org_eclipse_tahu_protobuf_Payload_Metric* metric, T value){
+    metric->value.long_value = SIGNED ? (uint64_t)(int64_t)value : (uint64_t)value;
+  }
+};
+
+template<> struct sparkplugb_arduino_int_metric_type<1, true>
+  : sparkplugb_arduino_int_value_type<1, METRIC_DATA_TYPE_INT8, true>{};
+template<> struct sparkplugb_arduino_int_metric_type<2, true>
+  : sparkplugb_arduino_int_value_type<2, METRIC_DATA_TYPE_INT16, true>{};
+template<> struct sparkplugb_arduino_int_metric_type<4, true>
+  : sparkplugb_arduino_int_value_type<4, METRIC_DATA_TYPE_INT32, true>{};
+template<> struct sparkplugb_arduino_int_metric_type<8, true>
+  : sparkplugb_arduino_long_value_type<METRIC_DATA_TYPE_INT64, true>{};
+template<> struct sparkplugb_arduino_int_metric_type<1, false>
+  : sparkplugb_arduino_int_value_type<1, METRIC_DATA_TYPE_UINT8, false>{};
+template<> struct sparkplugb_arduino_int_metric_type<2, false>
+  : sparkplugb_arduino_int_value_type<2, METRIC_DATA_TYPE_UINT16, false>{};
+template<> struct sparkplugb_arduino_int_metric_type<4, false>
+  : sparkplugb_arduino_long_value_type<METRIC_DATA_TYPE_UINT32, false>{};
+template<> struct sparkplugb_arduino_int_metric_type<8, false>
+  : sparkplugb_arduino_long_value_type<METRIC_DATA_TYPE_UINT64, false>{};
+
+// every integer type, whatever int32_t and friends are typedefs of
+#define SPARKPLUGB_INT_METRIC_TYPE(type, is_signed) \
+  template<> struct sparkplugb_arduino_metric_type<type> \
+    : sparkplugb_arduino_int_metric_type<sizeof(type), is_signed>{};
+SPARKPLUGB_INT_METRIC_TYPE(signed char, true)
+SPARKPLUGB_INT_METRIC_TYPE(short, true)
+SPARKPLUGB_INT_METRIC_TYPE(int, true)
+SPARKPLUGB_INT_METRIC_TYPE(long, true)
+SPARKPLUGB_INT_METRIC_TYPE(long long, true)
+SPARKPLUGB_INT_METRIC_TYPE(unsigned char, false)
+SPARKPLUGB_INT_METRIC_TYPE(unsigned short, false)
+SPARKPLUGB_INT_METRIC_TYPE(unsigned int, false)
+SPARKPLUGB_INT_METRIC_TYPE(unsigned long, false)
+SPARKPLUGB_INT_METRIC_TYPE(unsigned long long, false)
+#undef SPARKPLUGB_INT_METRIC_TYPE
+
+template<> struct sparkplugb_arduino_metric_type<float>{
+  static const uint32_t datatype = METRIC_DATA_TYPE_FLOAT;
+  static const pb_size_t which_value = org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag;
+  static void set(org_eclipse_tahu_protobuf_Payload_Metric* metric, float value){
+    metric->value.float_value = value;
+  }
+};
+
+template<> struct sparkplugb_arduino_metric_type<double>{
+  static const uint32_t datatype = METRIC_DATA_TYPE_DOUBLE;
+  static const pb_size_t which_value = org_eclipse_tahu_protobuf_Payload_Metric_double_value_tag;
+  static void set(org_eclipse_tahu_protobuf_Payload_Metric* metric, double value){
+    metric->value.double_value = value;
+  }
+};
+
+template<> struct sparkplugb_arduino_metric_type<bool>{
+  static const uint32_t datatype = METRIC_DATA_TYPE_BOOLEAN;
+  static const pb_size_t which_value = org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag;
+  static void set(org_eclipse_tahu_protobuf_Payload_Metric* metric, bool value){
+    metric->value.boolean_value = value;
+  }
+};
+
+// strings are referenced, not copied
+template<> struct sparkplugb_arduino_metric_type<const char*>{
+  static const uint32_t datatype = METRIC_DATA_TYPE_STRING;
+  static const pb_size_t which_value = org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag;
+  static void set(org_eclipse_tahu_protobuf_Payload_Metric* metric, const char* value){
+    metric->value.string_value = (char*)value;
+  }
+};
+template<> struct sparkplugb_arduino_metric_type<char*>
+  : sparkplugb_arduino_metric_type<const char*>{};
+
+// MQTT 3.1.1 PUBLISH flags, see sparkplugb_arduino_encoder::publish_header()
+#define SPARKPLUGB_MQTT_RETAIN 0x01
+#define SPARKPLUGB_MQTT_QOS1 0x02
+#define SPARKPLUGB_MQTT_QOS2 0x04
+
+// bytes a PUBLISH header can take in front of the payload: packet type,
+// remaining length (up to 4 bytes), topic length, topic and packet id
+#define SPARKPLUGB_PUBLISH_HEADROOM(topic_length) (9 + (size_t)(topic_length))
+
+// smallest payload whose metrics are encoded on several threads, see
+// set_encode_threads()
+#ifndef SPARKPLUGB_PARALLEL_MIN_METRICS
+#define SPARKPLUGB_PARALLEL_MIN_METRICS 1024
+#endif
+
 /*
 @brief Encoder for Sparkplug B MQTT protocol
 */
@@ -141,12 +261,290 @@ public:
   */
   size_t encode(org_eclipse_tahu_protobuf_Payload* payload, uint8_t* buffer,
               size_t buffer_length);
+
+  /*
+  @brief encode the payload as a complete MQTT PUBLISH packet (QoS 0)
+  @param topic topic to publish to
+  @param buffer buffer for the packet, SPARKPLUGB_PUBLISH_HEADROOM(strlen(topic))
+  bytes more than the payload needs
+  @param buffer_length size of the buffer
+  @param frame set to the start of the packet, which is inside buffer
+  @return packet length, or -1 on failure
+
+  The payload is encoded after the headroom and the PUBLISH header and topic
+  are then written right in front of it, so the packet can be handed to the
+  socket as is, e.g. client.write(frame, length), without being copied into
+  the MQTT client's own buffer.
+  */
+  size_t encode_publish(const char* topic, uint8_t* buffer, size_t buffer_length, uint8_t** frame);
+
+  /*
+  @brief write an MQTT 3.1.1 PUBLISH header in front of a payload
+  @param payload payload, with SPARKPLUGB_PUBLISH_HEADROOM(strlen(topic))
+  writable bytes in front of it
+  @param payload_length payload size
+  @param topic topic to publish to
+  @param flags SPARKPLUGB_MQTT_* flags
+  @param packet_id packet identifier, only written for QoS 1 and 2
+  @param frame set to the start of the packet
+  @return packet length, or -1 if the topic or the payload is too long
+  */
+  static size_t publish_header(uint8_t* payload, size_t payload_length, const char* topic,
+                               uint8_t flags, uint16_t packet_id, uint8_t** frame);
   /*
   @brief clear (zeros) the payload and metric data
   */
   void clear_payload();
+
+  /*
+  @brief give the payload an empty pool of metrics for add() to fill
+  @param metrics pointer to the array of metrics
+  @param capacity length of the array of metrics
+  */
+  bool set_metric_pool(org_eclipse_tahu_protobuf_Payload_Metric* metrics, int capacity);
+
+  /*
+  @brief empty the metric pool, e.g. before building the next payload
+  */
+  void clear_metrics();
+
+  /*
+  @brief add a metric to the payload, e.g. add<float>("temp", 21.5f)
+  @param name metric name, NULL for none; the string is referenced, not copied
+  @param value value, its C++ type selects datatype and value field
+  @return the metric, or NULL if the pool is full
+
+  The metric has no timestamp; set has_timestamp and timestamp on the
+  returned metric if it needs one.
+  */
+  template<typename T>
+  org_eclipse_tahu_protobuf_Payload_Metric* add(const char* name, T value){
+    return this->add_value<T>(this->next_metric(name, false, 0,
+        sparkplugb_arduino_metric_type<T>::datatype), value);
+  }
+
+  /*
+  @brief add a metric with an alias to the payload, e.g. add<float>("temp", 3, 21.5f)
+  @param name metric name, NULL to send the alias only
+  @param alias metric alias
+  @param value value, its C++ type selects datatype and value field
+  @return the metric, or NULL if the pool is full
+  */
+  template<typename T>
+  org_eclipse_tahu_protobuf_Payload_Metric* add(const char* name, uint64_t alias, T value){
+    return this->add_value<T>(this->next_metric(name, true, alias,
+        sparkplugb_arduino_metric_type<T>::datatype), value);
+  }
+
+  /*
+  @brief add a null metric to the payload
+  @param name metric name
+  @param datatype METRIC_DATA_TYPE_* of the metric
+  @return the metric, or NULL if the pool is full
+  */
+  org_eclipse_tahu_protobuf_Payload_Metric* add_null(const char* name, uint32_t datatype);
+
+  /*
+  @brief add a DataSet metric to the payload
+  @param name metric name
+  @param columns number of columns
+  @param column_names name of each column
+  @param types DATA_SET_DATA_TYPE_* of each column
+  @param rows rows, each holding columns elements
+  @param rows_count number of rows
+  @return the metric, or NULL if the pool is full
+
+  All arrays are referenced, not copied.
+  */
+  org_eclipse_tahu_protobuf_Payload_Metric* add_dataset(const char* name, uint32_t columns,
+      const char* const* column_names, const uint32_t* types,
+      org_eclipse_tahu_protobuf_Payload_DataSet_Row* rows, uint32_t rows_count);
+
+  /*
+  @brief leave out metric timestamps that equal the payload timestamp
+  @param enable true to omit them
+
+  Sparkplug readers take the payload timestamp for a metric without one,
+  so this saves about 7 bytes per metric on DDATA where all metrics share
+  the payload timestamp. See also decoder.set_fill_metric_timestamps().
+  */
+  void set_omit_metric_timestamps(bool enable);
+
+  /*
+  @brief encode large payloads' metrics on several threads (POSIX hosts only)
+  @param threads number of threads to use, 0 or 1 to encode on the caller only
+
+  With SPARKPLUGB_PARALLEL_MIN_METRICS metrics or more, ranges of metrics
+  are first sized and then written in parallel, each straight to its place
+  in the buffer. The bytes are the same as from a serial encode. Ignored on
+  targets without POSIX threads.
+  */
+  void set_encode_threads(unsigned threads);
+private:
+  friend class sparkplugb_arduino_birth_cache;
+  friend class sparkplugb_arduino_aggregator;
+
+  bool omit_timestamps; // set_omit_metric_timestamps() setting
+  unsigned encode_threads; // set_encode_threads() setting
+  pb_size_t pool_capacity; // length of the set_metric_pool() array
+
+  org_eclipse_tahu_protobuf_Payload_Metric* next_metric(const char* name,
+      bool has_alias, uint64_t alias, uint32_t datatype);
+
+  template<typename T>
+  org_eclipse_tahu_protobuf_Payload_Metric* add_value(
+      org_eclipse_tahu_protobuf_Payload_Metric* metric, T value)
+  {
+    if(metric == NULL) return NULL;
+    metric->which_value = sparkplugb_arduino_metric_type<T>::which_value;
+    sparkplugb_arduino_metric_type<T>::set(metric, value);
+    return metric;
+  }
+
+  bool encode_payload(pb_ostream_t* stream, org_eclipse_tahu_protobuf_Payload* payload);
+  bool encode_metric(pb_ostream_t* stream, const org_eclipse_tahu_protobuf_Payload_Metric* metric,
+                     bool omit_timestamp);
+  bool encode_dataset_metric(pb_ostream_t* stream, const org_eclipse_tahu_protobuf_Payload_Metric* metric);
+  bool encode_metrics(pb_ostream_t* stream, org_eclipse_tahu_protobuf_Payload* payload, bool omit);
+  bool encode_metrics_parallel(pb_ostream_t* stream, org_eclipse_tahu_protobuf_Payload* payload, bool omit);
+  static void* encode_metric_ranges(void* job);
+};
+
+// bytes kept free in front of the cached BIRTH metrics for the payload
+// timestamp and the bdSeq metric
+#ifndef SPARKPLUGB_BIRTH_HEADROOM
+#define SPARKPLUGB_BIRTH_HEADROOM 64
+#endif
+
+/*
+@brief Encoded NBIRTH/DBIRTH kept for fast rebirths
+
+A rebirth request makes a node send its whole BIRTH again, with every metric
+name, property and metadata, typically while the host is busy with many
+reconnecting nodes. The cache keeps the encoded metrics of the last BIRTH, so
+that the next one only writes the payload timestamp, the bdSeq metric, seq
+and the fields after the metrics around them.
+
+Metrics other than bdSeq are sent as they were when the cache was filled,
+values, timestamps and metadata included. The cache only notices a different
+metrics array or count, or a change in the metric names, aliases, datatypes
+or properties, which it checks with a hash on every encode(). That hash reads
+every name and property, so a cache hit still takes time in proportion to the
+number of metrics, though far less than encoding them. Anything else is the
+caller's responsibility: a BIRTH is only correct if invalidate() is called
+whenever another part of a metric changes.
+
+The bdSeq metric is moved to the front of the metrics, so the order of the
+metrics in the message differs from the payload's metrics array. Metrics
+other than bdSeq keep their own timestamps even if the encoder omits
+timestamps equal to the payload timestamp.
+*/
+class sparkplugb_arduino_birth_cache{
+public:
+  sparkplugb_arduino_birth_cache(); // constructor
+
+  /*
+  @brief assign the storage for the encoded BIRTH
+  @param buffer storage, SPARKPLUGB_BIRTH_HEADROOM bytes more than the
+  largest BIRTH
+  @param size size of the buffer
+  */
+  void begin(uint8_t* buffer, size_t size);
+
+  /*
+  @brief encode a BIRTH, reusing the cached metrics when still valid
+  @param encoder encoder whose settings (omitted timestamps, threads) apply
+  @param payload BIRTH payload with the current timestamp, seq and bdSeq
+  @return length of the message at data(), or -1 if it does not fit
+  */
+  size_t encode(sparkplugb_arduino_encoder* encoder, org_eclipse_tahu_protobuf_Payload* payload);
+
+  /*
+  @brief drop the cached metrics, the next encode() encodes them all
+  */
+  void invalidate();
+
+  /*
+  @brief true if the next encode() can reuse the cached metrics
+  */
+  bool valid();
+
+  /*
+  @brief start of the message written by the last encode()
+  */
+  const uint8_t* data();
 private:
+  uint8_t* buffer;
+  size_t size;
+  bool cached;
+  const org_eclipse_tahu_protobuf_Payload_Metric* metrics; // metrics array of the cache
+  pb_size_t metrics_count;
+  pb_size_t bdseq; // index of the bdSeq metric, metrics_count if none
+  uint64_t fingerprint; // hash of the metric definitions of the cache
+  size_t metrics_length; // cached metric bytes, at SPARKPLUGB_BIRTH_HEADROOM
+  size_t head_length; // bytes in front of the metrics written by encode()
+
+  bool encode_metrics(sparkplugb_arduino_encoder* encoder, org_eclipse_tahu_protobuf_Payload* payload,
+                      uint64_t fingerprint);
+};
+
+/*
+@brief Heap usage of a decoded payload, see track_allocations()
+*/
+struct sparkplugb_arduino_alloc_stats{
+  uint32_t allocations; // pb_realloc calls made by the last decode
+  uint32_t frees; // pb_free calls since the last decode (pb_release)
+  size_t bytes; // total bytes requested by those pb_realloc calls
+  size_t live_bytes; // bytes currently held by the decoded payload
+  size_t peak_bytes; // largest live_bytes seen since the last decode
+};
+
+// smallest DataSet decoded on several threads, see set_decode_threads()
+#ifndef SPARKPLUGB_PARALLEL_MIN_ROWS
+#define SPARKPLUGB_PARALLEL_MIN_ROWS 4096
+#endif
+
+/*
+@brief Limits applied to each decode, see set_limits(). 0 means no limit.
+*/
+struct sparkplugb_arduino_decode_limits{
+  size_t max_bytes; // heap bytes the decoded payload may hold
+  uint32_t max_metrics; // metrics, including metrics inside templates
+  uint32_t max_string_length; // length of any single string
+  uint32_t max_dataset_cells; // DataSet values, summed over all DataSets
+};
+
+/*
+@brief Visitor used by sparkplugb_arduino_decoder::get()
+
+Numbers and booleans convert to any arithmetic T as by a C++ cast; strings,
+bytes, DataSets and templates only to a pointer of their own type.
+*/
+template<typename T>
+struct sparkplugb_arduino_value_getter{
+  T* out;
+  template<typename U> bool operator()(U value){ *this->out = (T)value; return true; }
+  bool operator()(const char*){ return false; }
+  bool operator()(const pb_bytes_array_t*){ return false; }
+  bool operator()(const org_eclipse_tahu_protobuf_Payload_DataSet*){ return false; }
+  bool operator()(const org_eclipse_tahu_protobuf_Payload_Template*){ return false; }
+};
+
+// pointer results: only the matching value kind
+template<typename P>
+struct sparkplugb_arduino_pointer_getter{
+  P* out;
+  template<typename U> bool operator()(U){ return false; }
+  bool operator()(P value){ *this->out = value; return true; }
 };
+template<> struct sparkplugb_arduino_value_getter<const char*>
+  : sparkplugb_arduino_pointer_getter<const char*>{};
+template<> struct sparkplugb_arduino_value_getter<const pb_bytes_array_t*>
+  : sparkplugb_arduino_pointer_getter<const pb_bytes_array_t*>{};
+template<> struct sparkplugb_arduino_value_getter<const org_eclipse_tahu_protobuf_Payload_DataSet*>
+  : sparkplugb_arduino_pointer_getter<const org_eclipse_tahu_protobuf_Payload_DataSet*>{};
+template<> struct sparkplugb_arduino_value_getter<const org_eclipse_tahu_protobuf_Payload_Template*>
+  : sparkplugb_arduino_pointer_getter<const org_eclipse_tahu_protobuf_Payload_Template*>{};
 
 /*
 @brief Decoder for Sparkplug B MQTT protocol
@@ -157,6 +555,68 @@ public:
   org_eclipse_tahu_protobuf_Payload payload;
 
   sparkplugb_arduino_decoder(); // constructor
+  virtual ~sparkplugb_arduino_decoder(){} // subclasses may be used through a base pointer
+
+  /*
+  @brief set the allocator used for the decoded payload
+  @param allocator allocator to use, or NULL for realloc()/free()
+
+  The allocator is installed with pb_set_allocator() for the duration of
+  decode() and free_payload(). Do not change it while a payload is decoded.
+  */
+  void set_allocator(const pb_allocator_t* allocator);
+
+  /*
+  @brief record heap usage of each decode
+  @param enable true to record allocation counters
+
+  While enabled, every allocation made by decode() carries a small size
+  header so that live and peak bytes can be tracked. A payload decoded with
+  tracking enabled must be released with free_payload(), not pb_release().
+  */
+  void track_allocations(bool enable);
+
+  /*
+  @brief get the heap usage recorded for the last decode
+  @return the counters; all zero if tracking is disabled
+  */
+  sparkplugb_arduino_alloc_stats get_alloc_stats();
+
+  /*
+  @brief reject payloads that would exceed the given limits
+  @param limits limits to apply; all zero (the default) disables them
+
+  Before anything is allocated, decode() scans the binary payload and fails
+  if it holds too many metrics or DataSet cells, or a string that is too long.
+  max_bytes is enforced on each allocation while decoding, which requires
+  allocation tracking (see track_allocations) for that payload.
+  */
+  void set_limits(sparkplugb_arduino_decode_limits limits);
+
+  /*
+  @brief give metrics without a timestamp the payload timestamp
+  @param enable true to fill in missing metric timestamps after each decode
+  */
+  void set_fill_metric_timestamps(bool enable);
+
+  /*
+  @brief decode large DataSets on several threads (POSIX hosts only)
+  @param threads number of threads to use, 0 or 1 to decode on the caller only
+
+  DataSets of SPARKPLUGB_PARALLEL_MIN_ROWS rows or more in the payload's
+  metrics are located first, the rest of the payload is decoded, and then
+  their rows are decoded in parallel into one preallocated row array per
+  DataSet. Only used with the default allocator and allocation tracking
+  off, since custom allocators need not be thread-safe; ignored on targets
+  without POSIX threads.
+  */
+  void set_decode_threads(unsigned threads);
+
+  /*
+  @brief reason the last decode failed
+  @return error message, or NULL if the last decode succeeded
+  */
+  virtual const char* get_error();
 
   /*
   @brief perform a decode
@@ -165,15 +625,1436 @@ public:
 
   This function decodes the payload in to payload.
   It basically creates a stream and calls pb_decode.
+  Virtual, like free_payload() and get_error(), so that decoders with their
+  own storage (sparkplugb_arduino_static_decoder) behave the same when used
+  through a sparkplugb_arduino_decoder pointer or reference.
   */
-  bool decode(const pb_byte_t *binary_payload, size_t binary_payloadlen);
+  virtual bool decode(const pb_byte_t *binary_payload, size_t binary_payloadlen);
 
   /*
   @brief free the payload's dynamiclly allocated memory and zero the payload.
 
   This function basically calls pb_release and sets the payload data to zero.
   */
-  void free_payload();
+  virtual void free_payload();
+
+  /*
+  @brief find a metric of the decoded payload
+  @param name metric name, or alias
+  @return the first matching metric, or NULL if there is none
+  */
+  const org_eclipse_tahu_protobuf_Payload_Metric* find(const char* name);
+  const org_eclipse_tahu_protobuf_Payload_Metric* find(uint64_t alias);
+  // an int literal is an alias, find(0) would be ambiguous otherwise
+  const org_eclipse_tahu_protobuf_Payload_Metric* find(int alias){
+    return this->find((uint64_t)alias);
+  }
+
+  /*
+  @brief read a metric of the decoded payload, e.g. get("temp", &temp)
+  @param key metric name or alias
+  @param value set to the metric value, left alone on failure
+  @return false if the metric is missing, null, or of an incompatible type
+
+  See get_value() for the conversions done.
+  */
+  template<typename K, typename T>
+  bool get(K key, T* value){
+    return get_value(this->find(key), value);
+  }
+
+  /*
+  @brief pass the value of a metric to visitor, see visit_value()
+  @param key metric name or alias
+  @return false if the metric is missing, otherwise as visit_value()
+  */
+  template<typename K, typename V>
+  bool visit(K key, V& visitor){
+    return visit_value(this->find(key), visitor);
+  }
+
+  /*
+  @brief read the value of a metric
+  @param metric metric to read, may be NULL
+  @param value set to the metric value, left alone on failure
+  @return false if metric is NULL, null, or of an incompatible type
+
+  Integer, floating point, boolean and DATETIME values convert to any
+  arithmetic type as by a C++ cast, after being read as their datatype (so
+  INT8 and INT16 are sign extended). STRING, TEXT and UUID values are read
+  as const char*, BYTES and FILE as const pb_bytes_array_t*, DATASET and
+  TEMPLATE as a const pointer to the decoded struct; all point into the
+  decoded payload and are not copied.
+  */
+  template<typename T>
+  static bool get_value(const org_eclipse_tahu_protobuf_Payload_Metric* metric, T* value){
+    sparkplugb_arduino_value_getter<T> getter;
+    getter.out = value;
+    return visit_value(metric, getter);
+  }
+
+  /*
+  @brief call visitor with the value of a metric, as its datatype
+  @param metric metric to visit, may be NULL
+  @param visitor object with bool operator() for each of int8_t, int16_t,
+    int32_t, int64_t, uint8_t, uint16_t, uint32_t, uint64_t (also DATETIME),
+    float, double, bool, const char* (STRING, TEXT, UUID),
+    const pb_bytes_array_t* (BYTES, FILE), and const pointers to DataSet and
+    Template; a template operator() can stand in for any of them
+  @return false if metric is NULL or null, or its value field does not
+    match its datatype; otherwise what the visitor returned
+
+  A metric without a datatype, as is usual in DATA messages, is visited by
+  its value field: int_value as int32_t and long_value as int64_t.
+  */
+  template<typename V>
+  static bool visit_value(const org_eclipse_tahu_protobuf_Payload_Metric* metric, V& visitor){
+    const uint32_t INT_TAG = org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag;
+    const uint32_t LONG_TAG = org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag;
+    uint32_t datatype;
+
+    if(metric == NULL || (metric->has_is_null && metric->is_null)) return false;
+    datatype = metric->has_datatype ? metric->datatype : value_datatype(metric->which_value);
+    switch(datatype){
+      case METRIC_DATA_TYPE_INT8:
+        if(metric->which_value != INT_TAG) return false;
+        return visitor((int8_t)metric->value.int_value);
+      case METRIC_DATA_TYPE_INT16:
+        if(metric->which_value != INT_TAG) return false;
+        return visitor((int16_t)metric->value.int_value);
+      case METRIC_DATA_TYPE_INT32:
+        if(metric->which_value != INT_TAG) return false;
+        return visitor((int32_t)metric->value.int_value);
+      case METRIC_DATA_TYPE_INT64:
+        if(metric->which_value != LONG_TAG) return false;
+        return visitor((int64_t)metric->value.long_value);
+      case METRIC_DATA_TYPE_UINT8:
+        if(metric->which_value != INT_TAG) return false;
+        return visitor((uint8_t)metric->value.int_value);
+      case METRIC_DATA_TYPE_UINT16:
+        if(metric->which_value != INT_TAG) return false;
+        return visitor((uint16_t)metric->value.int_value);
+      case METRIC_DATA_TYPE_UINT32:
+        // long_value per the specification, some encoders use int_value
+        if(metric->which_value == LONG_TAG) return visitor((uint32_t)metric->value.long_value);
+        if(metric->which_value != INT_TAG) return false;
+        return visitor((uint32_t)metric->value.int_value);
+      case METRIC_DATA_TYPE_UINT64:
+      case METRIC_DATA_TYPE_DATETIME:
+        if(metric->which_value != LONG_TAG) return false;
+        return visitor((uint64_t)metric->value.long_value);
+      case METRIC_DATA_TYPE_FLOAT:
+        if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag) return false;
+        return visitor(metric->value.float_value);
+      case METRIC_DATA_TYPE_DOUBLE:
+        if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_double_value_tag) return false;
+        return visitor(metric->value.double_value);
+      case METRIC_DATA_TYPE_BOOLEAN:
+        if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag) return false;
+        return visitor(metric->value.boolean_value);
+      case METRIC_DATA_TYPE_STRING:
+      case METRIC_DATA_TYPE_TEXT:
+      case METRIC_DATA_TYPE_UUID:
+        if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag) return false;
+        return visitor((const char*)metric->value.string_value);
+      case METRIC_DATA_TYPE_BYTES:
+      case METRIC_DATA_TYPE_FILE:
+        if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag) return false;
+        return visitor((const pb_bytes_array_t*)metric->value.bytes_value);
+      case METRIC_DATA_TYPE_DATASET:
+        if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag) return false;
+        return visitor((const org_eclipse_tahu_protobuf_Payload_DataSet*)&metric->value.dataset_value);
+      case METRIC_DATA_TYPE_TEMPLATE:
+        if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_template_value_tag) return false;
+        return visitor((const org_eclipse_tahu_protobuf_Payload_Template*)&metric->value.template_value);
+      default:
+        return false;
+    }
+  }
+
+  /*
+  @brief datatype assumed for a metric that has none
+  @param which_value value field of the metric
+  @return METRIC_DATA_TYPE_*, METRIC_DATA_TYPE_UNKNOWN for extensions
+  */
+  static uint32_t value_datatype(pb_size_t which_value);
+private:
+  const pb_allocator_t* allocator; // user allocator, NULL for realloc/free
+  pb_allocator_t tracking_allocator; // counts, then forwards to allocator
+  bool tracking; // track_allocations() setting
+  bool payload_tracked; // payload was decoded with tracking enabled
+  sparkplugb_arduino_alloc_stats stats;
+  sparkplugb_arduino_decode_limits limits;
+  uint32_t scan_metrics; // metrics seen by check_limits
+  uint32_t scan_cells; // DataSet cells seen by check_limits
+  const char* error; // reason the last decode failed
+  bool fill_timestamps; // set_fill_metric_timestamps() setting
+  unsigned decode_threads; // set_decode_threads() setting
+
+  const pb_allocator_t* active_allocator(bool tracked);
+  void* raw_realloc(void* ptr, size_t size);
+  void raw_free(void* ptr);
+  static void* tracked_realloc(void* ctx, void* ptr, size_t size);
+  static void tracked_free(void* ctx, void* ptr);
+  bool check_limits(pb_istream_t* stream, const pb_msgdesc_t* fields, int depth);
+  bool decode_parallel(const pb_byte_t* binary_payload, size_t binary_payloadlen, bool* handled);
+};
+
+/*
+@brief Typed cell readers for sparkplugb_arduino_dataset_reader
+
+Each reads one DataSet value as the C++ type of its column; which_value is
+the value field the column type is stored in.
+*/
+#define SPARKPLUGB_DATASET_CELL(name, type, field) \
+  struct sparkplugb_arduino_cell_##name{ \
+    static const pb_size_t which_value = \
+      org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_##field##_tag; \
+    static type get(const org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue* cell){ \
+      return (type)cell->value.field; \
+    } \
+  };
+SPARKPLUGB_DATASET_CELL(int8, int8_t, int_value)
+SPARKPLUGB_DATASET_CELL(int16, int16_t, int_value)
+SPARKPLUGB_DATASET_CELL(int32, int32_t, int_value)
+SPARKPLUGB_DATASET_CELL(int64, int64_t, long_value)
+SPARKPLUGB_DATASET_CELL(uint8, uint8_t, int_value)
+SPARKPLUGB_DATASET_CELL(uint16, uint16_t, int_value)
+SPARKPLUGB_DATASET_CELL(uint32, uint32_t, int_value)
+SPARKPLUGB_DATASET_CELL(uint32_long, uint32_t, long_value)
+SPARKPLUGB_DATASET_CELL(uint64, uint64_t, long_value)
+SPARKPLUGB_DATASET_CELL(float, float, float_value)
+SPARKPLUGB_DATASET_CELL(double, double, double_value)
+SPARKPLUGB_DATASET_CELL(bool, bool, boolean_value)
+SPARKPLUGB_DATASET_CELL(string, const char*, string_value)
+#undef SPARKPLUGB_DATASET_CELL
+
+/*
+@brief Column-at-a-time access to a decoded DataSet
+
+The type of a column is resolved once per call, after which the loop over
+its rows reads one union member without a switch per cell:
+
+  sparkplugb_arduino_dataset_reader table;
+  int32_t data[250];
+  if(table.set_dataset(&metric->value.dataset_value))
+    n = table.read_column(0, data, 0, 250);
+
+Values are read as the column type (INT8/INT16 sign extended, UINT32 from
+long_value or int_value) and converted like sparkplugb_arduino_decoder::get().
+Strings point into the decoded payload.
+*/
+class sparkplugb_arduino_dataset_reader{
+public:
+  sparkplugb_arduino_dataset_reader(); // constructor
+
+  /*
+  @brief check the shape of a DataSet and select it for reading
+  @param dataset decoded DataSet, referenced not copied
+  @return false if a column has no type or a row has too few values
+  */
+  bool set_dataset(const org_eclipse_tahu_protobuf_Payload_DataSet* dataset);
+
+  uint32_t columns(){ return this->column_count; }
+  uint32_t rows(){ return this->row_count; }
+
+  /*
+  @brief DATA_SET_DATA_TYPE_* of a column, DATA_SET_DATA_TYPE_UNKNOWN if out of range
+  */
+  uint32_t type(uint32_t column);
+
+  /*
+  @brief name of a column, NULL if it has none
+  */
+  const char* column_name(uint32_t column);
+
+  /*
+  @brief read one value, e.g. get(row, column, &value)
+  @return false if out of range, or the value does not fit the column type or T
+  */
+  template<typename T>
+  bool get(uint32_t row, uint32_t column, T* value){
+    if(row >= this->row_count) return false;
+    copy_visitor<T> copy(value);
+    return this->visit_cells(column, row, 1, copy);
+  }
+
+  /*
+  @brief copy a range of a column into an array
+  @param column column index
+  @param out array of at least count elements
+  @param first_row first row to copy
+  @param count number of rows to copy, clipped to the rows available
+  @return number of values copied, or (size_t)-1 if the column does not
+    convert to T or a value is stored in the wrong field
+
+  The copy loop has no data dependent branches; a bad value is only
+  detected at the end, so out may be partly written on failure.
+  */
+  template<typename T>
+  size_t read_column(uint32_t column, T* out, uint32_t first_row, uint32_t count){
+    if(first_row >= this->row_count) return 0;
+    if(count > this->row_count - first_row) count = this->row_count - first_row;
+    switch(this->cell_kind(column)){
+      case DATA_SET_DATA_TYPE_INT8: return this->copy_cells<sparkplugb_arduino_cell_int8>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_INT16: return this->copy_cells<sparkplugb_arduino_cell_int16>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_INT32: return this->copy_cells<sparkplugb_arduino_cell_int32>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_INT64: return this->copy_cells<sparkplugb_arduino_cell_int64>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_UINT8: return this->copy_cells<sparkplugb_arduino_cell_uint8>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_UINT16: return this->copy_cells<sparkplugb_arduino_cell_uint16>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_UINT32: return this->copy_cells<sparkplugb_arduino_cell_uint32>(column, out, first_row, count);
+      case CELL_UINT32_LONG: return this->copy_cells<sparkplugb_arduino_cell_uint32_long>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_UINT64: return this->copy_cells<sparkplugb_arduino_cell_uint64>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_FLOAT: return this->copy_cells<sparkplugb_arduino_cell_float>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_DOUBLE: return this->copy_cells<sparkplugb_arduino_cell_double>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_BOOLEAN: return this->copy_cells<sparkplugb_arduino_cell_bool>(column, out, first_row, count);
+      case DATA_SET_DATA_TYPE_STRING: return this->copy_cells<sparkplugb_arduino_cell_string>(column, out, first_row, count);
+      default: return (size_t)-1;
+    }
+  }
+
+  /*
+  @brief call visitor(row, value) for each row of a column
+  @param column column index
+  @param visitor object with a bool operator()(uint32_t row, value) for the
+    column's C++ type, see sparkplugb_arduino_decoder::visit_value(); a
+    template operator() can stand in for all of them
+  @return false if the column is out of range, a value is stored in the
+    wrong field, or the visitor returned false (which stops the walk)
+  */
+  template<typename V>
+  bool visit_column(uint32_t column, V& visitor){
+    return this->visit_cells(column, 0, this->row_count, visitor);
+  }
+
+  /*
+  @brief convert a range of a number or boolean column into a dense array
+  @return number of values converted, or (size_t)-1 as read_column()
+
+  Shorthands for read_column() into the usual analytics types.
+  */
+  size_t column_to_f64(uint32_t column, double* out, uint32_t first_row, uint32_t count){
+    return this->read_column(column, out, first_row, count);
+  }
+  size_t column_to_f32(uint32_t column, float* out, uint32_t first_row, uint32_t count){
+    return this->read_column(column, out, first_row, count);
+  }
+  size_t column_to_i64(uint32_t column, int64_t* out, uint32_t first_row, uint32_t count){
+    return this->read_column(column, out, first_row, count);
+  }
+
+  /*
+  @brief convert a range of rows of all columns into a column-major matrix
+  @param out array of at least columns() * count elements; column c of the
+    result starts at out + c * (the number of rows converted)
+  @param first_row first row to convert
+  @param count number of rows to convert, clipped to the rows available
+  @return number of rows converted, or (size_t)-1 if a column is not a
+    number or boolean column
+
+  Rows are converted in blocks, all columns of a block at a time, so each
+  row is brought into the cache once rather than once per column.
+  */
+  size_t to_matrix_f64(double* out, uint32_t first_row, uint32_t count);
+private:
+  // cell_kind() value for UINT32 columns stored in long_value
+  static const uint32_t CELL_UINT32_LONG = 0x100;
+
+  const org_eclipse_tahu_protobuf_Payload_DataSet* dataset;
+  uint32_t column_count;
+  uint32_t row_count;
+
+  uint32_t cell_kind(uint32_t column);
+
+  // stores any value convertible to T, see sparkplugb_arduino_value_getter
+  template<typename T>
+  struct copy_visitor{
+    sparkplugb_arduino_value_getter<T> getter;
+    copy_visitor(T* out){ this->getter.out = out; }
+    template<typename U> bool operator()(uint32_t, U value){ return this->getter(value); }
+  };
+
+  template<typename C, typename T>
+  size_t copy_cells(uint32_t column, T* out, uint32_t first_row, uint32_t count){
+    const org_eclipse_tahu_protobuf_Payload_DataSet_Row* rows = this->dataset->rows + first_row;
+    const org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue* cell;
+    sparkplugb_arduino_value_getter<T> getter;
+    bool ok = true;
+    uint32_t i;
+
+    for(i=0; i<count; i++){
+      cell = rows[i].elements + column;
+      getter.out = out + i;
+      ok &= (cell->which_value == C::which_value) & getter(C::get(cell));
+    }
+    return ok ? count : (size_t)-1;
+  }
+
+  template<typename C, typename V>
+  bool visit_typed(uint32_t column, uint32_t first_row, uint32_t count, V& visitor){
+    const org_eclipse_tahu_protobuf_Payload_DataSet_Row* rows = this->dataset->rows;
+    const org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue* cell;
+    uint32_t r;
+
+    for(r=first_row; r<first_row+count; r++){
+      cell = rows[r].elements + column;
+      if(cell->which_value != C::which_value) return false;
+      if(!visitor(r, C::get(cell))) return false;
+    }
+    return true;
+  }
+
+  template<typename V>
+  bool visit_cells(uint32_t column, uint32_t first_row, uint32_t count, V& visitor){
+    switch(this->cell_kind(column)){
+      case DATA_SET_DATA_TYPE_INT8: return this->visit_typed<sparkplugb_arduino_cell_int8>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_INT16: return this->visit_typed<sparkplugb_arduino_cell_int16>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_INT32: return this->visit_typed<sparkplugb_arduino_cell_int32>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_INT64: return this->visit_typed<sparkplugb_arduino_cell_int64>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_UINT8: return this->visit_typed<sparkplugb_arduino_cell_uint8>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_UINT16: return this->visit_typed<sparkplugb_arduino_cell_uint16>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_UINT32: return this->visit_typed<sparkplugb_arduino_cell_uint32>(column, first_row, count, visitor);
+      case CELL_UINT32_LONG: return this->visit_typed<sparkplugb_arduino_cell_uint32_long>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_UINT64: return this->visit_typed<sparkplugb_arduino_cell_uint64>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_FLOAT: return this->visit_typed<sparkplugb_arduino_cell_float>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_DOUBLE: return this->visit_typed<sparkplugb_arduino_cell_double>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_BOOLEAN: return this->visit_typed<sparkplugb_arduino_cell_bool>(column, first_row, count, visitor);
+      case DATA_SET_DATA_TYPE_STRING: return this->visit_typed<sparkplugb_arduino_cell_string>(column, first_row, count, visitor);
+      default: return false;
+    }
+  }
+};
+
+/*
+@brief Fixed-capacity memory for sparkplugb_arduino_static_decoder
+
+Hands out memory to nanopb from caller-provided arrays instead of the heap.
+Metric, DataSet row and DataSet value arrays get a pool of their own, so that
+they grow in place as nanopb adds entries; strings and all other data share a
+byte pool. Memory is only given back all at once by reset().
+
+Each block of the byte pool takes 8 bytes more than asked for (its size and
+alignment). An array there that has to move to grow, e.g. DataSet columns or
+property keys, gets twice its old room, so byte pool use stays linear in the
+payload size: at most about 4 times the final size of each such array.
+*/
+class sparkplugb_arduino_pool{
+public:
+  // allocator to install with pb_set_allocator()
+  pb_allocator_t allocator;
+
+  sparkplugb_arduino_pool(); // constructor
+
+  /*
+  @brief assign the backing storage of each pool
+  */
+  void init(org_eclipse_tahu_protobuf_Payload_Metric* metrics, size_t metrics_count,
+            org_eclipse_tahu_protobuf_Payload_DataSet_Row* rows, size_t rows_count,
+            org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue* cells, size_t cells_count,
+            uint8_t* bytes, size_t bytes_count);
+
+  /*
+  @brief release everything handed out so far
+  */
+  void reset();
+
+  /*
+  @brief which pool ran out during the last allocation failure
+  @return error message, or NULL if no allocation failed since reset()
+  */
+  const char* get_error();
+
+  /*
+  @brief bytes of the byte pool handed out since reset(), headers and
+  abandoned blocks included
+  */
+  size_t bytes_used();
+private:
+  struct region{
+    uint8_t* base;
+    size_t capacity; // bytes
+    size_t used; // bytes handed out, including abandoned blocks
+    size_t last; // offset of the most recent block
+    const char* error; // message used when this region runs out
+  };
+  region metrics;
+  region rows;
+  region cells;
+  region bytes;
+  const char* error;
+
+  region* region_of(void* ptr);
+  void* region_realloc(region* r, void* ptr, size_t size);
+  void* bytes_realloc(void* ptr, size_t size);
+  static void* pool_realloc(void* ctx, void* ptr, size_t size);
+  static void* pool_field_realloc(void* ctx, void* ptr, size_t size, const pb_field_iter_t* field);
+  static void pool_free(void* ctx, void* ptr);
+};
+
+/*
+@brief Decoder that never uses the heap
+
+Decodes into fixed-capacity pools sized by the template parameters:
+METRICS metrics (including template members), ROWS DataSet rows, CELLS DataSet
+values and POOL_BYTES bytes for strings and all other variable length data.
+decode() fails with an error from get_error() when a pool overflows; it
+never calls malloc. Memory is reclaimed by free_payload() or the next decode().
+
+Declare instances statically or globally, the pools are stored in the object.
+*/
+template<size_t METRICS, size_t ROWS, size_t CELLS, size_t POOL_BYTES>
+class sparkplugb_arduino_static_decoder : public sparkplugb_arduino_decoder{
+public:
+  sparkplugb_arduino_static_decoder(){
+    this->pool.init(this->metric_storage, METRICS, this->row_storage, ROWS,
+                    this->cell_storage, CELLS, this->byte_storage, POOL_BYTES);
+    this->set_allocator(&this->pool.allocator);
+  }
+
+  /*
+  @brief perform a decode into the static pools
+  @param binary_payload inbound encoded binary data
+  @param binary_payloadlen size of the binary payload data
+
+  Any previously decoded payload is released first.
+  */
+  bool decode(const pb_byte_t *binary_payload, size_t binary_payloadlen){
+    this->free_payload();
+    return sparkplugb_arduino_decoder::decode(binary_payload, binary_payloadlen);
+  }
+
+  /*
+  @brief release the payload and empty the pools
+  */
+  void free_payload(){
+    sparkplugb_arduino_decoder::free_payload();
+    this->pool.reset();
+  }
+
+  /*
+  @brief reason the last decode failed
+  @return error message, or NULL if the last decode succeeded
+  */
+  const char* get_error(){
+    if(this->pool.get_error() != NULL) return this->pool.get_error();
+    return sparkplugb_arduino_decoder::get_error();
+  }
 private:
+  sparkplugb_arduino_pool pool;
+  // zero-length arrays are not allowed, keep at least one entry
+  org_eclipse_tahu_protobuf_Payload_Metric metric_storage[METRICS > 0 ? METRICS : 1];
+  org_eclipse_tahu_protobuf_Payload_DataSet_Row row_storage[ROWS > 0 ? ROWS : 1];
+  org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue cell_storage[CELLS > 0 ? CELLS : 1];
+  union{
+    uint8_t byte_storage[POOL_BYTES > 0 ? POOL_BYTES : 1];
+    uint64_t byte_storage_align; // align the byte pool for any data type
+  };
+};
+
+// flags of sparkplugb_arduino_history_sample
+#define SPARKPLUGB_HISTORY_ALIAS 0x01 // id is the metric alias
+#define SPARKPLUGB_HISTORY_NAME 0x02 // id indexes the metric name table
+#define SPARKPLUGB_HISTORY_NULL 0x04 // metric value is null
+
+/*
+@brief One buffered metric sample, see sparkplugb_arduino_history
+*/
+struct sparkplugb_arduino_history_sample{
+  uint64_t timestamp; // metric timestamp, ms since epoch
+  uint64_t value; // raw bits of the int/long/float/double/boolean value
+  uint32_t id; // alias, or index into the metric name table
+  uint8_t datatype; // METRIC_DATA_TYPE_*, 0 if the metric had none
+  uint8_t which_value; // org_eclipse_tahu_protobuf_Payload_Metric_*_value_tag
+  uint8_t flags; // SPARKPLUGB_HISTORY_* flags
+  uint8_t reserved;
+};
+
+/*
+@brief Store-and-forward buffer for metrics recorded while offline
+
+Queues timestamped scalar metric samples in a ring buffer, either in RAM or
+(on Linux and other POSIX hosts) in a memory-mapped file that survives a
+restart. After reconnecting, encode_batch() packs as many queued samples as
+fit in the byte budget into one DDATA payload with is_historical set; once
+that payload is published, consume() drops those samples from the queue.
+When the buffer is full the oldest samples are overwritten.
+
+Only int, long, float, double and boolean values are buffered. A metric is
+identified by its alias, or by its position in the table given to
+set_metric_names().
+*/
+class sparkplugb_arduino_history{
+public:
+  sparkplugb_arduino_history(); // constructor
+  ~sparkplugb_arduino_history(); // destructor, closes the file if open
+
+  /*
+  @brief keep the queue in RAM
+  @param samples array to use for the ring buffer
+  @param count length of the array
+  */
+  void begin(sparkplugb_arduino_history_sample* samples, uint32_t count);
+
+  /*
+  @brief keep the queue in a memory-mapped file (POSIX hosts only)
+  @param path file to use, created if needed
+  @param count number of samples the file holds
+  @return true on success
+
+  Samples already in the file are kept if it was created with the same count.
+  */
+  bool open(const char* path, uint32_t count);
+
+  /*
+  @brief release the ring buffer, unmapping the file if one is open
+  */
+  void close();
+
+  /*
+  @brief flush a memory-mapped queue to disk
+  */
+  void sync();
+
+  /*
+  @brief names used for metrics that do not have an alias
+  @param names array of metric names, which must stay valid
+  @param count length of the array
+  */
+  void set_metric_names(const char* const* names, uint32_t count);
+
+  /*
+  @brief leave out sample timestamps that equal the batch timestamp
+  @param enable true to omit them, see encoder.set_omit_metric_timestamps()
+  */
+  void set_omit_metric_timestamps(bool enable);
+
+  /*
+  @brief largest payload encode_batch() will produce, 0 for no limit
+  @param bytes byte budget for each batch
+  */
+  void set_batch_budget(size_t bytes);
+
+  /*
+  @brief queue one metric
+  @param metric metric to store, needs an alias or a name from the name table
+  @param timestamp used if the metric has no timestamp of its own
+  @return false if the metric can not be buffered
+  */
+  bool store(const org_eclipse_tahu_protobuf_Payload_Metric* metric, uint64_t timestamp);
+
+  /*
+  @brief queue every metric of a payload
+  @param payload payload to store, e.g. one that could not be published
+  @return number of metrics that were queued
+  */
+  uint32_t store(const org_eclipse_tahu_protobuf_Payload* payload);
+
+  /*
+  @brief encode the oldest queued samples as one historical payload
+  @param buffer buffer to store encoded binary data
+  @param buffer_length size of the buffer
+  @param timestamp payload timestamp
+  @param seq payload sequence number
+  @return message length, 0 if the queue is empty or -1 on failure
+
+  The samples stay queued until consume() is called, so a failed publish
+  can simply be retried. The payload stays within the batch budget, except
+  that an oldest sample too large for it is sent alone if it fits in the
+  buffer. Samples that can not be rebuilt as a metric or that do not fit in
+  the buffer on their own are left out and dropped by consume(), so they
+  never block the queue.
+  */
+  size_t encode_batch(uint8_t* buffer, size_t buffer_length,
+                      uint64_t timestamp, uint64_t seq);
+
+  /*
+  @brief drop the samples of the last encode_batch() from the queue
+  */
+  void consume();
+
+  /*
+  @brief number of queued samples
+  */
+  uint32_t available();
+
+  /*
+  @brief number of samples overwritten because the buffer was full
+  */
+  uint32_t dropped();
+private:
+  // ring buffer header, stored at the start of the file when memory-mapped
+  struct ring_header{
+    uint32_t magic;
+    uint32_t sample_size;
+    uint32_t capacity;
+    uint32_t dropped;
+    uint64_t head; // samples ever stored
+    uint64_t tail; // samples ever consumed or overwritten
+  };
+  ring_header local_header; // header used for a RAM queue
+  ring_header* header;
+  sparkplugb_arduino_history_sample* samples;
+  void* map; // mapped file, NULL for a RAM queue
+  size_t map_length;
+  const char* const* names;
+  uint32_t names_count;
+  size_t budget;
+  bool omit_timestamps;
+  uint64_t batch_end; // tail after the last encoded batch is consumed
+
+  bool sample_metric(const sparkplugb_arduino_history_sample* sample,
+                     org_eclipse_tahu_protobuf_Payload_Metric* metric);
+};
+
+/*
+@brief Coalesces metric updates of one device into batched DATA messages
+
+A gateway that bridges many local sources would otherwise publish one DDATA
+per source update. The aggregator collects the updates of a window, closed
+after a number of updates or an age (set_window()), and encode() turns them
+into one payload through a sparkplugb_arduino_encoder. By default only the
+latest value of each metric is kept; with set_keep_history(true) every
+update is sent, in the order received.
+
+Like sparkplugb_arduino_history, only int, long, float, double and boolean
+values are kept, a metric is identified by its alias or by its position in
+the set_metric_names() table, and the updates of a batch stay pending until
+consume() confirms it was published. Not thread-safe: a gateway feeding it
+from several threads must serialize the calls.
+*/
+class sparkplugb_arduino_aggregator{
+public:
+  sparkplugb_arduino_aggregator(); // constructor
+
+  /*
+  @brief assign the storage for pending updates
+  @param samples storage, cleared by this call; keep it about twice the
+  number of metrics, or the most updates a window collects with history kept
+  @param count length of the array
+  */
+  void begin(sparkplugb_arduino_history_sample* samples, uint32_t count);
+
+  /*
+  @brief names used for metrics that do not have an alias
+  @param names array of metric names, which must stay valid
+  @param count length of the array
+  */
+  void set_metric_names(const char* const* names, uint32_t count);
+
+  /*
+  @brief when a window closes, see due()
+  @param updates close after this many updates, 0 for no limit
+  @param age_ms close this long after the first update, 0 for no limit
+  */
+  void set_window(uint32_t updates, uint64_t age_ms);
+
+  /*
+  @brief send every update instead of the latest per metric
+  @param enable true to keep every update; drops the pending updates
+  */
+  void set_keep_history(bool enable);
+
+  /*
+  @brief add one metric update
+  @param metric metric to add, needs an alias or a name from the name table
+  @param timestamp used if the metric has no timestamp of its own
+  @return false if the metric can not be kept, or the storage is full
+  */
+  bool update(const org_eclipse_tahu_protobuf_Payload_Metric* metric, uint64_t timestamp);
+
+  /*
+  @brief add one metric update by alias, e.g. update<float>(3, 21.5f, now)
+  */
+  template<typename T>
+  bool update(uint64_t alias, T value, uint64_t timestamp){
+    org_eclipse_tahu_protobuf_Payload_Metric metric = org_eclipse_tahu_protobuf_Payload_Metric_init_zero;
+    metric.has_alias = true;
+    metric.alias = alias;
+    metric.which_value = sparkplugb_arduino_metric_type<T>::which_value;
+    sparkplugb_arduino_metric_type<T>::set(&metric, value);
+    return this->update(&metric, timestamp);
+  }
+
+  /*
+  @brief add every metric of a payload
+  @return number of metrics added
+  */
+  uint32_t update(const org_eclipse_tahu_protobuf_Payload* payload);
+
+  /*
+  @brief true if the window is closed and a batch should be sent
+  @param now current time, ms, same clock as the update timestamps
+  */
+  bool due(uint64_t now);
+
+  /*
+  @brief encode the pending updates as one payload
+  @param encoder encoder with a payload and a metric pool set, see
+  encoder.set_metric_pool(); its metrics are replaced
+  @param buffer buffer to store encoded binary data
+  @param buffer_length size of the buffer
+  @param timestamp payload timestamp
+  @param seq payload sequence number
+  @return message length, 0 if nothing is pending or -1 on failure
+
+  A batch holds at most as many updates as the metric pool; the rest wait
+  for the next one. The updates stay pending until consume() is called.
+  */
+  size_t encode(sparkplugb_arduino_encoder* encoder, uint8_t* buffer, size_t buffer_length,
+                uint64_t timestamp, uint64_t seq);
+
+  /*
+  @brief drop the updates of the last encode(), once it was published
+  */
+  void consume();
+
+  /*
+  @brief number of pending updates
+  */
+  uint32_t pending();
+private:
+  sparkplugb_arduino_history_sample* samples;
+  uint32_t count;
+  const char* const* names;
+  uint32_t names_count;
+  uint32_t max_updates;
+  uint64_t max_age;
+  bool keep_history;
+  uint32_t used; // history: updates stored, latest: metrics pending or in the batch
+  uint32_t updates; // updates since the window opened
+  uint64_t window_start; // timestamp of the first update of the window
+  uint32_t batch_end; // history: updates in the last encode()
+
+  int32_t slot(const sparkplugb_arduino_history_sample* sample);
+};
+
+// Sparkplug message types, see sparkplugb_arduino_session::message_type()
+#define SPARKPLUGB_MSG_UNKNOWN 0
+#define SPARKPLUGB_MSG_NBIRTH 1
+#define SPARKPLUGB_MSG_NDEATH 2
+#define SPARKPLUGB_MSG_DBIRTH 3
+#define SPARKPLUGB_MSG_DDEATH 4
+#define SPARKPLUGB_MSG_NDATA 5
+#define SPARKPLUGB_MSG_DDATA 6
+#define SPARKPLUGB_MSG_NCMD 7
+#define SPARKPLUGB_MSG_DCMD 8
+#define SPARKPLUGB_MSG_STATE 9
+
+// flags of sparkplugb_arduino_node_state
+#define SPARKPLUGB_NODE_ONLINE 0x01 // NBIRTH seen, no NDEATH since
+#define SPARKPLUGB_NODE_REBIRTH 0x02 // state lost, a rebirth should be requested
+
+/*
+@brief Result of checking an inbound message against the node's session
+*/
+enum sparkplugb_arduino_seq_status{
+  SPARKPLUGB_SEQ_OK = 0, // in sequence
+  SPARKPLUGB_SEQ_GAP, // messages were lost, expected seq skipped ahead
+  SPARKPLUGB_SEQ_REORDERED, // older than expected, duplicate or late message
+  SPARKPLUGB_SEQ_NO_BIRTH, // data from a node that is not online
+  SPARKPLUGB_SEQ_STALE_DEATH, // NDEATH of an earlier session (bdSeq mismatch)
+  SPARKPLUGB_SEQ_INVALID, // not a Sparkplug topic, or the node table is full
+};
+
+/*
+@brief Session state of one edge node, 16 bytes
+*/
+struct sparkplugb_arduino_node_state{
+  uint64_t key; // hash of "group/edge node", 0 for a free slot
+  uint8_t seq; // publisher: next seq to send, subscriber: next seq expected
+  uint8_t bdseq; // publisher: next bdSeq, subscriber: bdSeq of the session
+  uint8_t flags; // SPARKPLUGB_NODE_* flags, subscriber only
+  uint8_t reserved;
+  uint32_t errors; // gaps and reorderings seen
+};
+
+/*
+@brief Per edge node seq and bdSeq tracking
+
+Keeps the session of many edge nodes in a caller-provided table, found by
+group and edge node id in O(1) through open addressing on a 64-bit hash.
+
+Publisher side (a node or gateway): next_seq() and next_bdseq() hand out the
+numbers for one node with atomic increments, so they may be called from
+several threads.
+
+Subscriber side (a host application): check() validates every inbound
+message of a node against the expected seq and reports gaps, reorderings and
+data without a birth; rebirth_needed() then says to send a rebirth request.
+The subscriber side is not thread-safe.
+*/
+class sparkplugb_arduino_session{
+public:
+  sparkplugb_arduino_session(); // constructor
+
+  /*
+  @brief assign the node table
+  @param nodes table storage, cleared by this call
+  @param count table size, keep it about twice the number of nodes
+  */
+  void begin(sparkplugb_arduino_node_state* nodes, uint32_t count);
+
+  /*
+  @brief find or add a node
+  @param group group id
+  @param edge_node edge node id
+  @return node index, or -1 if the table is full
+
+  Adding nodes is not thread-safe; a publisher should add its nodes before
+  other threads call next_seq().
+  */
+  int32_t node(const char* group, const char* edge_node);
+
+  /*
+  @brief find or add the node a Sparkplug topic belongs to
+  @param topic "spBv1.0/group/type/edge_node[/device]"
+  @param type set to the SPARKPLUGB_MSG_* message type if not NULL
+  @return node index, or -1 if the topic is not valid or the table is full
+  */
+  int32_t node(const char* topic, uint8_t* type);
+
+  /*
+  @brief publisher: seq for the next message of a node
+  */
+  uint8_t next_seq(int32_t node);
+
+  /*
+  @brief publisher: start a new session, the next seq will be 0 (NBIRTH)
+  @return bdSeq of the new session, for the NDEATH will and the NBIRTH
+  */
+  uint8_t next_bdseq(int32_t node);
+
+  /*
+  @brief subscriber: validate an inbound message
+  @param node node index
+  @param type SPARKPLUGB_MSG_* message type
+  @param seq payload seq (ignored for NDEATH)
+  @param bdseq bdSeq metric of an NBIRTH or NDEATH (ignored for others)
+  */
+  sparkplugb_arduino_seq_status check(int32_t node, uint8_t type, uint8_t seq, uint8_t bdseq);
+
+  /*
+  @brief subscriber: validate an inbound message given its topic and payload
+  */
+  sparkplugb_arduino_seq_status check(const char* topic, const org_eclipse_tahu_protobuf_Payload* payload);
+
+  /*
+  @brief subscriber: true if the node's state was lost since its last birth
+  */
+  bool rebirth_needed(int32_t node);
+
+  /*
+  @brief get the state of a node, NULL if the index is not valid
+  */
+  const sparkplugb_arduino_node_state* state(int32_t node);
+
+  /*
+  @brief message type of a Sparkplug topic type field, e.g. "NDATA"
+  */
+  static uint8_t message_type(const char* type, size_t length);
+private:
+  sparkplugb_arduino_node_state* nodes;
+  uint32_t count;
+
+  int32_t lookup(uint64_t key);
+};
+
+// Sparkplug quality codes, from the "Quality" metric property
+#define SPARKPLUGB_QUALITY_BAD 0
+#define SPARKPLUGB_QUALITY_GOOD 192
+#define SPARKPLUGB_QUALITY_STALE 500
+
+// sparkplugb_arduino_metric_value flags
+#define SPARKPLUGB_METRIC_NULL 0x01 // the last value was null
+
+// key bit of metrics that have no alias, see metric_table.name_key()
+#define SPARKPLUGB_METRIC_NAME_KEY 0x8000000000000000ULL
+
+// bytes of storage for a metric table of count metrics
+#define SPARKPLUGB_METRIC_TABLE_BYTES(count) ((size_t)(count) * 36)
+
+/*
+@brief Last value of one metric, as read from sparkplugb_arduino_metric_table
+*/
+struct sparkplugb_arduino_metric_value{
+  uint64_t key; // alias, or name_key() for a metric without one
+  uint64_t value; // int64_t/uint64_t for integers, double bits for FLOAT and
+                  // DOUBLE, 0 or 1 for BOOLEAN
+  uint64_t timestamp; // metric timestamp, else that of its payload
+  uint16_t quality; // SPARKPLUGB_QUALITY_*
+  uint8_t datatype; // METRIC_DATA_TYPE_* from the BIRTH
+  uint8_t flags; // SPARKPLUGB_METRIC_* flags
+};
+
+/*
+@brief Current value of every metric of one node or device, for hosts
+
+apply() feeds the table the payloads of one node or device: a BIRTH defines
+the metrics and their datatypes, DATA messages update them in place (found by
+alias, or by name for metrics without one) and a DEATH marks them all stale.
+Numbers, booleans and DATETIMEs are kept; other datatypes only get their
+timestamp and quality updated. Nothing is allocated: the table lives in
+caller storage, as arrays of keys, values, timestamps, qualities and
+datatypes indexed through open addressing.
+
+One thread applies payloads, any number of threads read. Every apply() is
+one seqlock write section, so readers never block the writer and always see
+a table between two payloads; a read that overlaps an apply() is retried.
+*/
+class sparkplugb_arduino_metric_table{
+public:
+  sparkplugb_arduino_metric_table(); // constructor
+
+  /*
+  @brief assign the table storage
+  @param storage 8-byte aligned storage, cleared by this call
+  @param size storage bytes, SPARKPLUGB_METRIC_TABLE_BYTES(count) for count
+  metrics; keep count about twice the number of metrics
+  */
+  void begin(void* storage, size_t size);
+
+  /*
+  @brief writer: apply a payload of the node or device
+  @param type SPARKPLUGB_MSG_* type of the message, e.g. from session.node()
+  @param payload decoded payload
+  @return false if a DATA metric is not in the BIRTH, or a BIRTH does not
+  fit; the host should then request a rebirth
+  */
+  bool apply(uint8_t type, const org_eclipse_tahu_protobuf_Payload* payload);
+
+  /*
+  @brief read the last value of a metric
+  @param alias metric alias
+  @param value set to the metric's value and state
+  @return false if the metric is not in the table
+  */
+  bool read(uint64_t alias, sparkplugb_arduino_metric_value* value);
+
+  /*
+  @brief read the last value of a metric by name, see read(alias, value)
+  */
+  bool read(const char* name, sparkplugb_arduino_metric_value* value);
+
+  /*
+  @brief read a metric as a number, e.g. get("temp", &temp)
+  @param key metric name or alias
+  @param value set to the value, converted as by a C++ cast
+  @return false if the metric is missing, null or not a number
+  */
+  template<typename K, typename T>
+  bool get(K key, T* value){
+    sparkplugb_arduino_metric_value metric;
+    if(!this->read(key, &metric)) return false;
+    return value_as(&metric, value);
+  }
+
+  /*
+  @brief copy every metric, consistent as of a single payload
+  @param values array of at least size() entries
+  @return number of metrics copied
+  */
+  uint32_t snapshot(sparkplugb_arduino_metric_value* values);
+
+  /*
+  @brief number of table slots, the most metrics the table holds
+  */
+  uint32_t size();
+
+  /*
+  @brief changes on every apply(), readers can poll it for updates
+  */
+  uint32_t version();
+
+  /*
+  @brief key under which a metric without an alias is kept
+  */
+  static uint64_t name_key(const char* name);
+
+  /*
+  @brief convert a value read from the table, see get()
+  */
+  template<typename T>
+  static bool value_as(const sparkplugb_arduino_metric_value* metric, T* value){
+    double real;
+
+    if(metric->flags & SPARKPLUGB_METRIC_NULL) return false;
+    switch(metric->datatype){
+      case METRIC_DATA_TYPE_INT8:
+      case METRIC_DATA_TYPE_INT16:
+      case METRIC_DATA_TYPE_INT32:
+      case METRIC_DATA_TYPE_INT64:
+        *value = (T)(int64_t)metric->value;
+        return true;
+      case METRIC_DATA_TYPE_UINT8:
+      case METRIC_DATA_TYPE_UINT16:
+      case METRIC_DATA_TYPE_UINT32:
+      case METRIC_DATA_TYPE_UINT64:
+      case METRIC_DATA_TYPE_DATETIME:
+        *value = (T)metric->value;
+        return true;
+      case METRIC_DATA_TYPE_FLOAT:
+      case METRIC_DATA_TYPE_DOUBLE:
+        memcpy(&real, &metric->value, sizeof(real));
+        *value = (T)real;
+        return true;
+      case METRIC_DATA_TYPE_BOOLEAN:
+        *value = (T)(metric->value != 0);
+        return true;
+      default:
+        return false;
+    }
+  }
+private:
+  uint32_t count;
+  uint32_t sequence; // seqlock, odd while apply() writes
+  uint64_t* keys; // 0 for a free slot, else key + 1
+  uint64_t* names; // name_key() of each metric, 0 if it has no name
+  uint64_t* values;
+  uint64_t* timestamps;
+  uint16_t* quality;
+  uint8_t* datatypes;
+  uint8_t* flags;
+
+  int32_t slot(uint64_t key, bool add);
+  int32_t slot(const org_eclipse_tahu_protobuf_Payload_Metric* metric);
+  int32_t slot_by_name(uint64_t name);
+  void store(int32_t slot, const org_eclipse_tahu_protobuf_Payload_Metric* metric, uint64_t timestamp);
+  void copy(int32_t slot, sparkplugb_arduino_metric_value* value);
+};
+
+// clock read by sparkplugb_arduino_clock, returns ms
+typedef uint64_t (*sparkplugb_arduino_clock_source)(void* ctx);
+
+/*
+@brief Millisecond clock for metric and payload timestamps
+
+By default it counts millis() on Arduino and reads CLOCK_REALTIME_COARSE on
+Linux; set_source() plugs in any other clock, e.g. an RTC. set_epoch() turns
+the count into Unix time once the real time is known (from NTP, GPS, ...).
+
+In cached mode now() returns the time of the last refresh() instead of
+reading the clock, so stamping a batch costs a single clock read; stamp()
+does exactly that for a whole payload.
+*/
+class sparkplugb_arduino_clock{
+public:
+  sparkplugb_arduino_clock(); // constructor
+
+  /*
+  @brief use another clock
+  @param source function returning ms, or NULL for the default clock
+  @param ctx passed to source
+  */
+  void set_source(sparkplugb_arduino_clock_source source, void* ctx);
+
+  /*
+  @brief set the current time, the clock then counts on from it
+  @param now_ms current time, ms since Jan 1, 1970 UTC
+  */
+  void set_epoch(uint64_t now_ms);
+
+  /*
+  @brief enable or disable cached mode
+  */
+  void set_cached(bool enable);
+
+  /*
+  @brief read the clock into the cache
+  @return the current time
+  */
+  uint64_t refresh();
+
+  /*
+  @brief current time, ms since Jan 1, 1970 UTC once set_epoch() was called
+  */
+  uint64_t now();
+
+  /*
+  @brief set the payload timestamp and that of every metric that has one
+  @param payload payload to stamp
+  @return the timestamp used
+
+  The clock is read once, even in uncached mode.
+  */
+  uint64_t stamp(org_eclipse_tahu_protobuf_Payload* payload);
+private:
+  sparkplugb_arduino_clock_source source;
+  void* ctx;
+  uint64_t offset; // added to the source to get Unix time
+  bool cached;
+  uint64_t cached_ms;
+  uint32_t last_millis; // millis() wrap tracking of the default clock
+  uint32_t millis_wraps;
+
+  uint64_t read();
+};
+
+/*
+@brief Lock-free seq and timestamp stamping for one publishing node
+
+stamp() gives each payload the next seq and a timestamp in a single atomic
+step, so that any number of threads can publish for the node without a
+mutex: seq numbers are gap-free, and a later seq never carries an earlier
+timestamp (a clock that steps back is held at the last value handed out).
+
+Threads that stamp concurrently may still finish encoding in a different
+order. To keep the messages in seq order on the wire, call wait_turn() with
+the returned ticket just before publishing and release() right after.
+*/
+class sparkplugb_arduino_sequencer{
+public:
+  sparkplugb_arduino_sequencer(); // constructor
+
+  /*
+  @brief make the next stamp() return seq 0, for the NBIRTH of a new session
+  */
+  void rebirth();
+
+  /*
+  @brief set payload seq and timestamp
+  @param payload payload to stamp
+  @param now current time, ms since epoch
+  @return ticket for wait_turn() and release()
+  */
+  uint32_t stamp(org_eclipse_tahu_protobuf_Payload* payload, uint64_t now);
+
+  /*
+  @brief wait until every payload stamped before this ticket was released
+
+  Spins until then, calling sched_yield() on POSIX hosts and yield() on
+  Arduino so that the thread or task holding the turn can run.
+  */
+  void wait_turn(uint32_t ticket);
+
+  /*
+  @brief mark the payload of this ticket as published
+
+  Every ticket must be released, also when encoding or publishing failed,
+  or later tickets wait forever.
+  */
+  void release(uint32_t ticket);
+private:
+  // [ms since base : 40][seq : 8][ticket : 16], updated with compare-and-swap
+  uint64_t state;
+  uint64_t base; // time of the first stamp, ms since epoch
+  uint16_t released; // next ticket allowed to publish
+};
+
+// byte transport for sparkplugb_arduino_mqtt, both return the number of
+// bytes moved, 0 if the transport would block, or -1 if the connection is lost
+typedef long (*sparkplugb_arduino_mqtt_write)(void* ctx, const uint8_t* data, size_t length);
+typedef long (*sparkplugb_arduino_mqtt_read)(void* ctx, uint8_t* data, size_t length);
+
+// called for every PUBLISH received, topic (not NUL terminated) and payload
+// point into the receive buffer and are only valid during the call
+typedef void (*sparkplugb_arduino_mqtt_callback)(void* ctx, const char* topic, size_t topic_length,
+                                                 const uint8_t* payload, size_t length);
+
+// sparkplugb_arduino_mqtt::state()
+#define SPARKPLUGB_MQTT_DISCONNECTED 0
+#define SPARKPLUGB_MQTT_CONNECTING 1
+#define SPARKPLUGB_MQTT_CONNECTED 2
+
+// time allowed for CONNACK and PINGRESP
+#define SPARKPLUGB_MQTT_TIMEOUT_MS 10000
+
+#ifdef ARDUINO
+class Client; // EthernetClient, WiFiClient, ...
+#endif
+
+/*
+@brief Minimal MQTT 3.1.1 client for publishing Sparkplug payloads
+
+Publishes are QoS 0 and pipelined: they are queued in the transmit buffer
+and written to the transport in one go by flush() or loop(), or when the
+buffer is full. publish(encoder, topic) encodes the payload straight into
+the transmit buffer behind its PUBLISH header, so a message is never copied
+between encoding and the transport. The NDEATH is registered as the last
+will (QoS 1, not retained), and subscriptions for NCMD/DCMD take QoS 0 or 1.
+
+The transport is a pair of functions, see set_transport(); set_client()
+uses an Arduino Client such as EthernetClient, and open() a TCP socket on
+POSIX hosts. Nothing blocks except writing a payload larger than the
+transmit buffer. The client is not thread-safe.
+*/
+class sparkplugb_arduino_mqtt{
+public:
+  sparkplugb_arduino_mqtt(); // constructor
+  ~sparkplugb_arduino_mqtt(); // destructor, closes the socket if open
+
+  /*
+  @brief assign the packet buffers
+  @param tx transmit buffer, holds queued publishes; a PUBLISH must fit in it
+  to be encoded in place
+  @param tx_size size of the transmit buffer
+  @param rx receive buffer, larger incoming packets are dropped
+  @param rx_size size of the receive buffer
+  */
+  void begin(uint8_t* tx, size_t tx_size, uint8_t* rx, size_t rx_size);
+
+  /*
+  @brief use a custom transport
+  @param write writes bytes to the broker
+  @param read reads bytes from the broker without blocking
+  @param ctx passed to write and read
+  */
+  void set_transport(sparkplugb_arduino_mqtt_write write, sparkplugb_arduino_mqtt_read read, void* ctx);
+
+#ifdef ARDUINO
+  /*
+  @brief use an Arduino Client, which must already be connected to the broker
+  */
+  void set_client(Client* client);
+#endif
+
+  /*
+  @brief open a TCP connection to the broker and use it (POSIX hosts only)
+  @param host broker host name or address
+  @param port broker port, usually 1883
+  @return true on success
+  */
+  bool open(const char* host, uint16_t port);
+
+  /*
+  @brief close the socket opened by open()
+  */
+  void close();
+
+  /*
+  @brief set the function called for received messages
+  @param callback function to call, or NULL
+  @param ctx passed to callback
+  */
+  void set_callback(sparkplugb_arduino_mqtt_callback callback, void* ctx);
+
+  /*
+  @brief user name and password sent with CONNECT, NULL for none; the
+  strings must stay valid
+  */
+  void set_credentials(const char* username, const char* password);
+
+  /*
+  @brief register the NDEATH as last will, sent with CONNECT
+  @param topic NDEATH topic, NULL for no will
+  @param payload encoded NDEATH, which must stay valid until connect()
+  @param length payload size
+  */
+  void set_will(const char* topic, const uint8_t* payload, size_t length);
+
+  /*
+  @brief keep alive interval sent with CONNECT, 60 s by default, 0 disables it
+  */
+  void set_keep_alive(uint16_t seconds);
+
+  /*
+  @brief send CONNECT with clean session, as Sparkplug requires
+  @param client_id MQTT client id
+  @param now current time in ms
+  @return false if the transport failed or CONNECT does not fit in the
+  transmit buffer
+
+  The client is connected once loop() has received the CONNACK.
+  */
+  bool connect(const char* client_id, uint64_t now);
+
+  /*
+  @brief encode a payload and queue it as a QoS 0 PUBLISH
+  @param encoder encoder holding the payload
+  @param topic topic to publish to
+  @return false if not connected, or if the PUBLISH does not fit in the
+  transmit buffer even after flushing it
+  */
+  bool publish(sparkplugb_arduino_encoder* encoder, const char* topic);
+
+  /*
+  @brief queue an encoded payload as a QoS 0 PUBLISH
+  @param topic topic to publish to
+  @param payload encoded payload, e.g. from sparkplugb_arduino_birth_cache
+  @param length payload size
+  @param retain true to set the retain flag
+  @return false if not connected or the transport failed
+
+  The payload is copied into the transmit buffer, unless it does not fit:
+  it is then written to the transport directly, which blocks until done.
+  */
+  bool publish(const char* topic, const uint8_t* payload, size_t length, bool retain);
+
+  /*
+  @brief subscribe to a topic filter, e.g. spBv1.0/group/NCMD/node
+  @param filter topic filter
+  @param qos 0 or 1
+  @return false if not connected or the transport failed
+  */
+  bool subscribe(const char* filter, uint8_t qos);
+
+  /*
+  @brief write queued packets to the transport
+  @return false if the connection is lost; packets may remain queued when
+  the transport would block
+  */
+  bool flush();
+
+  /*
+  @brief write queued packets, handle received packets and keep alive
+  @param now current time in ms
+  @return false if not connected or connecting
+  */
+  bool loop(uint64_t now);
+
+  /*
+  @brief send DISCONNECT; the broker then drops the will, so publish the
+  NDEATH first
+  */
+  void disconnect();
+
+  /*
+  @brief SPARKPLUGB_MQTT_DISCONNECTED, _CONNECTING or _CONNECTED
+  */
+  uint8_t state();
+
+  /*
+  @brief true once CONNACK accepted the connection
+  */
+  bool connected();
+
+  /*
+  @brief bytes queued in the transmit buffer
+  */
+  size_t pending();
+private:
+  sparkplugb_arduino_mqtt_write write_fn;
+  sparkplugb_arduino_mqtt_read read_fn;
+  void* transport_ctx;
+  sparkplugb_arduino_mqtt_callback callback;
+  void* callback_ctx;
+  uint8_t* tx;
+  size_t tx_size;
+  size_t tx_start; // queued packets are tx[tx_start..tx_used)
+  size_t tx_used;
+  uint8_t* rx;
+  size_t rx_size;
+  size_t rx_used;
+  size_t rx_skip; // bytes left of a packet too large for rx
+  const char* username;
+  const char* password;
+  const char* will_topic;
+  const uint8_t* will_payload;
+  size_t will_length;
+  uint16_t keep_alive;
+  uint16_t packet_id;
+  uint8_t status;
+  bool ping_outstanding;
+  uint64_t wait_start; // when CONNECT or PINGREQ was sent
+  uint64_t last_out; // last time anything was written
+  uint64_t bytes_out; // bytes written to the transport
+  uint64_t bytes_out_seen; // bytes_out at the last loop()
+  int socket_fd;
+
+  bool encode_frame(sparkplugb_arduino_encoder* encoder, const char* topic, size_t topic_length);
+  bool make_room(size_t length);
+  bool write_all(const uint8_t* data, size_t length);
+  bool receive();
+  void handle(uint8_t type, uint8_t* body, size_t length);
+  void lost();
 };
 #endif
@@ -0,0 +1,329 @@
+/********************************************************************************
+ * Copyright 2020 Steward Observatory
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0.
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ ********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <payload_log.h>
+
+#define PAYLOAD_LOG_DEFAULT_INTERVAL 1024
+// the file grows by at least this much at a time
+#define PAYLOAD_LOG_GROW_BYTES (4u << 20)
+// records are padded to this size
+#define PAYLOAD_LOG_ALIGN 8
+
+static size_t align_record(size_t size) {
+	return (size + PAYLOAD_LOG_ALIGN - 1) & ~(size_t)(PAYLOAD_LOG_ALIGN - 1);
+}
+
+// Grow the file and its mapping so that at least need bytes are mapped
+static int grow_map(payload_log_writer_t *log, size_t need) {
+	size_t length = log->map_length;
+	uint8_t *map;
+
+	if (need <= length) {
+		return 0;
+	}
+	while (length < need) {
+		length += (length < PAYLOAD_LOG_GROW_BYTES) ? PAYLOAD_LOG_GROW_BYTES : length;
+	}
+	if (ftruncate(log->fd, length) != 0) {
+		return -1;
+	}
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	if (log->map != NULL) {
+		munmap(log->map, log->map_length);
+	}
+	log->map = map;
+	log->map_length = length;
+	return 0;
+}
+
+// Reserve a record at the end of the log, returns its offset or 0 on failure
+static size_t begin_record(payload_log_writer_t *log, size_t size) {
+	payload_log_file_header_t *header = (payload_log_file_header_t *)log->map;
+	size_t offset = header->data_end;
+
+	if (grow_map(log, offset + size) != 0) {
+		return 0;
+	}
+	return offset;
+}
+
+// Make a record written at offset visible to readers
+static void commit_record(payload_log_writer_t *log, size_t offset, size_t size) {
+	payload_log_file_header_t *header = (payload_log_file_header_t *)log->map;
+	__atomic_store_n(&header->data_end, (uint64_t)(offset + size), __ATOMIC_RELEASE);
+}
+
+// Write an index record for the payload records since the previous one
+static int write_index(payload_log_writer_t *log) {
+	payload_log_file_header_t *header;
+	payload_log_record_header_t *record;
+	size_t body = sizeof(uint64_t) + log->pending * sizeof(payload_log_index_entry_t);
+	size_t size = align_record(sizeof(*record) + body);
+	size_t offset;
+	uint64_t prev;
+
+	if (log->pending == 0) {
+		return 0;
+	}
+	offset = begin_record(log, size);
+	if (offset == 0) {
+		return -1;
+	}
+	header = (payload_log_file_header_t *)log->map;
+	record = (payload_log_record_header_t *)(log->map + offset);
+	memset(record, 0, size);
+	record->size = size;
+	record->type = PAYLOAD_LOG_RECORD_INDEX;
+	record->payload_length = body;
+	record->timestamp = log->entries[0].timestamp;
+	prev = header->last_index;
+	memcpy(record + 1, &prev, sizeof(prev));
+	memcpy((uint8_t *)(record + 1) + sizeof(prev), log->entries,
+		   log->pending * sizeof(payload_log_index_entry_t));
+	commit_record(log, offset, size);
+	header->last_index = offset;
+	log->pending = 0;
+	return 0;
+}
+
+int payload_log_create(payload_log_writer_t *log, const char *path, uint32_t index_interval) {
+	payload_log_file_header_t *header;
+
+	memset(log, 0, sizeof(*log));
+	log->index_interval = index_interval ? index_interval : PAYLOAD_LOG_DEFAULT_INTERVAL;
+	log->entries = malloc(log->index_interval * sizeof(payload_log_index_entry_t));
+	if (log->entries == NULL) {
+		return -1;
+	}
+	log->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (log->fd < 0 || grow_map(log, sizeof(payload_log_file_header_t)) != 0) {
+		payload_log_close(log);
+		return -1;
+	}
+
+	header = (payload_log_file_header_t *)log->map;
+	memcpy(header->magic, PAYLOAD_LOG_MAGIC, sizeof(header->magic));
+	header->header_size = sizeof(*header);
+	header->index_interval = log->index_interval;
+	header->data_end = sizeof(*header);
+	return 0;
+}
+
+int payload_log_append(payload_log_writer_t *log, const char *topic,
+					   const void *payload, size_t length, uint64_t timestamp) {
+	payload_log_file_header_t *header;
+	payload_log_record_header_t *record;
+	size_t topic_length = (topic == NULL) ? 0 : strlen(topic);
+	size_t used = sizeof(*record) + topic_length + length;
+	size_t size = align_record(used);
+	size_t offset;
+
+	if (log->map == NULL || topic_length > 0xFFFF || length > 0xFFFFFFFFu - sizeof(*record) - 0xFFFF) {
+		return -1;
+	}
+	offset = begin_record(log, size);
+	if (offset == 0) {
+		return -1;
+	}
+	header = (payload_log_file_header_t *)log->map;
+	record = (payload_log_record_header_t *)(log->map + offset);
+	record->size = size;
+	record->type = PAYLOAD_LOG_RECORD_PAYLOAD;
+	record->topic_length = topic_length;
+	record->payload_length = length;
+	record->reserved = 0;
+	record->timestamp = timestamp;
+	memcpy(record + 1, topic, topic_length);
+	memcpy((uint8_t *)(record + 1) + topic_length, payload, length);
+	memset((uint8_t *)record + used, 0, size - used);
+	commit_record(log, offset, size);
+	header->record_count++;
+
+	log->entries[log->pending].offset = offset;
+	log->entries[log->pending].timestamp = timestamp;
+	log->pending++;
+	if (log->pending == log->index_interval) {
+		return write_index(log);
+	}
+	return 0;
+}
+
+int payload_log_close(payload_log_writer_t *log) {
+	int result = 0;
+	size_t end = 0;
+
+	if (log->map != NULL) {
+		result = write_index(log);
+		end = ((payload_log_file_header_t *)log->map)->data_end;
+		munmap(log->map, log->map_length);
+	}
+	if (log->fd >= 0) {
+		// drop the unused tail left by grow_map()
+		if (end != 0 && ftruncate(log->fd, end) != 0) {
+			result = -1;
+		}
+		close(log->fd);
+	}
+	free(log->entries);
+	memset(log, 0, sizeof(*log));
+	log->fd = -1;
+	return result;
+}
+
+uint64_t payload_log_timestamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int payload_log_open(payload_log_reader_t *reader, const char *path) {
+	const payload_log_file_header_t *header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(reader, 0, sizeof(*reader));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(payload_log_file_header_t)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	header = (const payload_log_file_header_t *)map;
+	if (memcmp(header->magic, PAYLOAD_LOG_MAGIC, sizeof(header->magic)) != 0 ||
+		header->header_size < sizeof(*header) || header->header_size > (size_t)st.st_size) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	reader->map = map;
+	reader->map_length = st.st_size;
+	reader->end = __atomic_load_n(&header->data_end, __ATOMIC_ACQUIRE);
+	if (reader->end > reader->map_length) {
+		reader->end = reader->map_length;
+	}
+	reader->last_index = header->last_index;
+	reader->record_count = header->record_count;
+	reader->position = header->header_size;
+	return 0;
+}
+
+// Validate the record at offset, NULL if it runs past the end of the log
+static const payload_log_record_header_t *record_at(const payload_log_reader_t *reader, size_t offset) {
+	const payload_log_record_header_t *record;
+
+	if (offset % PAYLOAD_LOG_ALIGN != 0 || offset > reader->end ||
+		reader->end - offset < sizeof(*record)) {
+		return NULL;
+	}
+	record = (const payload_log_record_header_t *)(reader->map + offset);
+	if (record->size < sizeof(*record) || record->size > reader->end - offset ||
+		(size_t)record->topic_length + record->payload_length > record->size - sizeof(*record)) {
+		return NULL;
+	}
+	return record;
+}
+
+int payload_log_next(payload_log_reader_t *reader, payload_log_record_t *record) {
+	const payload_log_record_header_t *header;
+
+	while (reader->position < reader->end) {
+		header = record_at(reader, reader->position);
+		if (header == NULL) {
+			return -1;
+		}
+		reader->position += header->size;
+		if (header->type != PAYLOAD_LOG_RECORD_PAYLOAD) {
+			continue;
+		}
+		record->topic = (const char *)(header + 1);
+		record->topic_length = header->topic_length;
+		record->payload = (const uint8_t *)(header + 1) + header->topic_length;
+		record->payload_length = header->payload_length;
+		record->timestamp = header->timestamp;
+		return 1;
+	}
+	return 0;
+}
+
+int payload_log_seek(payload_log_reader_t *reader, uint64_t timestamp) {
+	const payload_log_file_header_t *file = (const payload_log_file_header_t *)reader->map;
+	const payload_log_record_header_t *index;
+	payload_log_index_entry_t first;
+	payload_log_record_t record;
+	uint64_t offset = reader->last_index;
+	uint64_t prev;
+	size_t start = file->header_size;
+	size_t position;
+	int result;
+
+	// walk back through the index records to the block holding the time
+	while (offset != 0) {
+		index = record_at(reader, offset);
+		if (index == NULL || index->type != PAYLOAD_LOG_RECORD_INDEX ||
+			index->payload_length < sizeof(prev) + sizeof(first)) {
+			return -1;
+		}
+		memcpy(&prev, index + 1, sizeof(prev));
+		memcpy(&first, (const uint8_t *)(index + 1) + sizeof(prev), sizeof(first));
+		if (first.timestamp <= timestamp) {
+			start = first.offset;
+			break;
+		}
+		if (prev >= offset) {
+			return -1;
+		}
+		offset = prev;
+	}
+
+	// then scan forward to the first payload at or after the time
+	reader->position = start;
+	for (;;) {
+		position = reader->position;
+		result = payload_log_next(reader, &record);
+		if (result <= 0) {
+			return result;
+		}
+		if (record.timestamp >= timestamp) {
+			reader->position = position;
+			return 0;
+		}
+	}
+}
+
+void payload_log_rewind(payload_log_reader_t *reader) {
+	if (reader->map != NULL) {
+		reader->position = ((const payload_log_file_header_t *)reader->map)->header_size;
+	}
+}
+
+void payload_log_release(payload_log_reader_t *reader) {
+	if (reader->map != NULL) {
+		munmap((void *)reader->map, reader->map_length);
+	}
+	memset(reader, 0, sizeof(*reader));
+}
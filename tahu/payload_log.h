@@ -0,0 +1,168 @@
+/********************************************************************************
+ * Copyright 2020 Steward Observatory
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0.
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ ********************************************************************************/
+
+/*
+ * Append-only log of received Sparkplug payloads, for capture and replay on a
+ * host (POSIX, mmap).
+ *
+ * File layout, all integers little endian as written by the host:
+ *   header   64 bytes, see payload_log_file_header_t
+ *   records  each a payload_log_record_header_t, then the topic and payload
+ *            bytes, padded to a multiple of 8 bytes
+ *
+ * Every index_interval payload records the writer adds an index record
+ * holding the offset and timestamp of each of those payloads and the offset
+ * of the previous index record, so a reader can seek by time without scanning
+ * the whole log. header.data_end only covers complete records, so a log cut
+ * short by a crash is still readable up to its last complete record.
+ */
+
+#ifndef _PAYLOAD_LOG_H_
+#define _PAYLOAD_LOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PAYLOAD_LOG_MAGIC "SPBLOG01"
+#define PAYLOAD_LOG_RECORD_PAYLOAD 1
+#define PAYLOAD_LOG_RECORD_INDEX 2
+
+typedef struct {
+	char magic[8];			// PAYLOAD_LOG_MAGIC
+	uint32_t header_size;	// offset of the first record
+	uint32_t index_interval;	// payload records per index record
+	uint64_t data_end;		// end of the last complete record
+	uint64_t record_count;	// payload records in the log
+	uint64_t last_index;	// offset of the last index record, 0 if none
+	uint8_t reserved[24];
+} payload_log_file_header_t;
+
+typedef struct {
+	uint32_t size;			// whole record including header and padding
+	uint16_t type;			// PAYLOAD_LOG_RECORD_*
+	uint16_t topic_length;	// topic bytes following the header
+	uint32_t payload_length;	// payload bytes following the topic
+	uint32_t reserved;
+	uint64_t timestamp;		// receive time, ns since Jan 1, 1970 UTC
+} payload_log_record_header_t;
+
+typedef struct {
+	uint64_t offset;		// offset of a payload record
+	uint64_t timestamp;		// its receive time
+} payload_log_index_entry_t;
+
+typedef struct {
+	int fd;
+	uint8_t *map;
+	size_t map_length;
+	uint32_t index_interval;
+	uint32_t pending;		// payload records since the last index record
+	payload_log_index_entry_t *entries;
+} payload_log_writer_t;
+
+typedef struct {
+	const char *topic;		// not NUL terminated
+	size_t topic_length;
+	const uint8_t *payload;
+	size_t payload_length;
+	uint64_t timestamp;		// receive time, ns since Jan 1, 1970 UTC
+} payload_log_record_t;
+
+typedef struct {
+	const uint8_t *map;
+	size_t map_length;
+	size_t position;		// offset of the next record
+	size_t end;				// end of the last complete record
+	uint64_t last_index;
+	uint64_t record_count;
+} payload_log_reader_t;
+
+/**
+ * Create a new log, replacing any existing file
+ *
+ * @param log       Writer to initialize
+ * @param path      File to create
+ * @param index_interval
+ *                  Payload records per index record, 0 for the default of 1024
+ *
+ * @return Returns 0 on success, or -1 on failure
+ */
+int payload_log_create(payload_log_writer_t *log, const char *path, uint32_t index_interval);
+
+/**
+ * Append one received payload to the log
+ *
+ * @param log       Writer returned by payload_log_create()
+ * @param topic     MQTT topic the payload arrived on
+ * @param payload   Encoded Sparkplug payload
+ * @param length    Size of the payload in bytes
+ * @param timestamp Receive time in ns, see payload_log_timestamp()
+ *
+ * @return Returns 0 on success, or -1 on failure
+ */
+int payload_log_append(payload_log_writer_t *log, const char *topic,
+					   const void *payload, size_t length, uint64_t timestamp);
+
+/**
+ * Write the pending index, trim the file and release the writer
+ *
+ * @return Returns 0 on success, or -1 on failure
+ */
+int payload_log_close(payload_log_writer_t *log);
+
+/**
+ * Get the current time in ns since Jan 1, 1970 UTC, for payload_log_append()
+ */
+uint64_t payload_log_timestamp(void);
+
+/**
+ * Map an existing log for reading
+ *
+ * @return Returns 0 on success, or -1 if the file is missing or not a log
+ */
+int payload_log_open(payload_log_reader_t *reader, const char *path);
+
+/**
+ * Get the next payload record
+ *
+ * <p>The record points into the mapped file, it stays valid until
+ * payload_log_release() is called.
+ *
+ * @return Returns 1 if a record was read, 0 at the end of the log, or -1 if
+ *         the log is corrupt
+ */
+int payload_log_next(payload_log_reader_t *reader, payload_log_record_t *record);
+
+/**
+ * Position the reader at the first payload received at or after a time
+ *
+ * @return Returns 0 on success, or -1 if the index is corrupt
+ */
+int payload_log_seek(payload_log_reader_t *reader, uint64_t timestamp);
+
+/**
+ * Position the reader at the first record
+ */
+void payload_log_rewind(payload_log_reader_t *reader);
+
+/**
+ * Unmap a log opened with payload_log_open()
+ */
+void payload_log_release(payload_log_reader_t *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -326,7 +326,22 @@ int free_payload(org_eclipse_tahu_protobuf_Payload *payload) {
 	return 0;
 }
 
-uint64_t get_current_timestamp() {
+// Settings read by every thread that stamps payloads; relaxed atomics are
+// enough since each is a single value that publishes no other data
+static uint64_t (*timestamp_source)(void) = get_realtime_timestamp;
+static bool timestamp_cached;
+static uint64_t cached_timestamp;
+
+static uint64_t read_timestamp_source(void) {
+	uint64_t (*source)(void) = __atomic_load_n(&timestamp_source, __ATOMIC_RELAXED);
+	return source();
+}
+
+static bool is_timestamp_cached(void) {
+	return __atomic_load_n(&timestamp_cached, __ATOMIC_RELAXED);
+}
+
+uint64_t get_realtime_timestamp(void) {
 	// Set the timestamp
 	struct timespec ts;
 #ifdef __MACH__ // OS X does not have clock_gettime, use clock_get_time
@@ -343,23 +358,64 @@ uint64_t get_current_timestamp() {
 	return ts.tv_sec * UINT64_C(1000) + ts.tv_nsec / 1000000;
 }
 
+uint64_t get_coarse_timestamp(void) {
+#ifdef CLOCK_REALTIME_COARSE
+	// Updated once per kernel tick and read without a system call
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return ts.tv_sec * UINT64_C(1000) + ts.tv_nsec / 1000000;
+#else
+	return get_realtime_timestamp();
+#endif
+}
+
+void set_timestamp_source(uint64_t (*source)(void)) {
+	__atomic_store_n(&timestamp_source, (source == NULL) ? get_realtime_timestamp : source,
+					 __ATOMIC_RELAXED);
+	if (is_timestamp_cached()) {
+		refresh_cached_timestamp();
+	}
+}
+
+void set_cached_timestamp(bool enable) {
+	if (enable) {
+		refresh_cached_timestamp();
+	}
+	__atomic_store_n(&timestamp_cached, enable, __ATOMIC_RELAXED);
+}
+
+uint64_t refresh_cached_timestamp(void) {
+	uint64_t timestamp = read_timestamp_source();
+	__atomic_store_n(&cached_timestamp, timestamp, __ATOMIC_RELAXED);
+	return timestamp;
+}
+
+uint64_t get_current_timestamp() {
+	if (is_timestamp_cached()) {
+		return __atomic_load_n(&cached_timestamp, __ATOMIC_RELAXED);
+	}
+	return read_timestamp_source();
+}
+
 void reset_sparkplug_sequence(void) {
-	payload_sequence = 0;
+	__atomic_store_n(&payload_sequence, 0, __ATOMIC_RELAXED);
 }
 
 int get_next_payload(org_eclipse_tahu_protobuf_Payload *payload) {
 
 	// Initialize payload
-	DEBUG_PRINT("Current Sequence Number: %u\n", payload_sequence);
 	memset(payload, 0, sizeof(org_eclipse_tahu_protobuf_Payload));
 	payload->has_timestamp = true;
-	payload->timestamp = get_current_timestamp();
+	// A new payload starts a new publish batch, so this is where the cached
+	// timestamp is refreshed; the metrics added to it reuse the value
+	payload->timestamp = is_timestamp_cached() ? refresh_cached_timestamp() : get_current_timestamp();
 	payload->has_seq = true;
-	payload->seq = payload_sequence;
 
-	// Increment/wrap the sequence number (stored in a U8, so it
-	// will wrap 255-to-0 automatically)
-	payload_sequence++;
+	// Take and increment/wrap the sequence number in one atomic step, so
+	// that threads never share a number (stored in a U8, so it will wrap
+	// 255-to-0 automatically)
+	payload->seq = __atomic_fetch_add(&payload_sequence, 1, __ATOMIC_RELAXED);
+	DEBUG_PRINT("Current Sequence Number: %u\n", (unsigned int)payload->seq);
 	return 0;
 }
 
@@ -24,8 +24,10 @@
 #ifndef _SPARKPLUGLIB_H_
 #define _SPARKPLUGLIB_H_
 
-// Enable/disable debug messages
+// Enable/disable debug messages (define SPARKPLUG_NO_DEBUG to disable)
+#ifndef SPARKPLUG_NO_DEBUG
 #define SPARKPLUG_DEBUG 1
+#endif
 
 #ifdef SPARKPLUG_DEBUG
 #define DEBUG_PRINT(...) printf(__VA_ARGS__)
@@ -323,10 +325,59 @@ int free_payload(org_eclipse_tahu_protobuf_Payload *payload);
 /**
  * Get the current timestamp in milliseconds (format used inside SparkPlug payloads)
  *
+ * <p>Reads the source set with set_timestamp_source(), or returns the cached
+ * value if set_cached_timestamp() enabled the cache.
+ *
  * @return The current timestamp in milliseconds since Jan 1, 1970 UTC.
  */
 uint64_t get_current_timestamp(void);
 
+/**
+ * Read CLOCK_REALTIME, the default timestamp source
+ *
+ * @return The current timestamp in milliseconds since Jan 1, 1970 UTC.
+ */
+uint64_t get_realtime_timestamp(void);
+
+/**
+ * Read CLOCK_REALTIME_COARSE where available (one kernel tick resolution,
+ * no system call), otherwise CLOCK_REALTIME
+ *
+ * @return The current timestamp in milliseconds since Jan 1, 1970 UTC.
+ */
+uint64_t get_coarse_timestamp(void);
+
+/**
+ * Set the clock read by get_current_timestamp()
+ *
+ * <p>May be called while other threads stamp payloads; each of them then
+ * reads either the old or the new source.
+ *
+ * @param source Function returning ms since Jan 1, 1970 UTC, e.g.
+ *               get_coarse_timestamp, or NULL for get_realtime_timestamp
+ */
+void set_timestamp_source(uint64_t (*source)(void));
+
+/**
+ * Enable or disable the cached timestamp
+ *
+ * <p>While enabled, get_current_timestamp() returns the value read by the
+ * last refresh_cached_timestamp() instead of reading the clock, so stamping
+ * every metric of a payload costs a single clock read. get_next_payload()
+ * refreshes the cache for each new payload. Threads stamping payloads at
+ * the same time switch to the new setting with their next read.
+ *
+ * @param enable true to cache the timestamp
+ */
+void set_cached_timestamp(bool enable);
+
+/**
+ * Read the timestamp source into the cache, e.g. at the start of a batch
+ *
+ * @return The new cached timestamp
+ */
+uint64_t refresh_cached_timestamp(void);
+
 /**
  * Reset the sequence number to 0.
  *